@@ -0,0 +1,286 @@
+// Micro benchmarks of the library hot paths: metric updates and family lookups from 1 to N threads,
+// and scrapes of families of 1k to 1M series. Build and options are described in README.md.
+#include "oura_prometheus.hpp"
+#include "oura_prometheus_shared.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace oura_prometheus;
+
+//////////////////////////////////////////////////////
+//// ALLOCATIONS COUNTING
+//////////////////////////////////////////////////////
+
+static std::atomic<std::uint64_t> allocations_count(0);
+
+// Replacements of new and delete are built on malloc and free, which gcc reports once they are inlined
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    allocations_count.fetch_add(1, std::memory_order_relaxed);
+    if(void* pointer = std::malloc(size == 0 ? 1 : size))
+    {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+//////////////////////////////////////////////////////
+//// BENCHMARK RUNNER
+//////////////////////////////////////////////////////
+
+struct Options
+{
+    std::size_t max_threads = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+    std::size_t max_series = 1000000;
+    std::size_t iterations = 1000000;
+    std::string filter;
+};
+
+// Operations benchmarked are given the index of the calling thread and of the iteration.
+// Runs operation iterations times on each of threads threads, returns the elapsed nanoseconds
+template <typename Function>
+double run_threads(const std::size_t threads, const std::size_t iterations, const Function& operation)
+{
+    std::atomic<std::size_t> ready(0);
+    std::atomic<bool> start(false);
+    std::vector<std::thread> workers;
+    for(std::size_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t](){
+            ready.fetch_add(1);
+            while(!start.load(std::memory_order_acquire))
+            {
+                std::this_thread::yield();
+            }
+            for(std::size_t i = 0; i < iterations; i++)
+            {
+                operation(t, i);
+            }
+        });
+    }
+    while(ready.load() != threads)
+    {
+        std::this_thread::yield();
+    }
+    const auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    for(auto& worker : workers)
+    {
+        worker.join();
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+}
+
+// Allocations made by one call of operation on average, measured on a single thread
+template <typename Function>
+double allocations_per_call(const std::size_t iterations, const Function& operation)
+{
+    const std::uint64_t before = allocations_count.load();
+    for(std::size_t i = 0; i < iterations; i++)
+    {
+        operation(0, i);
+    }
+    return static_cast<double>(allocations_count.load() - before) / iterations;
+}
+
+// Prints ns/op (time per operation seen by each thread) and the overall throughput for 1, 2, 4 ... max_threads threads
+template <typename Function>
+void benchmark_update(const Options& options, const char* name, const Function& operation)
+{
+    if(!options.filter.empty() && std::strstr(name, options.filter.c_str()) == nullptr)
+    {
+        return;
+    }
+    const double allocations = allocations_per_call(std::min<std::size_t>(options.iterations, 10000), operation);
+    for(std::size_t threads = 1;; threads = std::min(threads * 2, options.max_threads))
+    {
+        const double elapsed = run_threads(threads, options.iterations, operation);
+        std::printf("%-32s %8zu %12.2f %12.2f %12.2f\n", name, threads, elapsed / options.iterations,
+                    threads * options.iterations * 1e3 / elapsed, allocations);
+        if(threads == options.max_threads)
+        {
+            break;
+        }
+    }
+}
+
+// Label value of a series index
+std::string series_label(const std::size_t index)
+{
+    return "series_" + std::to_string(index);
+}
+
+// Prints the latency of scrapes of a single family holding series children, for each serializer
+void benchmark_scrape(const Options& options, const std::size_t series)
+{
+    if(!options.filter.empty() && std::strstr("scrape", options.filter.c_str()) == nullptr)
+    {
+        return;
+    }
+    std::shared_ptr<CounterFamily> family = std::make_shared<CounterFamily>("bench_requests_total", "Requests", std::set<std::string>{"code", "path"});
+    for(std::size_t i = 0; i < series; i++)
+    {
+        family->with_labels(std::to_string(200 + i % 5), series_label(i))->inc();
+    }
+    const MetricsSnapshot metrics = {{family->get_name(), family}};
+
+    TextSerializer text_serializer;
+    TextSerializer parallel_text_serializer(options.max_threads);
+    CachingTextSerializer caching_text_serializer;
+    OpenMetricsSerializer open_metrics_serializer;
+    ProtobufSerializer protobuf_serializer;
+    const std::pair<const char*, Serializer*> serializers[] = {
+        {"text", &text_serializer}, {"text_parallel", &parallel_text_serializer},
+        {"text_cached", &caching_text_serializer},
+        {"openmetrics", &open_metrics_serializer}, {"protobuf", &protobuf_serializer}};
+    for(const auto& serializer : serializers)
+    {
+        // The first scrape sizes the buffer, the next ones measure serialization alone
+        std::string buffer;
+        serializer.second->serialize(buffer, metrics);
+        const std::size_t scrapes = std::max<std::size_t>(1, 1000000 / series);
+        const std::uint64_t allocations_before = allocations_count.load();
+        const auto begin = std::chrono::steady_clock::now();
+        for(std::size_t i = 0; i < scrapes; i++)
+        {
+            buffer.clear();
+            serializer.second->serialize(buffer, metrics);
+        }
+        const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        std::printf("scrape %-25s %8zu %12.3f %12zu %12.2f\n", serializer.first, series, elapsed / scrapes, buffer.size(),
+                    static_cast<double>(allocations_count.load() - allocations_before) / scrapes);
+    }
+}
+
+//////////////////////////////////////////////////////
+//// BENCHMARKS
+//////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        const std::string option = argv[i];
+        if(option == "--threads")
+        {
+            options.max_threads = std::max<std::size_t>(1, std::strtoull(argv[i + 1], nullptr, 10));
+        }
+        else if(option == "--series")
+        {
+            options.max_series = std::strtoull(argv[i + 1], nullptr, 10);
+        }
+        else if(option == "--iterations")
+        {
+            options.iterations = std::max<std::size_t>(1, std::strtoull(argv[i + 1], nullptr, 10));
+        }
+        else if(option == "--filter")
+        {
+            options.filter = argv[i + 1];
+        }
+        else
+        {
+            std::fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    std::printf("%-32s %8s %12s %12s %12s\n", "update", "threads", "ns/op", "Mops/s", "allocs/op");
+
+    Counter atomic_counter(CounterStorage::Atomic);
+    benchmark_update(options, "counter_inc", [&](std::size_t, std::size_t){atomic_counter.inc();});
+
+    Counter sharded_counter(CounterStorage::Sharded);
+    benchmark_update(options, "counter_inc_sharded", [&](std::size_t, std::size_t){sharded_counter.inc();});
+
+    Gauge gauge;
+    benchmark_update(options, "gauge_set", [&](std::size_t, std::size_t i){gauge.set(static_cast<double>(i));});
+    benchmark_update(options, "gauge_inc", [&](std::size_t, std::size_t){gauge.inc();});
+
+    Histogram histogram;
+    benchmark_update(options, "histogram_observe", [&](std::size_t, std::size_t i){histogram.observe((i % 1000) * 0.01);});
+    const std::string trace_id = "4bf92f3577b34da6a3ce929d0e0e4736";
+    benchmark_update(options, "histogram_observe_exemplar", [&](std::size_t, std::size_t i){
+        histogram.observe((i % 1000) * 0.01, {{"trace_id", trace_id}});
+    });
+
+    // Accumulators are per thread, flushed when full or when their thread exits
+    std::shared_ptr<Counter> shared_counter = std::make_shared<Counter>();
+    benchmark_update(options, "local_counter_inc", [&](std::size_t, std::size_t){
+        thread_local LocalCounter local(shared_counter);
+        local.inc();
+    });
+    std::shared_ptr<Histogram> shared_histogram = std::make_shared<Histogram>();
+    benchmark_update(options, "local_histogram_observe", [&](std::size_t, std::size_t i){
+        thread_local LocalHistogram local(shared_histogram);
+        local.observe((i % 1000) * 0.01);
+    });
+
+    benchmark_update(options, "scoped_timer", [&](std::size_t, std::size_t){ScopedTimer timer(histogram);});
+#if defined(__x86_64__) || defined(__i386__)
+    TscClock::seconds_per_tick();
+    benchmark_update(options, "scoped_timer_tsc", [&](std::size_t, std::size_t){TscScopedTimer timer(histogram);});
+#endif
+
+    // Updates of shared memory slots, as made by pre-forked workers
+    SharedRegistry shared_registry(1);
+    SharedCounter shared_memory_counter = shared_registry.counter("bench_shared_total", "Shared counter");
+    benchmark_update(options, "shared_counter_inc", [&](std::size_t, std::size_t){shared_memory_counter.inc();});
+    SharedHistogram shared_memory_histogram = shared_registry.histogram("bench_shared_seconds", "Shared histogram");
+    benchmark_update(options, "shared_histogram_observe", [&](std::size_t, std::size_t i){shared_memory_histogram.observe((i % 1000) * 0.01);});
+
+    NativeHistogram native_histogram;
+    benchmark_update(options, "native_histogram_observe", [&](std::size_t, std::size_t i){native_histogram.observe((i % 1000) * 0.01 + 0.001);});
+
+    Summary summary;
+    benchmark_update(options, "summary_observe", [&](std::size_t, std::size_t i){summary.observe((i % 1000) * 0.01 + 0.001);});
+
+    // Lookups of existing children, each thread going through 100 of them
+    CounterFamily family("bench_family", "Family lookups", {"code", "path"});
+    std::vector<std::string> paths;
+    for(std::size_t i = 0; i < 100; i++)
+    {
+        paths.push_back(series_label(i));
+        family.with_labels("200", paths.back());
+    }
+    benchmark_update(options, "family_with_labels", [&](std::size_t t, std::size_t i){
+        family.with_labels("200", paths[(t * 7 + i) % paths.size()])->inc();
+    });
+    std::vector<std::set<Label>> label_sets;
+    for(const auto& path : paths)
+    {
+        label_sets.push_back({{"code", "200"}, {"path", path}});
+    }
+    benchmark_update(options, "family_labels", [&](std::size_t t, std::size_t i){
+        family.labels(label_sets[(t * 7 + i) % label_sets.size()])->inc();
+    });
+
+    std::printf("\n%-32s %8s %12s %12s %12s\n", "scrape", "series", "ms/scrape", "bytes", "allocs/scrape");
+    for(std::size_t series = 1000; series <= options.max_series; series *= 10)
+    {
+        benchmark_scrape(options, series);
+    }
+    return 0;
+}
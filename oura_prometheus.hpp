@@ -5,12 +5,39 @@
 #include <atomic>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <memory>
+#include <new>
 #include <sstream>
 #include <limits>
 #include <stdexcept>
-#include <regex>
 #include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <type_traits>
+#include <tuple>
+#include <chrono>
+#include <ostream>
+#if __cplusplus >= 201703L
+#include <charconv>
+#include <string_view>
+#include <utility>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 namespace oura_prometheus
 {
@@ -30,14 +57,23 @@ namespace oura_prometheus
             change(d.load());
         }
 
-        atomic_double& operator+=(const atomic_double& value)
+        atomic_double& operator+=(const double value)
         {
-            return change(this->load() + value);
+            add(value);
+            return *this;
+        }
+
+        atomic_double& operator-=(const double value)
+        {
+            add(-value);
+            return *this;
         }
 
-        atomic_double& operator-=(const atomic_double& value)
+        // The sum is computed from the value the exchange compares with, so that no concurrent change is lost
+        void add(const double value)
         {
-            return change(this->load() - value);
+            double current = this->load(std::memory_order_relaxed);
+            while(!this->compare_exchange_weak(current, current + value, std::memory_order_relaxed));
         }
 
         atomic_double& change(double target_value)
@@ -47,6 +83,121 @@ namespace oura_prometheus
         }
     };
 
+    // Size used to pad per-thread data so that two slots never share a cache line
+    constexpr std::size_t cache_line_size = 64;
+
+    // Index of the calling thread, assigned round robin the first time each thread asks for it
+    inline std::size_t thread_slot()
+    {
+        static std::atomic<std::size_t> next_slot(0);
+        thread_local std::size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+        return slot;
+    }
+
+    // Coarse clock of updates, advanced by each expiry sweep of a family, see MetricFamily::remove_expired
+    inline std::atomic<std::uint32_t>& touch_clock()
+    {
+        static std::atomic<std::uint32_t> epoch(0);
+        return epoch;
+    }
+
+    // Epoch of touch_clock in which a metric was last updated. It is only written once per epoch,
+    // updates of several threads mostly read it.
+    class TouchEpoch
+    {
+    public:
+        void touch()
+        {
+            const std::uint32_t epoch = touch_clock().load(std::memory_order_relaxed);
+            if(_epoch.load(std::memory_order_relaxed) != epoch)
+            {
+                _epoch.store(epoch, std::memory_order_relaxed);
+            }
+        }
+
+        // Whether the metric was updated in epoch or after it
+        bool since(const std::uint32_t epoch) const
+        {
+            return static_cast<std::int32_t>(_epoch.load(std::memory_order_relaxed) - epoch) >= 0;
+        }
+
+    private:
+        std::atomic<std::uint32_t> _epoch = {0};
+    };
+
+    // Seconds since the unix epoch, as exposed by _created samples
+    inline double unix_time()
+    {
+        return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Double value split into cache line padded shards, each thread adding into its own shard.
+    // Reading sums all shards, so it suits values written often and read rarely (on scrape).
+    class sharded_double
+    {
+    public:
+        explicit sharded_double(const double initial_value = 0, const std::size_t shards_count = default_shards_count())
+            : _shards(new Shard[round_up_power_of_two(shards_count)]), _mask(round_up_power_of_two(shards_count) - 1)
+        {
+            for(std::size_t i = 0; i <= _mask; i++)
+            {
+                _shards[i].value.store(0, std::memory_order_relaxed);
+            }
+            _shards[0].value.store(initial_value, std::memory_order_relaxed);
+        }
+
+        void add(const double value)
+        {
+            // Shards are only shared when there are more threads than shards, CAS keeps them exact
+            std::atomic<double>& shard = _shards[thread_slot() & _mask].value;
+            double current = shard.load(std::memory_order_relaxed);
+            while(!shard.compare_exchange_weak(current, current + value, std::memory_order_relaxed));
+        }
+
+        double load() const
+        {
+            double sum = 0;
+            for(std::size_t i = 0; i <= _mask; i++)
+            {
+                sum += _shards[i].value.load(std::memory_order_relaxed);
+            }
+            return sum;
+        }
+
+        std::size_t shards_count() const
+        {
+            return _mask + 1;
+        }
+
+        static std::size_t default_shards_count()
+        {
+            const std::size_t hardware_threads = std::thread::hardware_concurrency();
+            return hardware_threads == 0 ? 1 : hardware_threads;
+        }
+
+    private:
+        static std::size_t round_up_power_of_two(const std::size_t value)
+        {
+            std::size_t result = 1;
+            while(result < value)
+            {
+                result <<= 1;
+            }
+            return result;
+        }
+
+        // Padded to two cache lines: new[] does not honor over-alignment before c++17,
+        // so this is what guarantees that two shard values never land on the same line
+        struct Shard
+        {
+            std::atomic<double> value;
+            char padding[2 * cache_line_size - sizeof(std::atomic<double>)];
+        };
+
+        std::unique_ptr<Shard[]> _shards;
+        const std::size_t _mask;
+    };
+
     // Enumeration that list all prometheus available metric types
     // (https://prometheus.io/docs/concepts/metric_types/)
     enum class MetricType
@@ -58,7 +209,7 @@ namespace oura_prometheus
     };
 
     // Conversion function of a metric type value to it's string representation
-    std::string metric_type_to_string(MetricType type)
+    inline std::string metric_type_to_string(MetricType type)
     {
         std::string value = "";
         switch (type)
@@ -79,17 +230,78 @@ namespace oura_prometheus
         return value;
     }
 
-    const std::regex name_format_regex("[a-zA-Z_:][a-zA-Z0-9_:]*");
-    void check_name_format(const std::string& name)
+    // Classes of the chars allowed in names
+    constexpr unsigned char label_name_char = 1;
+    constexpr unsigned char metric_name_char = 2;
+    constexpr unsigned char digit_char = 4;
+
+    // Classes of each char value, 0 for chars not allowed in names: letters and _ are allowed in
+    // all names, digits too but not first, and : in metric names only
+    constexpr unsigned char name_chars_classes[256] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 2, 0, 0, 0, 0, 0,
+        0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+        3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 3,
+        0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+        3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 0};
+
+    constexpr unsigned char name_char_class(const char c)
+    {
+        return name_chars_classes[static_cast<unsigned char>(c)];
+    }
+
+    // Whether the char at index of a name is of the allowed class, digits not being allowed first
+    constexpr bool is_name_char(const char c, const unsigned char allowed_class, const std::size_t index)
     {
-        if(!std::regex_match(name, name_format_regex))
+        return (name_char_class(c) & allowed_class) != 0 && (index != 0 || (name_char_class(c) & digit_char) == 0);
+    }
+
+    // Whether name is made of chars of the allowed class, and does not start with a digit
+    inline bool follows_name_format(const std::string& name, const unsigned char allowed_class)
+    {
+        if(name.empty())
+        {
+            return false;
+        }
+        for(std::size_t i = 0; i < name.size(); i++)
+        {
+            if(!is_name_char(name[i], allowed_class, i))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Compile time counterparts of the names formats checks, for names known at compile time
+    constexpr bool is_valid_name(const char* name, const unsigned char allowed_class, const std::size_t index = 0)
+    {
+        return name[index] == '\0' ? index != 0
+                                   : is_name_char(name[index], allowed_class, index) && is_valid_name(name, allowed_class, index + 1);
+    }
+
+    constexpr bool is_valid_metric_name(const char* name)
+    {
+        return is_valid_name(name, metric_name_char);
+    }
+
+    constexpr bool is_valid_label_name(const char* name)
+    {
+        return is_valid_name(name, label_name_char);
+    }
+
+    inline void check_name_format(const std::string& name)
+    {
+        if(!follows_name_format(name, metric_name_char))
             throw std::invalid_argument("Metric name does not follow format");
     }
 
     struct Label
     {
-        const std::string name;
-        const std::string value;
+        std::string name;
+        std::string value;
 
         bool operator<(const Label &label) const
         {
@@ -102,410 +314,4591 @@ namespace oura_prometheus
         }
     };
 
-    using MetricSerializer = std::function<void(std::ostream&, const std::string&, double, const std::set<Label>&, Label)>;
+    // Label used by samples that do not carry a label of their own
+    const Label no_label = {"", ""};
 
-    class Metric
+    // Biggest number of chars written by write_double
+    constexpr std::size_t max_double_size = 32;
+
+    // Writes at output a text representation of value that parses back to the same double,
+    // using the exposition format spelling of infinities and NaN. Returns the number of chars written.
+    inline std::size_t write_double(char* output, const double value)
     {
-    public:
-        Metric(const std::string &name, const std::string &description, MetricType type)
-            : _name(name), _description(description), _type(type)
+        if(std::isnan(value))
         {
-            check_name_format(name);
+            std::memcpy(output, "NaN", 3);
+            return 3;
         }
-
-        const std::string& get_name() const
+        if(std::isinf(value))
         {
-            return _name;
+            std::memcpy(output, value > 0 ? "+Inf" : "-Inf", 4);
+            return 4;
         }
-
-        const std::string& get_description() const
+        // Counters and counts hold integers most of the time
+        if(value >= -1e15 && value <= 1e15 && value == static_cast<double>(static_cast<std::int64_t>(value)))
         {
-            return _description;
+            const std::int64_t integer = static_cast<std::int64_t>(value);
+            std::uint64_t magnitude = integer < 0 ? 0 - static_cast<std::uint64_t>(integer) : integer;
+            char digits[20];
+            std::size_t digits_count = 0;
+            do
+            {
+                digits[digits_count++] = static_cast<char>('0' + magnitude % 10);
+                magnitude /= 10;
+            } while(magnitude != 0);
+            std::size_t size = 0;
+            if(integer < 0)
+            {
+                output[size++] = '-';
+            }
+            while(digits_count != 0)
+            {
+                output[size++] = digits[--digits_count];
+            }
+            return size;
         }
-
-        const MetricType get_type() const
+#if defined(__cpp_lib_to_chars)
+        return std::to_chars(output, output + max_double_size, value).ptr - output;
+#else
+        // 15 significant digits are enough for most values, 17 always are
+        int size = std::snprintf(output, max_double_size, "%.15g", value);
+        if(std::strtod(output, nullptr) != value)
         {
-            return _type;
+            size = std::snprintf(output, max_double_size, "%.17g", value);
         }
+        return static_cast<std::size_t>(size);
+#endif
+    }
 
-        virtual void serialize(std::ostream& stream, const MetricSerializer& serializer) const = 0;
+    // Text of a double written once, for values exposed unchanged by every scrape
+    struct DoubleText
+    {
+        explicit DoubleText(const double value) : size(static_cast<std::uint8_t>(write_double(text, value))) {}
 
-    protected:
-        const std::string _name;
-        const std::string _description;
-        const MetricType _type;
+        char text[max_double_size];
+        std::uint8_t size;
     };
 
-    class Serializer
+    inline std::string format_double(const double value)
     {
-    public:
-        virtual void serialize(std::ostream& stream, std::map<std::string, std::weak_ptr<Metric>>& metrics) = 0;
-    };
+        char buffer[max_double_size];
+        return std::string(buffer, write_double(buffer, value));
+    }
 
-    class Collectable
+    inline void append_double(std::string& buffer, const double value)
     {
-    public:
-        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) = 0;
-    };
+        char text[max_double_size];
+        buffer.append(text, write_double(text, value));
+    }
 
-    class Registry : public Collectable
+    // Appends text escaped as per the exposition format: backslashes and line feeds,
+    // plus double quotes for label values
+    inline void append_escaped(std::string& buffer, const std::string& text, const bool escape_quotes = true)
     {
-    public:
-        bool register_metric(std::shared_ptr<Metric> metric)
+        std::size_t run_start = 0;
+        for(std::size_t i = 0; i < text.size(); i++)
         {
-            std::lock_guard<std::mutex> lock(_access_mtx);
-            bool was_metric_registered = false;
-            const std::string& metric_name = metric->get_name();
-            if(_register_metrics.find(metric_name) == _register_metrics.end())
+            const char c = text[i];
+            if(c == '\\' || c == '\n' || (c == '"' && escape_quotes))
             {
-                was_metric_registered = true;
-                _register_metrics.insert({metric_name, metric});
+                buffer.append(text, run_start, i - run_start);
+                buffer += '\\';
+                buffer += c == '\n' ? 'n' : c;
+                run_start = i + 1;
             }
-            return was_metric_registered;
         }
+        buffer.append(text, run_start, std::string::npos);
+    }
 
-        bool unregister_metric(const std::string& metric_name)
+    // Process wide storage of labels names and values: each distinct string is stored once, along with its
+    // escaping for the exposition formats. A string is freed once released by every label set that interned it,
+    // until then its address identifies it.
+    class LabelInterner
+    {
+    public:
+        struct InternedString
         {
-            std::lock_guard<std::mutex> lock(_access_mtx);
-            return _register_metrics.erase(metric_name) != 0;
-        }
+            const std::string value;
+            // Escaped value, only stored when escaping changes it
+            const std::string escaped_value;
 
-        std::shared_ptr<Metric> get_metric(const std::string& metric_name)
-        {
-            std::lock_guard<std::mutex> lock(_access_mtx);
-            std::shared_ptr<Metric> metric = nullptr;
-            if(_register_metrics.find(metric_name) != _register_metrics.end())
+            // Value as written in label values of the text exposition formats
+            const std::string& escaped() const
             {
-                metric = _register_metrics[metric_name];
+                return escaped_value.empty() ? value : escaped_value;
             }
-            return metric;
-        }
 
-        std::size_t size()
-        {
-            std::lock_guard<std::mutex> lock(_access_mtx);
-            return _register_metrics.size();
-        }
+            // Times the string was interned and not released yet, guarded by the interner lock
+            mutable std::size_t references;
+        };
 
-        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) override
+        // Interned string equal to value, to be released once it is no longer used
+        const InternedString* intern(const char* data, const std::size_t size)
         {
-            for(const auto& p : _register_metrics)
+            std::string value(data, size);
+            std::lock_guard<std::mutex> lock(_strings_mtx);
+            auto it = _strings.find(value);
+            if(it == _strings.end())
             {
-                metrics.insert({p.first, p.second});
+                std::string escaped_value;
+                append_escaped(escaped_value, value);
+                if(escaped_value == value)
+                {
+                    escaped_value.clear();
+                }
+                const InternedString* interned = new InternedString{value, escaped_value, 0};
+                it = _strings.emplace(std::move(value), std::unique_ptr<const InternedString>(interned)).first;
             }
+            it->second->references++;
+            return it->second.get();
         }
 
-    protected:
-        std::mutex _access_mtx;
-        std::map<std::string, std::shared_ptr<Metric>> _register_metrics = {};
-    };
-
-    const std::regex label_name_format_regex("[a-zA-Z_][a-zA-Z0-9_]*");
-    void check_label_name_format(const std::string& label_name)
-    {
-        if(!std::regex_match(label_name, label_name_format_regex))
-            throw std::invalid_argument("Label name does not follow format");
-    }
-
-    template <typename T>
-    class MetricFamily : public Metric
-    {
-    public:
-        MetricFamily(const std::string &name, const std::string &description, MetricType type, const std::set<std::string> &labels_names)
-            : Metric(name, description, type), _labels_names(labels_names)
+        const InternedString* intern(const std::string& value)
         {
-            std::for_each(labels_names.begin(), labels_names.end(), check_label_name_format);
+            return intern(value.data(), value.size());
         }
 
-    protected:
-        template <typename... Args>
-        std::shared_ptr<T> labels(const std::set<Label> &labels, Args &&... args)
+        // Releases count strings given by intern, each string is freed once released as many times as it was interned
+        void release(const InternedString* const* strings, const std::size_t count)
         {
-            // Verify label set size
-            if (labels.size() != _labels_names.size())
-            {
-                throw std::invalid_argument("Incorrect number of label given");
-            }
-
-            // Verify label set names
-            auto pred = [&](const Label& l){return _labels_names.find(l.name) == _labels_names.end();};
-            if(std::any_of(labels.begin(), labels.end(), pred))
+            std::lock_guard<std::mutex> lock(_strings_mtx);
+            for(std::size_t i = 0; i < count; i++)
             {
-                throw std::invalid_argument("Incorrect label combinaison given");
+                if(--strings[i]->references == 0)
+                {
+                    _strings.erase(_strings.find(strings[i]->value));
+                }
             }
+        }
 
-            std::shared_ptr<T> res;
-            // Return metric if label combinaison already exists
-            if(_metrics.find(labels) != _metrics.end())
-            {
-                res = _metrics[labels];
-            }
-            // Or create and return a new metric
-            else
-            {
-                std::shared_ptr<T> new_metric = std::make_shared<T>(args...);
-                _metrics.insert({labels, new_metric});
-                res = new_metric;
-            }
-            return res;
+        // Number of distinct strings interned
+        std::size_t size() const
+        {
+            std::lock_guard<std::mutex> lock(_strings_mtx);
+            return _strings.size();
         }
 
-        virtual void serialize(std::ostream& stream, const MetricSerializer& serializer) const override
+        // Interner of the process, never destroyed so that it outlives static metrics
+        static LabelInterner& instance()
         {
-            for(const auto& p : _metrics)
-            {
-                p.second->serialize(stream, serializer, _name, p.first);
-            }
+            static LabelInterner* interner = new LabelInterner();
+            return *interner;
         }
 
-    protected:
-        const std::set<std::string> _labels_names;
-        std::map<std::set<Label>, std::shared_ptr<T>> _metrics = {};
+    private:
+        mutable std::mutex _strings_mtx;
+        std::unordered_map<std::string, std::unique_ptr<const InternedString>> _strings;
     };
 
-    //////////////////////////////////////////////////////
-    //// COUNTER METRIC
-    //////////////////////////////////////////////////////
-    class Counter
+    // Labels of a metric, sorted by name. Labels names and values are interned, so that a label set
+    // only holds two pointers per label whatever the length of its strings, along with its text
+    // exposition rendering once it was serialized.
+    class LabelSet
     {
     public:
-        explicit Counter() : _value(0) {}
-        double get() {return _value;}
-        void inc() { _value += 1; }
-        void add(const double value)
+        explicit LabelSet(const std::set<Label>& labels)
+            : _strings(labels.empty() ? nullptr : new const LabelInterner::InternedString*[2 * labels.size()]), _size(labels.size()),
+              _id(next_id()), _text(nullptr)
         {
-            if (value > 0.0)
+            LabelInterner& interner = LabelInterner::instance();
+            std::size_t i = 0;
+            for(const auto& label : labels)
             {
-                _value += value;
+                _strings[i++] = interner.intern(label.name);
+                _strings[i++] = interner.intern(label.value);
             }
         }
 
-        void serialize(std::ostream& stream, const MetricSerializer& serializer, const std::string& name, const std::set<Label>& labels = {}) const
+        LabelSet(const LabelSet&) = delete;
+        LabelSet& operator=(const LabelSet&) = delete;
+
+        ~LabelSet()
         {
-            serializer(stream, name, _value, labels, {"",""});
+            delete _text.load(std::memory_order_relaxed);
+            LabelInterner::instance().release(_strings.get(), 2 * _size);
         }
 
-    protected:
-        atomic_double _value;
-    };
+        std::size_t size() const
+        {
+            return _size;
+        }
 
-    class CounterMetric : public Metric, public Counter
-    {
-    public:
-        CounterMetric(const std::string &name, const std::string &description)
-            : Metric(name, description, MetricType::Counter), Counter()
+        bool empty() const
         {
+            return _size == 0;
         }
 
-        virtual void serialize(std::ostream& stream, const MetricSerializer& serializer) const override
+        // Identifier of the label set, never given to another one of the process
+        std::uint64_t id() const
         {
-            Counter::serialize(stream, serializer, _name);
+            return _id;
         }
-    };
 
-    class CounterFamily : public MetricFamily<Counter>
-    {
-    public:
-        CounterFamily(const std::string& name, const std::string& description, const std::set<std::string>& labels_names)
-            : MetricFamily(name, description, MetricType::Counter, labels_names)
+        const std::string& name(const std::size_t index) const
         {
+            return _strings[2 * index]->value;
         }
 
-        std::shared_ptr<Counter> labels(const std::set<Label> &labels)
+        const std::string& value(const std::size_t index) const
         {
-            return MetricFamily::labels(labels);
+            return _strings[2 * index + 1]->value;
         }
-    };
 
-    //////////////////////////////////////////////////////
-    //// GAUGE METRIC
-    //////////////////////////////////////////////////////
-    class Gauge
-    {
-    public:
-        explicit Gauge(const double initial_value = 0) : _value(initial_value) {}
-        double get() {return _value;}
-        void set(const double value) { _value = value; }
-        void inc() { _value += 1; }
-        void dec() { _value -= 1; }
-        void add(const double value)
+        // Whether the label set holds exactly labels
+        bool matches(const std::set<Label>& labels) const
         {
-            if (value > 0.0)
+            if(labels.size() != _size)
             {
-                _value += value;
+                return false;
+            }
+            std::size_t i = 0;
+            for(const auto& label : labels)
+            {
+                if(label.name != name(i) || label.value != value(i))
+                {
+                    return false;
+                }
+                i++;
             }
+            return true;
         }
-        void sub(const double &value)
+
+        // Labels as written in the text exposition formats (l1="v1",l2="v2").
+        // Labels never change, so it is rendered on the first call only.
+        const std::string& text() const
         {
-            if (value > 0.0)
+            const std::string* text = _text.load(std::memory_order_acquire);
+            if(text == nullptr)
             {
-                _value -= value;
+                std::unique_ptr<std::string> rendered_text(new std::string());
+                for(std::size_t i = 0; i < _size; i++)
+                {
+                    if(i != 0)
+                    {
+                        *rendered_text += ',';
+                    }
+                    rendered_text->append(_strings[2 * i]->value).append("=\"");
+                    rendered_text->append(_strings[2 * i + 1]->escaped());
+                    *rendered_text += '"';
+                }
+                // Another serializer may have rendered it concurrently, the first one wins
+                if(_text.compare_exchange_strong(text, rendered_text.get(), std::memory_order_acq_rel))
+                {
+                    text = rendered_text.release();
+                }
             }
+            return *text;
         }
 
-        void serialize(std::ostream& stream, const MetricSerializer& serializer, const std::string& name, const std::set<Label>& labels = {}) const
+        void append_text(std::string& buffer) const
         {
-            serializer(stream, name, _value, labels, {"",""});
+            if(_size != 0)
+            {
+                buffer.append(text());
+            }
         }
 
-    protected:
-        atomic_double _value;
-    };
-
-    class GaugeMetric : public Metric, public Gauge
-    {
-    public:
-        GaugeMetric(const std::string &name, const std::string &description, const double initial_value = 0)
-            : Metric(name, description, MetricType::Gauge), Gauge(initial_value)
+        bool operator<(const LabelSet &label_set) const
         {
+            for(std::size_t i = 0; i < 2 * std::min(_size, label_set._size); i++)
+            {
+                // Equal strings are the same interned string
+                if(_strings[i] != label_set._strings[i])
+                {
+                    return _strings[i]->value < label_set._strings[i]->value;
+                }
+            }
+            return _size < label_set._size;
         }
 
-        virtual void serialize(std::ostream& stream, const MetricSerializer& serializer) const override
+    private:
+        static std::uint64_t next_id()
         {
-            Gauge::serialize(stream, serializer, _name);
+            static std::atomic<std::uint64_t> id(0);
+            return id.fetch_add(1, std::memory_order_relaxed);
         }
+
+        // Name and value of each label, one after the other
+        std::unique_ptr<const LabelInterner::InternedString*[]> _strings;
+        const std::size_t _size;
+        const std::uint64_t _id;
+        mutable std::atomic<const std::string*> _text;
     };
 
-    class GaugeFamily : public MetricFamily<Gauge>
+    // Label set of metrics that are not part of a family
+    const LabelSet no_labels(std::set<Label>{});
+
+    class Counter;
+    class Gauge;
+    class Histogram;
+    class Summary;
+    class NativeHistogram;
+
+    // Receives every child of the metric being serialized, implemented by serializers
+    class MetricSerializer
     {
     public:
-        GaugeFamily(const std::string &name, const std::string &description, const std::set<std::string> &labels_names)
-            : MetricFamily(name, description, MetricType::Gauge, labels_names)
-        {
-        }
+        virtual ~MetricSerializer() = default;
 
-        std::shared_ptr<Gauge> labels(const std::set<Label> &labels, const double default_value = 0)
-        {
-            return MetricFamily::labels(labels, default_value);
-        }
+        virtual void serialize(const LabelSet& labels, const Counter& counter) = 0;
+        virtual void serialize(const LabelSet& labels, const Gauge& gauge) = 0;
+        virtual void serialize(const LabelSet& labels, const Histogram& histogram) = 0;
+        virtual void serialize(const LabelSet& labels, const Summary& summary) = 0;
+        virtual void serialize(const LabelSet& labels, const NativeHistogram& histogram) = 0;
     };
 
-    //////////////////////////////////////////////////////
-    //// HISTOGRAM METRIC
-    //////////////////////////////////////////////////////
-    const std::set<double> default_buckets = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+    // Runs the serialization of parts_count parts of a metric, serialize_part(i, serializer) writing part i
+    using PartsRunner = std::function<void(std::size_t parts_count,
+                                           const std::function<void(std::size_t part, MetricSerializer& serializer)>& serialize_part)>;
 
-    class Histogram
+    // Cost of a metric for the library, see SelfMetrics
+    struct MetricStats
     {
-    public:
-        explicit Histogram(const std::set<double>& buckets = default_buckets)
-            : _sum(0)
+        // Whether the metric is a family, the other fields are only kept by families
+        bool family = false;
+        std::size_t children = 1;
+        // Label combinaisons created since the family was, including removed ones
+        std::uint64_t children_created = 0;
+        // Times the children index lock was found held by another thread
+        std::uint64_t lock_contentions = 0;
+        // Bytes of the children, their index and label sets, interned label strings and rendered label texts excluded
+        std::size_t memory_bytes = 0;
+    };
+
+    class Metric
+    {
+    public:
+        Metric(const std::string &name, const std::string &description, MetricType type)
+            : _name(name), _description(description), _type(type)
+        {
+            check_name_format(name);
+        }
+
+        virtual ~Metric() = default;
+
+        const std::string& get_name() const
+        {
+            return _name;
+        }
+
+        const std::string& get_description() const
+        {
+            return _description;
+        }
+
+        const MetricType get_type() const
+        {
+            return _type;
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const = 0;
+
+        // Number of children written by serialize
+        virtual std::size_t children_count() const
+        {
+            return 1;
+        }
+
+        // Serializes children split in parts of at most part_size children, in the order of serialize. Parts
+        // may be written by several threads at once, children do not change until run returns.
+        virtual void serialize_parts(const std::size_t part_size, const PartsRunner& run) const
+        {
+            (void)part_size;
+            run(1, [this](std::size_t, MetricSerializer& serializer){serialize(serializer);});
+        }
+
+        virtual MetricStats stats() const
+        {
+            return MetricStats();
+        }
+
+        // Removes the children whose limits ttl expired, see FamilyLimits, returns their count
+        virtual std::size_t remove_expired()
+        {
+            return 0;
+        }
+
+    protected:
+        const std::string _name;
+        const std::string _description;
+        const MetricType _type;
+    };
+
+    // Receives serialized data chunk by chunk, e.g. to compress or send it while serialization goes on
+    using ChunkConsumer = std::function<void(const std::string& chunk)>;
+
+    // Immutable set of metrics by name, shared between a registry and the serializations in progress
+    using MetricsSnapshot = std::map<std::string, std::shared_ptr<Metric>>;
+
+    // Strong references to the metrics that are still alive
+    inline MetricsSnapshot lock_metrics(const std::map<std::string, std::weak_ptr<Metric>>& metrics)
+    {
+        MetricsSnapshot snapshot;
+        for(const auto& p : metrics)
         {
-            // Creating buckets
-            _buckets.insert({std::numeric_limits<double>::infinity(), 0});
-            for(const auto& bucket : buckets)
+            if(auto metric = p.second.lock())
             {
-                _buckets.insert({bucket, 0});
+                snapshot.insert(snapshot.end(), {p.first, metric});
             }
         }
+        return snapshot;
+    }
 
-        void observe(const double value)
+    // Exposition formats, written by TextSerializer, OpenMetricsSerializer and ProtobufSerializer
+    enum class ExpositionFormat
+    {
+        Text,
+        OpenMetrics,
+        Protobuf
+    };
+
+    class Serializer
+    {
+    public:
+        virtual ~Serializer() = default;
+
+        // HTTP Content-Type of the serialized metrics
+        virtual const char* content_type() const = 0;
+
+        // Serializes metrics into buffer, which is handed to consumer and cleared each time it holds
+        // at least chunk_size bytes, and once at the end. Buffer capacity is kept across chunks.
+        virtual void serialize(std::string& buffer, const MetricsSnapshot& metrics,
+                               const ChunkConsumer& consumer, const std::size_t chunk_size) = 0;
+
+        // Appends serialized metrics to buffer, reusing a buffer across calls avoids any allocation
+        virtual void serialize(std::string& buffer, const MetricsSnapshot& metrics)
         {
-            _sum += value;
-            for(auto& bucket : _buckets)
+            serialize(buffer, metrics, nullptr, std::numeric_limits<std::size_t>::max());
+        }
+
+        virtual void serialize(std::string& buffer, std::map<std::string, std::weak_ptr<Metric>>& metrics,
+                               const ChunkConsumer& consumer, const std::size_t chunk_size)
+        {
+            serialize(buffer, lock_metrics(metrics), consumer, chunk_size);
+        }
+
+        virtual void serialize(std::string& buffer, std::map<std::string, std::weak_ptr<Metric>>& metrics)
+        {
+            serialize(buffer, lock_metrics(metrics));
+        }
+
+        virtual void serialize(std::ostream& stream, std::map<std::string, std::weak_ptr<Metric>>& metrics)
+        {
+            std::string buffer;
+            serialize(buffer, metrics);
+            stream.write(buffer.data(), buffer.size());
+        }
+    };
+
+    class Collectable
+    {
+    public:
+        virtual ~Collectable() = default;
+
+        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) = 0;
+
+        // View of the collected metrics that stays valid and unchanged while it is being serialized
+        virtual std::shared_ptr<const MetricsSnapshot> snapshot()
+        {
+            std::map<std::string, std::weak_ptr<Metric>> metrics;
+            collect(metrics);
+            return std::make_shared<const MetricsSnapshot>(lock_metrics(metrics));
+        }
+    };
+
+    // Lock guard counting the times mutex was already held by another thread.
+    // An uncontended try_lock costs as much as lock, contention alone adds an atomic increment.
+    class CountedLock
+    {
+    public:
+        CountedLock(std::mutex& mutex, std::atomic<std::uint64_t>& contentions) : _mutex(mutex)
+        {
+            if(!_mutex.try_lock())
             {
-                if(value <= bucket.first)
-                {
-                    bucket.second += 1;
-                }
+                contentions.fetch_add(1, std::memory_order_relaxed);
+                _mutex.lock();
+            }
+        }
+
+        CountedLock(const CountedLock&) = delete;
+        CountedLock& operator=(const CountedLock&) = delete;
+
+        ~CountedLock()
+        {
+            _mutex.unlock();
+        }
+
+    private:
+        std::mutex& _mutex;
+    };
+
+    // Registered metrics are held in a copy on write snapshot: registrations publish a new version
+    // of it, and collections share the current one without waiting for registrations.
+    class Registry : public Collectable
+    {
+    public:
+        bool register_metric(std::shared_ptr<Metric> metric)
+        {
+            CountedLock lock(_access_mtx, _lock_contentions);
+            std::shared_ptr<const MetricsSnapshot> metrics = registered();
+            const std::string& metric_name = metric->get_name();
+            if(metrics->find(metric_name) != metrics->end())
+            {
+                return false;
+            }
+            std::shared_ptr<MetricsSnapshot> new_metrics = std::make_shared<MetricsSnapshot>(*metrics);
+            new_metrics->insert({metric_name, metric});
+            publish(new_metrics);
+            return true;
+        }
+
+        // Registers all metrics publishing a single new snapshot, rather than one per metric.
+        // Metrics whose name is already registered are skipped, returns the number of registered ones.
+        std::size_t register_metrics(const std::vector<std::shared_ptr<Metric>>& metrics)
+        {
+            CountedLock lock(_access_mtx, _lock_contentions);
+            std::shared_ptr<MetricsSnapshot> new_metrics = std::make_shared<MetricsSnapshot>(*registered());
+            std::size_t registered_count = 0;
+            for(const auto& metric : metrics)
+            {
+                registered_count += new_metrics->insert({metric->get_name(), metric}).second ? 1 : 0;
+            }
+            if(registered_count != 0)
+            {
+                publish(new_metrics);
+            }
+            return registered_count;
+        }
+
+        bool unregister_metric(const std::string& metric_name)
+        {
+            CountedLock lock(_access_mtx, _lock_contentions);
+            std::shared_ptr<const MetricsSnapshot> metrics = registered();
+            if(metrics->find(metric_name) == metrics->end())
+            {
+                return false;
             }
+            std::shared_ptr<MetricsSnapshot> new_metrics = std::make_shared<MetricsSnapshot>(*metrics);
+            new_metrics->erase(metric_name);
+            publish(new_metrics);
+            return true;
+        }
+
+        std::shared_ptr<Metric> get_metric(const std::string& metric_name)
+        {
+            std::shared_ptr<const MetricsSnapshot> metrics = registered();
+            const auto it = metrics->find(metric_name);
+            return it != metrics->end() ? it->second : nullptr;
+        }
+
+        std::size_t size()
+        {
+            return registered()->size();
+        }
+
+        // Times a registration waited for another one
+        std::uint64_t lock_contentions() const
+        {
+            return _lock_contentions.load(std::memory_order_relaxed);
         }
 
-        const std::map<double, atomic_double>& buckets() const
+        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) override
         {
-            return _buckets;
+            std::shared_ptr<const MetricsSnapshot> registered_metrics = snapshot();
+            for(const auto& p : *registered_metrics)
+            {
+                metrics.insert({p.first, p.second});
+            }
         }
 
-        void serialize(std::ostream& stream, const MetricSerializer& serializer, const std::string& name, const std::set<Label>& labels = {}) const
+        // Current registered metrics, once the expired children of their families are removed, see FamilyLimits
+        virtual std::shared_ptr<const MetricsSnapshot> snapshot() override
         {
-            for(const auto& p : _buckets)
+            std::shared_ptr<const MetricsSnapshot> metrics = registered();
+            for(const auto& p : *metrics)
             {
-                serializer(stream, name, p.second, labels, {"le", std::to_string(p.first)});
+                p.second->remove_expired();
             }
+            return metrics;
+        }
+
+        // Current registered metrics, in O(1)
+        std::shared_ptr<const MetricsSnapshot> registered()
+        {
+            std::lock_guard<std::mutex> lock(_snapshot_mtx);
+            return _register_metrics;
         }
 
     protected:
-        std::map<double, atomic_double> _buckets;
-        atomic_double _sum;
+        void publish(const std::shared_ptr<const MetricsSnapshot>& metrics)
+        {
+            std::lock_guard<std::mutex> lock(_snapshot_mtx);
+            _register_metrics = metrics;
+        }
+
+        // Serializes registrations, which copy the snapshot
+        std::mutex _access_mtx;
+        std::atomic<std::uint64_t> _lock_contentions = {0};
+        // Only held to copy or replace the snapshot pointer
+        std::mutex _snapshot_mtx;
+        std::shared_ptr<const MetricsSnapshot> _register_metrics = std::make_shared<const MetricsSnapshot>();
     };
 
-    class HistogramMetric : public Metric, public Histogram
+    inline void check_label_name_format(const std::string& label_name)
+    {
+        if(!follows_name_format(label_name, label_name_char))
+            throw std::invalid_argument("Label name does not follow format");
+    }
+
+    // Initial value of label values hashes
+    constexpr std::uint64_t label_hash_seed = 14695981039346656037ULL;
+
+    // Chains the FNV-1a hash of a label value to the hash of the previous label values
+    inline std::uint64_t hash_label_value(std::uint64_t hash, const char* value, const std::size_t size)
+    {
+        constexpr std::uint64_t prime = 1099511628211ULL;
+        for(std::size_t i = 0; i < size; i++)
+        {
+            hash = (hash ^ static_cast<unsigned char>(value[i])) * prime;
+        }
+        // Mixing the size in so that {"ab", "c"} and {"a", "bc"} do not collide
+        return (hash ^ size) * prime;
+    }
+
+    // Non owning reference to a label value, given in label names order to with_labels methods
+    struct LabelValue
+    {
+        LabelValue(const std::string& value) : data(value.data()), size(value.size()) {}
+        LabelValue(const char* value) : data(value), size(std::strlen(value)) {}
+
+        const char* data;
+        std::size_t size;
+    };
+
+    //////////////////////////////////////////////////////
+    //// EXEMPLARS
+    //////////////////////////////////////////////////////
+
+    // Labels of an exemplar, e.g. {{"trace_id", id}}, referenced rather than copied
+    using ExemplarLabels = std::initializer_list<std::pair<LabelValue, LabelValue>>;
+
+    // OpenMetrics bound of the characters of exemplar label names and values, and size of their rendering
+    constexpr std::size_t exemplar_max_labels_size = 128;
+    constexpr std::size_t exemplar_text_capacity = 256;
+
+    struct Exemplar
+    {
+        // Label set text, e.g. trace_id="abc"
+        std::string labels;
+        double value;
+        // Seconds since the unix epoch
+        double timestamp;
+    };
+
+    // Latest exemplar of a counter or bucket, protected by a seqlock: recording one renders its labels
+    // then makes a few relaxed stores, and is dropped rather than waited for when another one is being recorded.
+    // Words are atomics, so that concurrent reads of a slot being written are retried rather than undefined.
+    class ExemplarSlot
     {
     public:
-        HistogramMetric(const std::string &name, const std::string &description, const std::set<double>& buckets = default_buckets)
-            : Metric(name, description, MetricType::Histogram), Histogram(buckets)
+        ExemplarSlot()
+        {
+            for(auto& word : _words)
+            {
+                word.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        // Throws std::invalid_argument when a label name is not valid or the labels are too long
+        void record(const ExemplarLabels& labels, const double value)
+        {
+            char text[exemplar_text_capacity];
+            const std::size_t size = render(labels, text);
+            const double timestamp = unix_time();
+
+            std::uint32_t sequence = _sequence.load(std::memory_order_relaxed);
+            if((sequence & 1) != 0 || !_sequence.compare_exchange_strong(sequence, sequence + 1, std::memory_order_acquire))
+            {
+                return;
+            }
+            for(std::size_t i = 0; i * 8 < size; i++)
+            {
+                std::uint64_t word = 0;
+                std::memcpy(&word, text + i * 8, std::min<std::size_t>(8, size - i * 8));
+                _words[i].store(word, std::memory_order_relaxed);
+            }
+            _size.store(size, std::memory_order_relaxed);
+            _value.store(value, std::memory_order_relaxed);
+            _timestamp.store(timestamp, std::memory_order_relaxed);
+            _sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        // Returns false when no exemplar was recorded yet
+        bool load(Exemplar& exemplar) const
         {
+            char text[exemplar_text_capacity];
+            while(true)
+            {
+                const std::uint32_t sequence = _sequence.load(std::memory_order_acquire);
+                if(sequence == 0)
+                {
+                    return false;
+                }
+                if((sequence & 1) != 0)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                const std::size_t size = std::min(_size.load(std::memory_order_relaxed), exemplar_text_capacity);
+                for(std::size_t i = 0; i * 8 < size; i++)
+                {
+                    const std::uint64_t word = _words[i].load(std::memory_order_relaxed);
+                    std::memcpy(text + i * 8, &word, std::min<std::size_t>(8, size - i * 8));
+                }
+                exemplar.value = _value.load(std::memory_order_relaxed);
+                exemplar.timestamp = _timestamp.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(_sequence.load(std::memory_order_relaxed) == sequence)
+                {
+                    exemplar.labels.assign(text, size);
+                    return true;
+                }
+            }
         }
 
-        virtual void serialize(std::ostream& stream, const MetricSerializer& serializer) const override
+    protected:
+        // Writes name="value" pairs separated by commas, values escaped as samples label values
+        static std::size_t render(const ExemplarLabels& labels, char* text)
         {
-            Histogram::serialize(stream, serializer, _name);
+            std::size_t characters = 0;
+            std::size_t size = 0;
+            auto put = [&](const char c){
+                if(size == exemplar_text_capacity)
+                {
+                    throw std::invalid_argument("Exemplar labels are too long");
+                }
+                text[size++] = c;
+            };
+            for(const auto& label : labels)
+            {
+                const LabelValue& name = label.first;
+                bool follows_format = name.size != 0;
+                for(std::size_t i = 0; i < name.size && follows_format; i++)
+                {
+                    follows_format = is_name_char(name.data[i], label_name_char, i);
+                }
+                if(!follows_format)
+                {
+                    throw std::invalid_argument("Exemplar label name does not follow format");
+                }
+                characters += name.size + label.second.size;
+                if(characters > exemplar_max_labels_size)
+                {
+                    throw std::invalid_argument("Exemplar labels are too long");
+                }
+                if(size != 0)
+                {
+                    put(',');
+                }
+                std::for_each(name.data, name.data + name.size, put);
+                put('=');
+                put('"');
+                for(std::size_t i = 0; i < label.second.size; i++)
+                {
+                    const char c = label.second.data[i];
+                    if(c == '\\' || c == '"')
+                    {
+                        put('\\');
+                        put(c);
+                    }
+                    else if(c == '\n')
+                    {
+                        put('\\');
+                        put('n');
+                    }
+                    else
+                    {
+                        put(c);
+                    }
+                }
+                put('"');
+            }
+            return size;
         }
+
+        std::atomic<std::uint32_t> _sequence = {0};
+        std::atomic<std::size_t> _size = {0};
+        std::atomic<double> _value = {0};
+        std::atomic<double> _timestamp = {0};
+        std::array<std::atomic<std::uint64_t>, exemplar_text_capacity / 8> _words;
     };
 
-    class HistogramFamily : public MetricFamily<Histogram>
+    // Exemplar slots allocated on the first recorded exemplar, so that metrics without exemplars do not pay for them
+    class ExemplarSlots
     {
     public:
-        HistogramFamily(const std::string &name, const std::string &description, const std::set<std::string> &labels_names, const std::set<double>& buckets = default_buckets)
-            : MetricFamily(name, description, MetricType::Gauge, labels_names), _buckets(buckets)
+        explicit ExemplarSlots(const std::size_t count) : _count(count) {}
+        ExemplarSlots(const ExemplarSlots&) = delete;
+        ExemplarSlots& operator=(const ExemplarSlots&) = delete;
+
+        ~ExemplarSlots()
         {
+            delete[] _slots.load();
         }
 
-        std::shared_ptr<Histogram> labels(const std::set<Label> &labels)
+        void record(const std::size_t index, const ExemplarLabels& labels, const double value)
         {
-            return MetricFamily::labels(labels, _buckets);
+            ExemplarSlot* slots = _slots.load(std::memory_order_acquire);
+            if(slots == nullptr)
+            {
+                // The first threads to record race to publish slots, the losers free theirs
+                std::unique_ptr<ExemplarSlot[]> new_slots(new ExemplarSlot[_count]);
+                if(_slots.compare_exchange_strong(slots, new_slots.get(), std::memory_order_acq_rel))
+                {
+                    slots = new_slots.release();
+                }
+            }
+            slots[index].record(labels, value);
+        }
+
+        bool load(const std::size_t index, Exemplar& exemplar) const
+        {
+            const ExemplarSlot* slots = _slots.load(std::memory_order_acquire);
+            return slots != nullptr && slots[index].load(exemplar);
+        }
+
+        // Whether an exemplar is recorded when only one in one_in of them are, counted per metric across threads
+        bool sample(const std::uint32_t one_in)
+        {
+            return one_in <= 1 || (_tick.fetch_add(1, std::memory_order_relaxed) + 1) % one_in == 0;
         }
 
     protected:
-        const std::set<double> _buckets;
+        const std::size_t _count;
+        std::atomic<ExemplarSlot*> _slots = {nullptr};
+        std::atomic<std::uint32_t> _tick = {0};
     };
-    
-    inline std::string escape_double_quotes(const std::string& text)
-    {
-        return std::regex_replace(text, std::regex("\""), "\\\"");
-    }
 
-    class TextSerializer : public Serializer
+    // Sizes of the chunks of children arenas
+    constexpr std::size_t arena_min_chunk_size = 4096;
+    constexpr std::size_t arena_max_chunk_size = 1 << 20;
+
+    // Bump allocator of the children of a family: children are allocated one after the other in chunks
+    // that are only freed with the arena, once their family and all their handles are gone.
+    // Memory of removed children is kept in free lists by size, for the next children to reuse.
+    class ChildrenArena
     {
     public:
-        virtual void serialize(std::ostream& stream, std::map<std::string, std::weak_ptr<Metric>>& metrics) override
+        ChildrenArena() = default;
+        ChildrenArena(const ChildrenArena&) = delete;
+        ChildrenArena& operator=(const ChildrenArena&) = delete;
+
+        void* allocate(const std::size_t size, const std::size_t alignment)
         {
-            for(const auto& p : metrics)
+            std::lock_guard<std::mutex> lock(_arena_mtx);
+            for(auto& free_list : _free_lists)
             {
-                if(auto metric = p.second.lock())
+                if(free_list.first == size && free_list.second != nullptr &&
+                   reinterpret_cast<std::uintptr_t>(free_list.second) % alignment == 0)
                 {
-                    stream << "# HELP " << metric->get_name() << " " << metric->get_description() << std::endl;
-                    stream << "# TYPE " << metric->get_name() << " " << metric_type_to_string(metric->get_type()) << std::endl;
-                    metric->serialize(stream, TextSerializer::metric_serializer);
+                    FreeBlock* block = free_list.second;
+                    free_list.second = block->next;
+                    return block;
                 }
             }
+            std::uintptr_t address = (_next + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+            if(_chunks.empty() || address + size > _end)
+            {
+                // Chunks double in size, so that small families stay small and big ones have few chunks
+                _chunk_size = std::min(std::max(_chunk_size * 2, arena_min_chunk_size), arena_max_chunk_size);
+                const std::size_t chunk_size = std::max(_chunk_size, size + alignment);
+                _chunks.emplace_back(new char[chunk_size]);
+                _capacity += chunk_size;
+                _next = reinterpret_cast<std::uintptr_t>(_chunks.back().get());
+                _end = _next + chunk_size;
+                address = (_next + alignment - 1) & ~static_cast<std::uintptr_t>(alignment - 1);
+            }
+            _next = address + size;
+            return reinterpret_cast<void*>(address);
         }
 
-       static void metric_serializer(std::ostream& stream,
-                                     const std::string& name, 
-                                     double value, 
-                                     const std::set<Label>& labels, 
-                                     Label additional_label)
+        void deallocate(void* pointer, const std::size_t size)
         {
-            stream << name;
-            if(!labels.empty() || !additional_label.name.empty())
+            // Blocks too small to hold a free list link are simply lost until the arena is freed
+            if(size < sizeof(FreeBlock))
             {
-                stream << "{";
-                std::string comma = "";
-                for(const auto& label : labels)
-                {
-                    stream << comma << label.name << "=\"" << escape_double_quotes(label.value) << "\"";
-                    comma = ",";
-                }
-                if(!additional_label.name.empty())
+                return;
+            }
+            std::lock_guard<std::mutex> lock(_arena_mtx);
+            FreeBlock* block = static_cast<FreeBlock*>(pointer);
+            for(auto& free_list : _free_lists)
+            {
+                if(free_list.first == size)
                 {
-                    stream << comma << additional_label.name << "=\"" << escape_double_quotes(additional_label.value) << "\"";
+                    block->next = free_list.second;
+                    free_list.second = block;
+                    return;
                 }
-               stream << "}";
             }
-            stream << " " << value << std::endl;
+            block->next = nullptr;
+            _free_lists.push_back({size, block});
+        }
+
+        // Bytes of the chunks allocated so far
+        std::size_t capacity() const
+        {
+            std::lock_guard<std::mutex> lock(_arena_mtx);
+            return _capacity;
+        }
+
+    private:
+        struct FreeBlock
+        {
+            FreeBlock* next;
+        };
+
+        mutable std::mutex _arena_mtx;
+        std::vector<std::unique_ptr<char[]>> _chunks = {};
+        // Free blocks by size, children of a family only come in a couple of sizes
+        std::vector<std::pair<std::size_t, FreeBlock*>> _free_lists = {};
+        std::size_t _chunk_size = 0;
+        std::size_t _capacity = 0;
+        std::uintptr_t _next = 0;
+        std::uintptr_t _end = 0;
+    };
+
+    // Allocator of a children arena, keeping the arena alive
+    template <typename U>
+    class ArenaAllocator
+    {
+    public:
+        using value_type = U;
+
+        explicit ArenaAllocator(const std::shared_ptr<ChildrenArena>& arena) : arena(arena) {}
+
+        template <typename V>
+        ArenaAllocator(const ArenaAllocator<V>& allocator) : arena(allocator.arena) {}
+
+        U* allocate(const std::size_t n)
+        {
+            return static_cast<U*>(arena->allocate(n * sizeof(U), alignof(U)));
+        }
+
+        void deallocate(U* pointer, const std::size_t n)
+        {
+            arena->deallocate(pointer, n * sizeof(U));
+        }
+
+        template <typename V>
+        bool operator==(const ArenaAllocator<V>& allocator) const
+        {
+            return arena == allocator.arena;
+        }
+
+        template <typename V>
+        bool operator!=(const ArenaAllocator<V>& allocator) const
+        {
+            return arena != allocator.arena;
         }
 
+        std::shared_ptr<ChildrenArena> arena;
+    };
+
+    // What a family does with new label combinaisons once it reached its maximum cardinality
+    enum class OverflowPolicy
+    {
+        // Updates of new label combinaisons are dropped, they all go to a single child that is never exposed
+        Drop,
+        // New label combinaisons all share a child whose label values are overflow_label_value
+        Collapse
+    };
+
+    // Label values of the child of overflowed label combinaisons
+    const std::string overflow_label_value = "other";
+
+    struct FamilyLimits
+    {
+        // Maximum number of children, 0 is unlimited. The Collapse child comes on top of it.
+        std::size_t max_cardinality = 0;
+        OverflowPolicy overflow_policy = OverflowPolicy::Drop;
+        // Children not updated for longer are removed when the registry holding the family is collected,
+        // 0 never removes them. Children held by a handle, or looked up since the previous sweep, are kept.
+        // Updates are timed by the next sweep, children expire up to one collection interval late.
+        std::chrono::milliseconds ttl = std::chrono::milliseconds(0);
+    };
+
+    // Label names of a family in declaration order, which is the order of with_labels values:
+    // {"path", "code"} takes with_labels("/", "200"). Names given by a std::set come in its sorted order.
+    class LabelNames
+    {
+    public:
+        LabelNames(std::initializer_list<std::string> names) : _names(names) {}
+        LabelNames(const std::vector<std::string>& names) : _names(names) {}
+        LabelNames(const std::set<std::string>& names) : _names(names.begin(), names.end()) {}
+
+        const std::vector<std::string>& names() const
+        {
+            return _names;
+        }
+
+        bool contains(const std::string& name) const
+        {
+            return std::find(_names.begin(), _names.end(), name) != _names.end();
+        }
+
+    private:
+        std::vector<std::string> _names;
+    };
+
+    // Children of a family, along with their label set, are allocated from an arena:
+    // they are laid out next to each other in creation order, which is their serialization order.
+    template <typename T>
+    class MetricFamily : public Metric
+    {
+    public:
+        MetricFamily(const std::string &name, const std::string &description, MetricType type, const LabelNames &labels_names)
+            : Metric(name, description, type), _labels_names(labels_names.names().begin(), labels_names.names().end())
+        {
+            const std::vector<std::string>& names = labels_names.names();
+            std::for_each(names.begin(), names.end(), check_label_name_format);
+            if(_labels_names.size() != names.size())
+            {
+                throw std::invalid_argument("Label names of " + name + " must be distinct");
+            }
+            // Label sets are sorted by name, with_labels values are picked in that order
+            for(const auto& label_name : _labels_names)
+            {
+                _value_positions.push_back(std::find(names.begin(), names.end(), label_name) - names.begin());
+            }
+            _tables.emplace_back(new Table(initial_table_size));
+            _table.store(_tables.back().get(), std::memory_order_release);
+        }
+
+        virtual ~MetricFamily()
+        {
+            for(Entry* entry : _entries)
+            {
+                entry->~Entry();
+            }
+        }
+
+        // Number of label combinaisons created
+        std::size_t size() const
+        {
+            CountedLock lock(_metrics_mtx, _lock_contentions);
+            return _entries.size();
+        }
+
+        // Must be set before the first child is created
+        void set_limits(const FamilyLimits& limits)
+        {
+            CountedLock lock(_metrics_mtx, _lock_contentions);
+            if(!_entries.empty())
+            {
+                throw std::logic_error("Family limits must be set before children are created");
+            }
+            _limits = limits;
+            if(limits.ttl.count() > 0 && !_readers)
+            {
+                _readers.reset(new ReadersCount[2 * readers_slots]);
+                for(std::size_t i = 0; i < 2 * readers_slots; i++)
+                {
+                    _readers[i].count.store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        const FamilyLimits& limits() const
+        {
+            return _limits;
+        }
+
+        // Removes the children not updated for longer than the limits ttl, returns their count. It is run by registry
+        // collections, it waits for concurrent lookups and serializations but never for updates.
+        virtual std::size_t remove_expired() override
+        {
+            std::lock_guard<std::mutex> serialization_lock(_serialization_mtx);
+            return remove_expired_children();
+        }
+
+        virtual MetricStats stats() const override
+        {
+            MetricStats stats;
+            stats.family = true;
+            stats.children_created = _children_created.load(std::memory_order_relaxed);
+            stats.lock_contentions = _lock_contentions.load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(_metrics_mtx);
+            stats.children = _entries.size();
+            // Each label set holds a name and a value pointer per label
+            stats.memory_bytes = _arena->capacity() + _entries.capacity() * sizeof(Entry*)
+                + _entries.size() * 2 * _labels_names.size() * sizeof(const LabelInterner::InternedString*);
+            for(const auto& table : _tables)
+            {
+                stats.memory_bytes += sizeof(Table) + (table->mask + 1) * sizeof(std::atomic<const Entry*>);
+            }
+            if(_readers)
+            {
+                stats.memory_bytes += 2 * readers_slots * sizeof(ReadersCount);
+            }
+            return stats;
+        }
+
+    protected:
+        // Must be called with _serialization_mtx locked, which keeps the children serialized from being freed
+        std::size_t remove_expired_children()
+        {
+            CountedLock lock(_metrics_mtx, _lock_contentions);
+            if(!_readers)
+            {
+                return 0;
+            }
+            const auto now = std::chrono::steady_clock::now();
+            // Updates made from now on record the next epoch, those since the previous sweep recorded its epoch or a later one
+            const std::uint32_t previous_epoch = _swept_epoch;
+            _swept_epoch = touch_clock().fetch_add(1, std::memory_order_relaxed) + 1;
+            std::vector<Entry*> expired;
+            std::size_t kept_count = 0;
+            for(Entry* entry : _entries)
+            {
+                if(entry->metric->touched().since(previous_epoch) || entry->used.exchange(false, std::memory_order_relaxed) ||
+                   entry->metric.use_count() > 1)
+                {
+                    entry->touched = now;
+                }
+                if(now - entry->touched > _limits.ttl)
+                {
+                    expired.push_back(entry);
+                }
+                else
+                {
+                    _entries[kept_count++] = entry;
+                }
+            }
+            if(expired.empty())
+            {
+                return 0;
+            }
+            _entries.resize(kept_count);
+
+            // Publishing a table without the expired children, then freeing them once no lookup can see them anymore.
+            // The table has room for the expired children found by lookups in the meantime, which are put back.
+            std::size_t table_size = initial_table_size;
+            while((kept_count + expired.size()) * 2 > table_size)
+            {
+                table_size *= 2;
+            }
+            std::unique_ptr<Table> table(new Table(table_size));
+            for(const Entry* entry : _entries)
+            {
+                insert(*table, *entry);
+            }
+            _table.store(table.get(), std::memory_order_seq_cst);
+            wait_readers();
+            _tables.clear();
+            _tables.push_back(std::move(table));
+            std::size_t removed_count = 0;
+            for(Entry* entry : expired)
+            {
+                if(entry->used.load(std::memory_order_relaxed) || entry->metric.use_count() > 1)
+                {
+                    _entries.push_back(entry);
+                    insert(*_tables.back(), *entry);
+                    continue;
+                }
+                entry->~Entry();
+                _arena->deallocate(entry, sizeof(Entry));
+                removed_count++;
+            }
+            // New label combinaisons may fit again
+            _full.store(false, std::memory_order_relaxed);
+            return removed_count;
+        }
+
+        template <typename... Args>
+        std::shared_ptr<T> labels(const std::set<Label> &labels, Args &&... args)
+        {
+            // Existing label combinaisons are found without locking, and a label set
+            // that does not follow the family labels names was never inserted
+            const std::uint64_t hash = hash_labels(labels);
+            auto match = [&](const LabelSet& key){return key.matches(labels);};
+            if(std::shared_ptr<T> metric = lookup(hash, match))
+            {
+                return metric;
+            }
+
+            // Verify label set size
+            if (labels.size() != _labels_names.size())
+            {
+                throw std::invalid_argument("Incorrect number of label given");
+            }
+
+            // Verify label set names
+            auto pred = [&](const Label& l){return _labels_names.find(l.name) == _labels_names.end();};
+            if(std::any_of(labels.begin(), labels.end(), pred))
+            {
+                throw std::invalid_argument("Incorrect label combinaison given");
+            }
+
+            return create(hash, match, labels, args...);
+        }
+
+        // Same as labels, with label values given in label names declaration order. No label set is built
+        // when the label combinaison already exists.
+        template <std::size_t N, typename... Args>
+        std::shared_ptr<T> with_labels(const std::array<LabelValue, N>& values, Args &&... args)
+        {
+            // Verify label values count
+            if (N != _labels_names.size())
+            {
+                throw std::invalid_argument("Incorrect number of label given");
+            }
+
+            std::uint64_t hash = label_hash_seed;
+            for(std::size_t i = 0; i < N; i++)
+            {
+                const LabelValue& value = values[_value_positions[i]];
+                hash = hash_label_value(hash, value.data, value.size);
+            }
+            auto match = [&](const LabelSet& key){
+                if(key.size() != N)
+                {
+                    return false;
+                }
+                for(std::size_t i = 0; i < N; i++)
+                {
+                    const std::string& label_value = key.value(i);
+                    const LabelValue& value = values[_value_positions[i]];
+                    if(label_value.size() != value.size || label_value.compare(0, value.size, value.data, value.size) != 0)
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            };
+            if(std::shared_ptr<T> metric = lookup(hash, match))
+            {
+                return metric;
+            }
+
+            std::set<Label> labels;
+            std::size_t i = 0;
+            for(const auto& name : _labels_names)
+            {
+                const LabelValue& value = values[_value_positions[i++]];
+                labels.insert(labels.end(), {name, std::string(value.data, value.size)});
+            }
+            return create(hash, match, labels, args...);
+        }
+
+        // The children are serialized from a copy of their list, children creations do not wait for the serialization
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            std::lock_guard<std::mutex> serialization_lock(_serialization_mtx);
+            copy_entries();
+            for(const Entry* entry : _serialized)
+            {
+                serializer.serialize(entry->labels, *entry->metric);
+            }
+        }
+
+        virtual std::size_t children_count() const override
+        {
+            return size();
+        }
+
+        // Parts are cut from a copy of the children list, as in serialize
+        virtual void serialize_parts(const std::size_t part_size, const PartsRunner& run) const override
+        {
+            std::lock_guard<std::mutex> serialization_lock(_serialization_mtx);
+            copy_entries();
+            const std::size_t parts_count = std::max<std::size_t>(1, (_serialized.size() + part_size - 1) / part_size);
+            run(parts_count, [this, part_size](const std::size_t part, MetricSerializer& serializer){
+                const std::size_t last = std::min(_serialized.size(), (part + 1) * part_size);
+                for(std::size_t i = part * part_size; i < last; i++)
+                {
+                    serializer.serialize(_serialized[i]->labels, *_serialized[i]->metric);
+                }
+            });
+        }
+
+        // Must be called with _serialization_mtx locked. Entries are only freed by expiry, which it excludes,
+        // so their copies stay valid once _metrics_mtx is released.
+        void copy_entries() const
+        {
+            CountedLock lock(_metrics_mtx, _lock_contentions);
+            _serialized.assign(_entries.begin(), _entries.end());
+        }
+
+        // Create the new metric, unless another thread did it since the lookup
+        template <typename Match, typename... Args>
+        std::shared_ptr<T> create(const std::uint64_t hash, const Match& match, const std::set<Label> &labels, Args &&... args)
+        {
+            // Label combinaisons not found once the family is full overflow without locking
+            if(_full.load(std::memory_order_acquire))
+            {
+                return _overflow;
+            }
+            CountedLock lock(_metrics_mtx, _lock_contentions);
+            if(const Entry* entry = find(hash, match))
+            {
+                return entry->metric;
+            }
+            if(_limits.max_cardinality != 0 && _entries.size() >= _limits.max_cardinality)
+            {
+                return overflow(args...);
+            }
+            return add(hash, labels, args...);
+        }
+
+        // Must be called with _metrics_mtx locked
+        template <typename... Args>
+        std::shared_ptr<T> add(const std::uint64_t hash, const std::set<Label> &labels, Args &&... args)
+        {
+            // The metric and its shared_ptr control block come right after the entry
+            void* entry_memory = _arena->allocate(sizeof(Entry), alignof(Entry));
+            std::shared_ptr<T> new_metric;
+            try
+            {
+                new_metric = std::allocate_shared<T>(ArenaAllocator<T>(_arena), args...);
+            }
+            catch(...)
+            {
+                _arena->deallocate(entry_memory, sizeof(Entry));
+                throw;
+            }
+            Entry* entry = new(entry_memory) Entry(labels, hash, new_metric);
+            _entries.push_back(entry);
+            index(*entry);
+            _children_created.fetch_add(1, std::memory_order_relaxed);
+            return new_metric;
+        }
+
+        // Child of a new label combinaison once the maximum cardinality is reached.
+        // Must be called with _metrics_mtx locked.
+        template <typename... Args>
+        std::shared_ptr<T> overflow(Args &&... args)
+        {
+            // The overflow child never changes once created, it is then read without locking
+            if(!_overflow)
+            {
+                if(_limits.overflow_policy == OverflowPolicy::Drop)
+                {
+                    _overflow = std::make_shared<T>(args...);
+                }
+                else
+                {
+                    std::set<Label> labels;
+                    std::uint64_t hash = label_hash_seed;
+                    for(const auto& name : _labels_names)
+                    {
+                        labels.insert(labels.end(), {name, overflow_label_value});
+                        hash = hash_label_value(hash, overflow_label_value.data(), overflow_label_value.size());
+                    }
+                    const Entry* entry = find(hash, [&](const LabelSet& key){return key.matches(labels);});
+                    _overflow = entry != nullptr ? entry->metric : add(hash, labels, args...);
+                }
+            }
+            _full.store(true, std::memory_order_release);
+            return _overflow;
+        }
+
+        // Hash of the label values, in label names order
+        static std::uint64_t hash_labels(const std::set<Label> &labels)
+        {
+            std::uint64_t hash = label_hash_seed;
+            for(const auto& label : labels)
+            {
+                hash = hash_label_value(hash, label.value.data(), label.value.size());
+            }
+            return hash;
+        }
+
+    protected:
+        struct Entry
+        {
+            Entry(const std::set<Label>& labels, const std::uint64_t hash, const std::shared_ptr<T>& metric)
+                : labels(labels), hash(hash), metric(metric), touched(std::chrono::steady_clock::now())
+            {
+            }
+
+            const LabelSet labels;
+            const std::uint64_t hash;
+            const std::shared_ptr<T> metric;
+            // Only used by expiry, with _metrics_mtx locked: last time the child was seen updated or in use
+            std::chrono::steady_clock::time_point touched;
+            // Whether the child was looked up since the last sweep
+            mutable std::atomic<bool> used = {false};
+        };
+
+        // Lookups of families whose children expire register in the readers counts of the current epoch parity.
+        // Removals move to the next epoch, and wait for the lookups of the previous one before freeing anything.
+        struct ReadersCount
+        {
+            std::atomic<std::uint64_t> count;
+            char padding[cache_line_size - sizeof(std::atomic<std::uint64_t>)];
+        };
+
+        static constexpr std::size_t readers_slots = 16;
+
+        // Metric of the entry found by find, kept alive by the returned pointer
+        template <typename Match>
+        std::shared_ptr<T> lookup(const std::uint64_t hash, const Match& match) const
+        {
+            if(!_readers)
+            {
+                const Entry* entry = find(hash, match);
+                return entry != nullptr ? entry->metric : nullptr;
+            }
+            ReadersCount* readers;
+            while(true)
+            {
+                const std::uint64_t epoch = _epoch.load(std::memory_order_seq_cst);
+                readers = &_readers[(epoch & 1) * readers_slots + thread_slot() % readers_slots];
+                readers->count.fetch_add(1, std::memory_order_seq_cst);
+                // A removal waiting for the previous epoch may have missed this lookup, which then registers again
+                if(_epoch.load(std::memory_order_seq_cst) == epoch)
+                {
+                    break;
+                }
+                readers->count.fetch_sub(1, std::memory_order_release);
+            }
+            const Entry* entry = find(hash, match);
+            std::shared_ptr<T> metric;
+            if(entry != nullptr)
+            {
+                metric = entry->metric;
+                // Looked up children are in use, only written once per sweep to keep lookups from sharing a written line
+                if(!entry->used.load(std::memory_order_relaxed))
+                {
+                    entry->used.store(true, std::memory_order_relaxed);
+                }
+            }
+            readers->count.fetch_sub(1, std::memory_order_release);
+            return metric;
+        }
+
+        // Must be called with _metrics_mtx locked, once removed children are unreachable from _table
+        void wait_readers()
+        {
+            const std::uint64_t epoch = _epoch.fetch_add(1, std::memory_order_seq_cst);
+            for(std::size_t i = 0; i < readers_slots; i++)
+            {
+                const ReadersCount& readers = _readers[(epoch & 1) * readers_slots + i];
+                while(readers.count.load(std::memory_order_seq_cst) != 0)
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        // Open addressing hash table of pointers to _entries. Slots are only ever filled, removals publish
+        // a new table, and replaced tables are kept alive while lookups may read them, so it is read without locking.
+        struct Table
+        {
+            explicit Table(const std::size_t size) : mask(size - 1), slots(new std::atomic<const Entry*>[size])
+            {
+                for(std::size_t i = 0; i < size; i++)
+                {
+                    slots[i].store(nullptr, std::memory_order_relaxed);
+                }
+            }
+
+            const std::size_t mask;
+            std::unique_ptr<std::atomic<const Entry*>[]> slots;
+        };
+
+        static constexpr std::size_t initial_table_size = 16;
+
+        // Entry of the given hash whose label set matches, or nullptr. Without lock, the entry
+        // must only be used while registered as a reader, see lookup.
+        template <typename Match>
+        const Entry* find(const std::uint64_t hash, const Match& match) const
+        {
+            // Sequentially consistent so that the table is read after registering as a reader
+            const Table* table = _table.load(std::memory_order_seq_cst);
+            for(std::size_t i = hash & table->mask;; i = (i + 1) & table->mask)
+            {
+                const Entry* entry = table->slots[i].load(std::memory_order_acquire);
+                if(entry == nullptr || (entry->hash == hash && match(entry->labels)))
+                {
+                    return entry;
+                }
+            }
+        }
+
+        // Must be called with _metrics_mtx locked
+        void index(const Entry& entry)
+        {
+            Table* table = _table.load(std::memory_order_relaxed);
+            // Keeping the load factor under 1/2, entries already contain the new entry
+            if(_entries.size() * 2 > table->mask + 1)
+            {
+                _tables.emplace_back(new Table((table->mask + 1) * 2));
+                Table* grown_table = _tables.back().get();
+                for(const Entry* e : _entries)
+                {
+                    insert(*grown_table, *e);
+                }
+                _table.store(grown_table, std::memory_order_release);
+            }
+            else
+            {
+                insert(*table, entry);
+            }
+        }
+
+        static void insert(Table& table, const Entry& entry)
+        {
+            std::size_t i = entry.hash & table.mask;
+            while(table.slots[i].load(std::memory_order_relaxed) != nullptr)
+            {
+                i = (i + 1) & table.mask;
+            }
+            table.slots[i].store(&entry, std::memory_order_release);
+        }
+
+    protected:
+        const std::set<std::string> _labels_names;
+        // Position among with_labels values of the value of each label name, in sorted names order
+        std::vector<std::size_t> _value_positions = {};
+        mutable std::mutex _metrics_mtx;
+        // Held by serializations and expiry, never by updates, lookups or creations
+        mutable std::mutex _serialization_mtx;
+        // Children being serialized, only used with _serialization_mtx locked
+        mutable std::vector<const Entry*> _serialized = {};
+        std::shared_ptr<ChildrenArena> _arena = std::make_shared<ChildrenArena>();
+        std::vector<Entry*> _entries = {};
+        std::vector<std::unique_ptr<Table>> _tables = {};
+        std::atomic<Table*> _table;
+        FamilyLimits _limits = {};
+        // Child of the overflowed label combinaisons, never exposed with the Drop policy
+        std::shared_ptr<T> _overflow = {};
+        // Whether the family reached its maximum cardinality, until children are removed
+        std::atomic<bool> _full = {false};
+        // Only allocated for families whose children expire
+        std::unique_ptr<ReadersCount[]> _readers = {};
+        std::atomic<std::uint64_t> _epoch = {0};
+        // Epoch of touch_clock started by the last sweep, only used with _metrics_mtx locked
+        std::uint32_t _swept_epoch = touch_clock().load(std::memory_order_relaxed);
+        std::atomic<std::uint64_t> _children_created = {0};
+        mutable std::atomic<std::uint64_t> _lock_contentions = {0};
+    };
+
+    //////////////////////////////////////////////////////
+    //// PENDING LOCAL UPDATES
+    //////////////////////////////////////////////////////
+
+    // Updates pending in a local accumulator, see LocalCounter and LocalHistogram: the additions of a counter,
+    // or the sum and bucket counts of a histogram. Only the thread of the accumulator writes them, with relaxed
+    // stores, and flushes write sequence as a seqlock so that the updates are read either pending or flushed.
+    struct LocalPending
+    {
+        explicit LocalPending(const std::size_t counts_size = 0) : counts(counts_size)
+        {
+            for(auto& count : counts)
+            {
+                count.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        // Odd while the pending updates are moved into the metric
+        std::atomic<std::uint32_t> sequence = {0};
+        std::atomic<double> value = {0};
+        std::vector<std::atomic<std::uint64_t>> counts;
+    };
+
+    // Pending updates of the local accumulators of a metric, which its reads add to its own values.
+    // Its state is allocated along with the first accumulator, so that other metrics only pay for a pointer.
+    class LocalPendings
+    {
+    public:
+        LocalPendings() = default;
+        LocalPendings(const LocalPendings&) = delete;
+        LocalPendings& operator=(const LocalPendings&) = delete;
+
+        ~LocalPendings()
+        {
+            delete _state.load(std::memory_order_relaxed);
+        }
+
+        void add(const LocalPending& pending)
+        {
+            State* state = _state.load(std::memory_order_acquire);
+            if(state == nullptr)
+            {
+                // The first accumulators race to publish the state, the losers free theirs
+                std::unique_ptr<State> new_state(new State());
+                if(_state.compare_exchange_strong(state, new_state.get(), std::memory_order_acq_rel))
+                {
+                    state = new_state.release();
+                }
+            }
+            std::lock_guard<std::mutex> lock(state->mtx);
+            state->pendings.push_back(&pending);
+            state->sequences.push_back(0);
+        }
+
+        void remove(const LocalPending& pending)
+        {
+            State* state = _state.load(std::memory_order_acquire);
+            std::lock_guard<std::mutex> lock(state->mtx);
+            state->pendings.erase(std::find(state->pendings.begin(), state->pendings.end(), &pending));
+            state->sequences.pop_back();
+        }
+
+        // read(), a value of the metric, plus pending(p) for each accumulator, read in between flushes of the accumulators.
+        // Accumulators never wait for it, it is retried when one of them flushes meanwhile.
+        template <typename T, typename Read, typename Pending>
+        T total(const Read& read, const Pending& pending) const
+        {
+            State* state = _state.load(std::memory_order_acquire);
+            if(state == nullptr)
+            {
+                return read();
+            }
+            std::lock_guard<std::mutex> lock(state->mtx);
+            while(true)
+            {
+                bool flushing = false;
+                for(std::size_t i = 0; i < state->pendings.size(); i++)
+                {
+                    state->sequences[i] = state->pendings[i]->sequence.load(std::memory_order_acquire);
+                    flushing = flushing || (state->sequences[i] & 1) != 0;
+                }
+                if(flushing)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                T value = read();
+                for(const LocalPending* p : state->pendings)
+                {
+                    value += pending(*p);
+                }
+                std::atomic_thread_fence(std::memory_order_acquire);
+                bool unchanged = true;
+                for(std::size_t i = 0; i < state->pendings.size() && unchanged; i++)
+                {
+                    unchanged = state->pendings[i]->sequence.load(std::memory_order_relaxed) == state->sequences[i];
+                }
+                if(unchanged)
+                {
+                    return value;
+                }
+            }
+        }
+
+    protected:
+        struct State
+        {
+            std::mutex mtx;
+            std::vector<const LocalPending*> pendings;
+            // Sequences of the pendings read by total, reused across reads
+            std::vector<std::uint32_t> sequences;
+        };
+
+        std::atomic<State*> _state = {nullptr};
+    };
+
+    // Brackets the moves of pending updates into their metric, see LocalPending
+    template <typename Move>
+    void flush_pending(LocalPending& pending, const Move& move)
+    {
+        const std::uint32_t sequence = pending.sequence.load(std::memory_order_relaxed);
+        pending.sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        move();
+        pending.sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+    //////////////////////////////////////////////////////
+    //// COUNTER METRIC
+    //////////////////////////////////////////////////////
+
+    // Storage used by a counter to hold its value
+    enum class CounterStorage
+    {
+        // Atomic integer for whole increments and atomic double for the others, contended when many threads update the counter
+        Atomic,
+        // Per-thread padded shards summed on read, for counters updated from many threads
+        Sharded
+    };
+
+    // Whole numbers up to which doubles are exact, counters add those to an integer
+    constexpr double max_exact_integer = 9007199254740992.0;
+
+    class Counter
+    {
+    public:
+        explicit Counter(const CounterStorage storage = CounterStorage::Atomic)
+            : _whole(0), _fraction(0), _shards(storage == CounterStorage::Sharded ? new sharded_double() : nullptr), _created(unix_time()), _created_text(_created)
+        {
+        }
+
+        // Additions pending in local accumulators included
+        double get() const
+        {
+            return _locals.total<double>([this](){return value();}, [](const LocalPending& pending){return pending.value.load(std::memory_order_relaxed);});
+        }
+
+        void inc()
+        {
+            _touched.touch();
+            if(_shards)
+            {
+                _shards->add(1);
+            }
+            else
+            {
+                _whole.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void inc(const ExemplarLabels& exemplar, const std::uint32_t one_in = 1) { add(1, exemplar, one_in); }
+
+        // Also keeps the increment as the exemplar of the counter, for one in one_in of these calls
+        void add(const double value, const ExemplarLabels& exemplar, const std::uint32_t one_in = 1)
+        {
+            if (value > 0.0)
+            {
+                increment(value);
+                if(_exemplars.sample(one_in))
+                {
+                    _exemplars.record(0, exemplar, value);
+                }
+            }
+        }
+
+        // Latest exemplar, returns false when there is none
+        bool exemplar(Exemplar& exemplar) const
+        {
+            return _exemplars.load(0, exemplar);
+        }
+
+        void add(const double value)
+        {
+            if (value > 0.0)
+            {
+                increment(value);
+            }
+        }
+
+        CounterStorage storage() const
+        {
+            return _shards ? CounterStorage::Sharded : CounterStorage::Atomic;
+        }
+
+        // Epoch of the last update, see FamilyLimits
+        const TouchEpoch& touched() const
+        {
+            return _touched;
+        }
+
+        // Additions pending in the local accumulators of the counter, see LocalCounter
+        LocalPendings& local_pendings()
+        {
+            return _locals;
+        }
+
+        // Creation time of the counter, in seconds since the unix epoch
+        double created() const
+        {
+            return _created;
+        }
+
+        const DoubleText& created_text() const
+        {
+            return _created_text;
+        }
+
+    protected:
+        // Counter holding a value read elsewhere, see CallbackCounterMetric
+        Counter(const double value, const double created)
+            : _whole(0), _fraction(value), _created(created), _created_text(created)
+        {
+        }
+
+        double value() const
+        {
+            return _shards ? _shards->load() : static_cast<double>(_whole.load(std::memory_order_relaxed)) + _fraction.load(std::memory_order_relaxed);
+        }
+
+        void increment(const double value)
+        {
+            _touched.touch();
+            if(_shards)
+            {
+                _shards->add(value);
+            }
+            else if(value < max_exact_integer && static_cast<double>(static_cast<std::uint64_t>(value)) == value)
+            {
+                _whole.fetch_add(static_cast<std::uint64_t>(value), std::memory_order_relaxed);
+            }
+            else
+            {
+                _fraction += value;
+            }
+        }
+
+        // Only used without shards
+        std::atomic<std::uint64_t> _whole;
+        atomic_double _fraction;
+        std::unique_ptr<sharded_double> _shards;
+        const double _created;
+        const DoubleText _created_text;
+        ExemplarSlots _exemplars{1};
+        LocalPendings _locals;
+        TouchEpoch _touched;
+    };
+
+    class CounterMetric : public Metric, public Counter
+    {
+    public:
+        CounterMetric(const std::string &name, const std::string &description, const CounterStorage storage = CounterStorage::Atomic)
+            : Metric(name, description, MetricType::Counter), Counter(storage)
+        {
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            serializer.serialize(no_labels, static_cast<const Counter&>(*this));
+        }
+    };
+
+    class CounterFamily : public MetricFamily<Counter>
+    {
+    public:
+        CounterFamily(const std::string& name, const std::string& description, const LabelNames& labels_names, const CounterStorage storage = CounterStorage::Atomic)
+            : MetricFamily(name, description, MetricType::Counter, labels_names), _storage(storage)
+        {
+        }
+
+        std::shared_ptr<Counter> labels(const std::set<Label> &labels)
+        {
+            return MetricFamily::labels(labels, _storage);
+        }
+
+        // Label values are given in label names declaration order, e.g. with_labels("GET", "200") for {"method", "code"}
+        template <typename... Values>
+        std::shared_ptr<Counter> with_labels(const Values&... values)
+        {
+            return MetricFamily::with_labels(std::array<LabelValue, sizeof...(Values)>{{values...}}, _storage);
+        }
+
+    protected:
+        const CounterStorage _storage;
+    };
+
+    // When local accumulators flush their pending updates into their metric
+    struct LocalFlushPolicy
+    {
+        // Number of pending updates
+        std::size_t max_pending = 1024;
+        // Time since the oldest pending update, checked every local_clock_period updates
+        std::chrono::milliseconds max_delay = std::chrono::milliseconds(1000);
+    };
+
+    // Number of updates between two clock reads of local accumulators
+    constexpr std::size_t local_clock_period = 64;
+
+    // Accumulates additions to a counter in a value of its own, moved into the counter by flushes.
+    // An accumulator must only be used by one thread. Reads of the counter, and thus scrapes, see the pending
+    // additions right away. Flushes happen when max_pending is reached, on the first update max_delay after the
+    // oldest pending one, on flush() and on destruction.
+    class LocalCounter
+    {
+    public:
+        explicit LocalCounter(const std::shared_ptr<Counter>& counter, const LocalFlushPolicy& policy = LocalFlushPolicy())
+            : _counter(counter), _policy(policy)
+        {
+            _counter->local_pendings().add(_pending);
+        }
+
+        LocalCounter(const LocalCounter&) = delete;
+        LocalCounter& operator=(const LocalCounter&) = delete;
+
+        ~LocalCounter()
+        {
+            flush();
+            _counter->local_pendings().remove(_pending);
+        }
+
+        void inc() { add(1); }
+        void add(const double value)
+        {
+            if (value > 0.0)
+            {
+                // Only this thread writes the value, stores are as cheap as plain ones
+                _pending.value.store(_pending.value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+                if(_pending_count++ == 0)
+                {
+                    _deadline = std::chrono::steady_clock::now() + _policy.max_delay;
+                }
+                if(_pending_count >= _policy.max_pending ||
+                   (_pending_count % local_clock_period == 0 && std::chrono::steady_clock::now() >= _deadline))
+                {
+                    flush();
+                }
+            }
+        }
+
+        void flush()
+        {
+            if(_pending_count != 0)
+            {
+                flush_pending(_pending, [this](){
+                    _counter->add(_pending.value.load(std::memory_order_relaxed));
+                    _pending.value.store(0, std::memory_order_relaxed);
+                });
+                _pending_count = 0;
+            }
+        }
+
+        // Additions not flushed yet
+        double pending() const
+        {
+            return _pending.value.load(std::memory_order_relaxed);
+        }
+
+    protected:
+        const std::shared_ptr<Counter> _counter;
+        const LocalFlushPolicy _policy;
+        LocalPending _pending;
+        std::size_t _pending_count = 0;
+        std::chrono::steady_clock::time_point _deadline = {};
+    };
+
+    //////////////////////////////////////////////////////
+    //// GAUGE METRIC
+    //////////////////////////////////////////////////////
+    class Gauge
+    {
+    public:
+        explicit Gauge(const double initial_value = 0) : _value(initial_value) {}
+        double get() const {return _value;}
+        // Setting the current value is an update, it keeps the gauge from expiring
+        void set(const double value) { _touched.touch(); _value = value; }
+        // Sets the gauge to the seconds since the unix epoch
+        void set_to_current_time() { set(unix_time()); }
+        void inc() { _touched.touch(); _value += 1; }
+        void dec() { _touched.touch(); _value -= 1; }
+        void add(const double value)
+        {
+            if (value > 0.0)
+            {
+                _touched.touch();
+                _value += value;
+            }
+        }
+        void sub(const double &value)
+        {
+            if (value > 0.0)
+            {
+                _touched.touch();
+                _value -= value;
+            }
+        }
+
+        // Epoch of the last update, see FamilyLimits
+        const TouchEpoch& touched() const
+        {
+            return _touched;
+        }
+
+    protected:
+        atomic_double _value;
+        TouchEpoch _touched;
+    };
+
+    class GaugeMetric : public Metric, public Gauge
+    {
+    public:
+        GaugeMetric(const std::string &name, const std::string &description, const double initial_value = 0)
+            : Metric(name, description, MetricType::Gauge), Gauge(initial_value)
+        {
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            serializer.serialize(no_labels, static_cast<const Gauge&>(*this));
+        }
+    };
+
+    class GaugeFamily : public MetricFamily<Gauge>
+    {
+    public:
+        GaugeFamily(const std::string &name, const std::string &description, const LabelNames &labels_names)
+            : MetricFamily(name, description, MetricType::Gauge, labels_names)
+        {
+        }
+
+        std::shared_ptr<Gauge> labels(const std::set<Label> &labels, const double default_value = 0)
+        {
+            return MetricFamily::labels(labels, default_value);
+        }
+
+        // Label values are given in label names declaration order, e.g. with_labels("GET", "200") for {"method", "code"}
+        template <typename... Values>
+        std::shared_ptr<Gauge> with_labels(const Values&... values)
+        {
+            return MetricFamily::with_labels(std::array<LabelValue, sizeof...(Values)>{{values...}}, 0.0);
+        }
+    };
+
+    //////////////////////////////////////////////////////
+    //// HISTOGRAM METRIC
+    //////////////////////////////////////////////////////
+    const std::set<double> default_buckets = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+    class Histogram
+    {
+    public:
+        explicit Histogram(const std::set<double>& buckets = default_buckets)
+            : _bounds(buckets.begin(), buckets.end()), _sum(0), _created(unix_time()), _created_text(_created), _exemplars(buckets.size() + 1)
+        {
+            // Creating buckets, bounds are sorted and always end with +Inf
+            if(_bounds.empty() || _bounds.back() != std::numeric_limits<double>::infinity())
+            {
+                _bounds.push_back(std::numeric_limits<double>::infinity());
+            }
+            _counts = std::vector<std::atomic<std::uint64_t>>(_bounds.size());
+
+            // le labels are formatted once here and reused on every serialization
+            _le_labels.reserve(_bounds.size());
+            for(const auto& bound : _bounds)
+            {
+                _le_labels.push_back({"le", format_double(bound)});
+            }
+        }
+
+        // The count, which tells scrape caches that the histogram changed, is updated last, see child_activity
+        void observe(const double value)
+        {
+            _touched.touch();
+            _sum += value;
+            // Counts are stored per bucket, they are only accumulated when read
+            _counts[bucket_index(value)].fetch_add(1, std::memory_order_release);
+        }
+
+        // Also keeps the observation as the exemplar of its bucket, for one in one_in of these calls
+        void observe(const double value, const ExemplarLabels& exemplar, const std::uint32_t one_in = 1)
+        {
+            _touched.touch();
+            _sum += value;
+            const std::size_t index = bucket_index(value);
+            _counts[index].fetch_add(1, std::memory_order_release);
+            if(_exemplars.sample(one_in))
+            {
+                _exemplars.record(index, exemplar, value);
+            }
+        }
+
+        // Latest exemplar of the bucket at index, returns false when there is none
+        bool exemplar(const std::size_t index, Exemplar& exemplar) const
+        {
+            return _exemplars.load(index, exemplar);
+        }
+
+        // Adds observations given by their number per bucket, not accumulated, and their sum
+        void observe_many(const std::vector<std::uint64_t>& bucket_counts, const double sum)
+        {
+            _touched.touch();
+            _sum += sum;
+            for(std::size_t i = 0; i < bucket_counts.size() && i < _counts.size(); i++)
+            {
+                if(bucket_counts[i] != 0)
+                {
+                    _counts[i].fetch_add(bucket_counts[i], std::memory_order_release);
+                }
+            }
+        }
+
+        // Index of the first bucket whose upper bound is greater or equal to value
+        std::size_t bucket_index(const double value) const
+        {
+            if(std::isnan(value))
+            {
+                return _bounds.size() - 1;
+            }
+            return std::lower_bound(_bounds.begin(), _bounds.end(), value) - _bounds.begin();
+        }
+
+        // Cumulative count of observations per bucket upper bound. Reads include the observations pending in local accumulators.
+        std::map<double, double> buckets() const
+        {
+            std::map<double, double> res;
+            std::uint64_t cumulative_count = 0;
+            for(std::size_t i = 0; i < _bounds.size(); i++)
+            {
+                cumulative_count += bucket_count(i);
+                res.insert({_bounds[i], static_cast<double>(cumulative_count)});
+            }
+            return res;
+        }
+
+        double sum() const
+        {
+            return _locals.total<double>([this](){return _sum.load();}, [](const LocalPending& pending){return pending.value.load(std::memory_order_relaxed);});
+        }
+
+        // Values written by the observations counted are visible once it returned
+        std::uint64_t count() const
+        {
+            auto sum_counts = [](const std::vector<std::atomic<std::uint64_t>>& counts){
+                std::uint64_t total_count = 0;
+                for(const auto& count : counts)
+                {
+                    total_count += count.load(std::memory_order_acquire);
+                }
+                return total_count;
+            };
+            return _locals.total<std::uint64_t>([&](){return sum_counts(_counts);}, [&](const LocalPending& pending){return sum_counts(pending.counts);});
+        }
+
+        // Buckets upper bounds, the last one is +Inf
+        const std::vector<double>& bounds() const
+        {
+            return _bounds;
+        }
+
+        // Number of observations of the bucket at index, not accumulated with previous buckets
+        std::uint64_t bucket_count(const std::size_t index) const
+        {
+            return _locals.total<std::uint64_t>([&](){return _counts[index].load(std::memory_order_acquire);},
+                                                [&](const LocalPending& pending){return pending.counts[index].load(std::memory_order_acquire);});
+        }
+
+        // le label of the bucket at index
+        const Label& le_label(const std::size_t index) const
+        {
+            return _le_labels[index];
+        }
+
+        // Observations pending in the local accumulators of the histogram, see LocalHistogram
+        LocalPendings& local_pendings()
+        {
+            return _locals;
+        }
+
+        // Epoch of the last update, see FamilyLimits
+        const TouchEpoch& touched() const
+        {
+            return _touched;
+        }
+
+        // Creation time of the histogram, in seconds since the unix epoch
+        double created() const
+        {
+            return _created;
+        }
+
+        const DoubleText& created_text() const
+        {
+            return _created_text;
+        }
+
+    protected:
+        std::vector<double> _bounds;
+        std::vector<std::atomic<std::uint64_t>> _counts;
+        std::vector<Label> _le_labels;
+        atomic_double _sum;
+        const double _created;
+        const DoubleText _created_text;
+        ExemplarSlots _exemplars;
+        LocalPendings _locals;
+        TouchEpoch _touched;
+    };
+
+    class HistogramMetric : public Metric, public Histogram
+    {
+    public:
+        HistogramMetric(const std::string &name, const std::string &description, const std::set<double>& buckets = default_buckets)
+            : Metric(name, description, MetricType::Histogram), Histogram(buckets)
+        {
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            serializer.serialize(no_labels, static_cast<const Histogram&>(*this));
+        }
+    };
+
+    class HistogramFamily : public MetricFamily<Histogram>
+    {
+    public:
+        HistogramFamily(const std::string &name, const std::string &description, const LabelNames &labels_names, const std::set<double>& buckets = default_buckets)
+            : MetricFamily(name, description, MetricType::Histogram, labels_names), _buckets(buckets)
+        {
+            if(labels_names.contains("le"))
+            {
+                throw std::invalid_argument("Histogram label names cannot contain le");
+            }
+        }
+
+        std::shared_ptr<Histogram> labels(const std::set<Label> &labels)
+        {
+            return MetricFamily::labels(labels, _buckets);
+        }
+
+        // Label values are given in label names declaration order, e.g. with_labels("GET", "200") for {"method", "code"}
+        template <typename... Values>
+        std::shared_ptr<Histogram> with_labels(const Values&... values)
+        {
+            return MetricFamily::with_labels(std::array<LabelValue, sizeof...(Values)>{{values...}}, _buckets);
+        }
+
+    protected:
+        const std::set<double> _buckets;
+    };
+
+    // Accumulates observations of a histogram in bucket counts of its own, moved into the histogram by flushes.
+    // Reads of the histogram see them right away and flushes happen, as for LocalCounter.
+    class LocalHistogram
+    {
+    public:
+        explicit LocalHistogram(const std::shared_ptr<Histogram>& histogram, const LocalFlushPolicy& policy = LocalFlushPolicy())
+            : _histogram(histogram), _policy(policy), _pending(histogram->bounds().size()), _bucket_counts(histogram->bounds().size(), 0)
+        {
+            _histogram->local_pendings().add(_pending);
+        }
+
+        LocalHistogram(const LocalHistogram&) = delete;
+        LocalHistogram& operator=(const LocalHistogram&) = delete;
+
+        ~LocalHistogram()
+        {
+            flush();
+            _histogram->local_pendings().remove(_pending);
+        }
+
+        // As for Histogram::observe, the count is updated last
+        void observe(const double value)
+        {
+            _pending.value.store(_pending.value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+            std::atomic<std::uint64_t>& count = _pending.counts[_histogram->bucket_index(value)];
+            count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            if(_pending_count++ == 0)
+            {
+                _deadline = std::chrono::steady_clock::now() + _policy.max_delay;
+            }
+            if(_pending_count >= _policy.max_pending ||
+               (_pending_count % local_clock_period == 0 && std::chrono::steady_clock::now() >= _deadline))
+            {
+                flush();
+            }
+        }
+
+        void flush()
+        {
+            if(_pending_count != 0)
+            {
+                flush_pending(_pending, [this](){
+                    for(std::size_t i = 0; i < _bucket_counts.size(); i++)
+                    {
+                        _bucket_counts[i] = _pending.counts[i].load(std::memory_order_relaxed);
+                        _pending.counts[i].store(0, std::memory_order_relaxed);
+                    }
+                    _histogram->observe_many(_bucket_counts, _pending.value.load(std::memory_order_relaxed));
+                    _pending.value.store(0, std::memory_order_relaxed);
+                });
+                _pending_count = 0;
+            }
+        }
+
+        // Observations not flushed yet
+        std::size_t pending() const
+        {
+            return _pending_count;
+        }
+
+    protected:
+        const std::shared_ptr<Histogram> _histogram;
+        const LocalFlushPolicy _policy;
+        LocalPending _pending;
+        // Counts handed to observe_many by flushes
+        std::vector<std::uint64_t> _bucket_counts;
+        std::size_t _pending_count = 0;
+        std::chrono::steady_clock::time_point _deadline = {};
+    };
+
+    //////////////////////////////////////////////////////
+    //// NATIVE HISTOGRAM METRIC
+    //////////////////////////////////////////////////////
+
+    // Observations of a native histogram at a point in time, buckets are sorted by index
+    struct NativeHistogramSnapshot
+    {
+        std::int32_t schema = 0;
+        double zero_threshold = 0;
+        std::uint64_t zero_count = 0;
+        std::uint64_t count = 0;
+        double sum = 0;
+        std::vector<std::pair<std::int32_t, std::uint64_t>> positive_buckets;
+        std::vector<std::pair<std::int32_t, std::uint64_t>> negative_buckets;
+    };
+
+    constexpr std::int32_t native_histogram_min_schema = -4;
+    constexpr std::int32_t native_histogram_max_schema = 8;
+    // Observations closer to 0 than this threshold are counted in the zero bucket
+    constexpr double native_histogram_zero_threshold = 2.938735877055719e-39;
+
+    // Fraction bounds of schema buckets: 2^(i/2^schema - 1) for i in [0, 2^schema), schema > 0
+    inline const std::vector<double>& native_histogram_fraction_bounds(const std::int32_t schema)
+    {
+        static const std::vector<std::vector<double>> bounds = [](){
+            std::vector<std::vector<double>> res(native_histogram_max_schema + 1);
+            for(std::int32_t s = 1; s <= native_histogram_max_schema; s++)
+            {
+                const std::int32_t size = 1 << s;
+                for(std::int32_t i = 0; i < size; i++)
+                {
+                    res[s].push_back(std::exp2(static_cast<double>(i - size) / size));
+                }
+            }
+            return res;
+        }();
+        return bounds[schema];
+    }
+
+    // Index of the bucket holding a positive finite value for schema. Bucket i covers (2^((i-1)/2^schema), 2^(i/2^schema)].
+    inline std::int32_t native_histogram_index(const double value, const std::int32_t schema)
+    {
+        // Reading the fraction and exponent right from the double bits, value = fraction * 2^exponent with fraction in [0.5, 1)
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        std::int32_t exponent = static_cast<std::int32_t>((bits >> 52) & 0x7ff) - 1022;
+        double fraction;
+        if(exponent == -1022)
+        {
+            // Subnormal values
+            int subnormal_exponent;
+            fraction = std::frexp(value, &subnormal_exponent);
+            exponent = subnormal_exponent;
+        }
+        else
+        {
+            bits = (bits & 0x800fffffffffffffULL) | (1022ULL << 52);
+            std::memcpy(&fraction, &bits, sizeof(fraction));
+        }
+
+        if(schema > 0)
+        {
+            const std::vector<double>& bounds = native_histogram_fraction_bounds(schema);
+            const std::int32_t fraction_index = static_cast<std::int32_t>(std::lower_bound(bounds.begin(), bounds.end(), fraction) - bounds.begin());
+            return fraction_index + (exponent - 1) * static_cast<std::int32_t>(bounds.size());
+        }
+        // Powers of two are the upper bound of their bucket
+        const std::int32_t index = fraction == 0.5 ? exponent - 1 : exponent;
+        const std::int32_t offset = (1 << -schema) - 1;
+        return (index + offset) >> -schema;
+    }
+
+    // Upper bound of the bucket at index for schema
+    inline double native_histogram_upper_bound(const std::int32_t index, const std::int32_t schema)
+    {
+        if(schema > 0)
+        {
+            const std::int32_t size = 1 << schema;
+            const std::int32_t fraction_index = index & (size - 1);
+            return std::ldexp(native_histogram_fraction_bounds(schema)[fraction_index] * 2, (index - fraction_index) / size);
+        }
+        return std::ldexp(1, index * (1 << -schema));
+    }
+
+    // Lower bound of the bucket at index for schema, excluded from positive buckets and included in negative ones
+    inline double native_histogram_lower_bound(const std::int32_t index, const std::int32_t schema)
+    {
+        return native_histogram_upper_bound(index - 1, schema);
+    }
+
+    // Prometheus native histogram: exponential buckets of base 2^(2^-schema) that are only stored while populated,
+    // in a table sized from their count that grows as buckets are populated. Whenever more than max_buckets are
+    // populated, the schema is decreased, merging buckets two by two.
+    class NativeHistogram
+    {
+    public:
+        explicit NativeHistogram(const std::int32_t schema = 3, const std::size_t max_buckets = 160)
+            : _max_buckets(max_buckets), _zero_count(0), _count(0), _sum(0), _created(unix_time()), _created_text(_created)
+        {
+            if(schema < native_histogram_min_schema || schema > native_histogram_max_schema)
+            {
+                throw std::invalid_argument("Native histogram schema must be between -4 and 8");
+            }
+            _table.store(new Table(schema, min_table_size), std::memory_order_release);
+        }
+
+        NativeHistogram(const NativeHistogram&) = delete;
+        NativeHistogram& operator=(const NativeHistogram&) = delete;
+
+        ~NativeHistogram()
+        {
+            delete _table.load(std::memory_order_relaxed);
+        }
+
+        // The count, which tells scrape caches that the histogram changed, is updated last, see child_activity
+        void observe(const double value)
+        {
+            _touched.touch();
+            _sum += value;
+            if(std::isnan(value))
+            {
+                _count.fetch_add(1, std::memory_order_release);
+                return;
+            }
+            if(std::fabs(value) <= native_histogram_zero_threshold)
+            {
+                _zero_count.fetch_add(1, std::memory_order_relaxed);
+                _count.fetch_add(1, std::memory_order_release);
+                return;
+            }
+            const double magnitude = std::min(std::fabs(value), std::numeric_limits<double>::max());
+            while(true)
+            {
+                std::atomic<std::uint64_t>& users = register_user();
+                Table* table = _table.load(std::memory_order_seq_cst);
+                if(table->frozen.load(std::memory_order_seq_cst))
+                {
+                    users.fetch_sub(1, std::memory_order_release);
+                    std::lock_guard<std::mutex> lock(_replacement_mtx);
+                    continue;
+                }
+                const std::int64_t key = bucket_key(native_histogram_index(magnitude, table->schema), value < 0);
+                bool is_new_bucket = false;
+                Slot* slot = table->find_or_claim(key, is_new_bucket);
+                if(slot != nullptr)
+                {
+                    slot->count.fetch_add(1, std::memory_order_relaxed);
+                }
+                users.fetch_sub(1, std::memory_order_release);
+                if(slot != nullptr)
+                {
+                    _count.fetch_add(1, std::memory_order_release);
+                }
+                if(slot == nullptr || (is_new_bucket && needs_replacement(*table)))
+                {
+                    replace(table);
+                }
+                if(slot != nullptr)
+                {
+                    return;
+                }
+            }
+        }
+
+        std::int32_t schema() const
+        {
+            std::atomic<std::uint64_t>& users = register_user();
+            const std::int32_t schema = _table.load(std::memory_order_seq_cst)->schema;
+            users.fetch_sub(1, std::memory_order_release);
+            return schema;
+        }
+
+        double sum() const
+        {
+            return _sum;
+        }
+
+        // Values written by the observations counted are visible once it returned
+        std::uint64_t count() const
+        {
+            return _count.load(std::memory_order_acquire);
+        }
+
+        // Epoch of the last update, see FamilyLimits
+        const TouchEpoch& touched() const
+        {
+            return _touched;
+        }
+
+        // Creation time of the histogram, in seconds since the unix epoch
+        double created() const
+        {
+            return _created;
+        }
+
+        const DoubleText& created_text() const
+        {
+            return _created_text;
+        }
+
+        // Fills snapshot with the current observations, reusing its buckets storage
+        void collect(NativeHistogramSnapshot& snapshot) const
+        {
+            snapshot.zero_threshold = native_histogram_zero_threshold;
+            snapshot.zero_count = _zero_count.load(std::memory_order_relaxed);
+            snapshot.count = count();
+            snapshot.sum = sum();
+            snapshot.positive_buckets.clear();
+            snapshot.negative_buckets.clear();
+            std::atomic<std::uint64_t>& users = register_user();
+            const Table* table = _table.load(std::memory_order_seq_cst);
+            snapshot.schema = table->schema;
+            for(std::size_t i = 0; i <= table->mask; i++)
+            {
+                const std::int64_t key = table->slots[i].key.load(std::memory_order_acquire);
+                const std::uint64_t count = table->slots[i].count.load(std::memory_order_relaxed);
+                if(key != empty_key && count != 0)
+                {
+                    auto& buckets = (key & 1) ? snapshot.negative_buckets : snapshot.positive_buckets;
+                    buckets.push_back({static_cast<std::int32_t>(key >> 1), count});
+                }
+            }
+            users.fetch_sub(1, std::memory_order_release);
+            std::sort(snapshot.positive_buckets.begin(), snapshot.positive_buckets.end());
+            std::sort(snapshot.negative_buckets.begin(), snapshot.negative_buckets.end());
+        }
+
+    protected:
+        struct Slot
+        {
+            std::atomic<std::int64_t> key;
+            std::atomic<std::uint64_t> count;
+        };
+
+        static constexpr std::int64_t empty_key = std::numeric_limits<std::int64_t>::min();
+        static constexpr std::size_t min_table_size = 8;
+
+        // Open addressing table of the populated buckets, slots are claimed with a CAS on their key
+        struct Table
+        {
+            Table(const std::int32_t table_schema, const std::size_t size)
+                : schema(table_schema), mask(size - 1), slots(new Slot[size]), populated(0), frozen(false)
+            {
+                for(std::size_t i = 0; i < size; i++)
+                {
+                    slots[i].key.store(empty_key, std::memory_order_relaxed);
+                    slots[i].count.store(0, std::memory_order_relaxed);
+                }
+            }
+
+            // Slot of key, claimed if needed, or nullptr when the table is full
+            Slot* find_or_claim(const std::int64_t key, bool& is_new_bucket)
+            {
+                std::size_t i = static_cast<std::size_t>(key * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+                for(std::size_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask)
+                {
+                    std::int64_t slot_key = slots[i].key.load(std::memory_order_acquire);
+                    if(slot_key == empty_key && slots[i].key.compare_exchange_strong(slot_key, key, std::memory_order_acq_rel))
+                    {
+                        populated.fetch_add(1, std::memory_order_relaxed);
+                        is_new_bucket = true;
+                        return &slots[i];
+                    }
+                    if(slot_key == key)
+                    {
+                        return &slots[i];
+                    }
+                }
+                return nullptr;
+            }
+
+            const std::int32_t schema;
+            const std::size_t mask;
+            std::unique_ptr<Slot[]> slots;
+            std::atomic<std::size_t> populated;
+            std::atomic<bool> frozen;
+        };
+
+        static std::int64_t bucket_key(const std::int32_t index, const bool negative)
+        {
+            return static_cast<std::int64_t>(index) * 2 + (negative ? 1 : 0);
+        }
+
+        // Smallest table keeping the load factor of populated buckets under 1/2
+        static std::size_t table_size(const std::size_t populated)
+        {
+            std::size_t size = min_table_size;
+            while(size <= populated * 2)
+            {
+                size *= 2;
+            }
+            return size;
+        }
+
+        // Whether the table holds too many buckets for its schema or its size
+        bool needs_replacement(const Table& table) const
+        {
+            const std::size_t populated = table.populated.load(std::memory_order_relaxed);
+            return (populated > _max_buckets && table.schema > native_histogram_min_schema) || populated * 2 > table.mask + 1;
+        }
+
+        // Observations and collections register in the users count of the current epoch parity. Replacements move
+        // to the next epoch and wait for the users of the previous one, as lookups of expiring family children do.
+        std::atomic<std::uint64_t>& register_user() const
+        {
+            while(true)
+            {
+                const std::uint64_t epoch = _epoch.load(std::memory_order_seq_cst);
+                std::atomic<std::uint64_t>& users = _users[epoch & 1];
+                users.fetch_add(1, std::memory_order_seq_cst);
+                // A replacement waiting for the previous epoch may have missed this user, which then registers again
+                if(_epoch.load(std::memory_order_seq_cst) == epoch)
+                {
+                    return users;
+                }
+                users.fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        // Must be called with _replacement_mtx locked
+        void wait_users()
+        {
+            const std::uint64_t epoch = _epoch.fetch_add(1, std::memory_order_seq_cst);
+            while(_users[epoch & 1].load(std::memory_order_seq_cst) != 0)
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        // Copy of the buckets of source in a table of schema, which is the schema of source or the one below it
+        static Table* copy(const Table& source, const std::int32_t schema)
+        {
+            std::unique_ptr<Table> table(new Table(schema, table_size(source.populated.load(std::memory_order_relaxed))));
+            for(std::size_t i = 0; i <= source.mask; i++)
+            {
+                const std::int64_t key = source.slots[i].key.load(std::memory_order_relaxed);
+                const std::uint64_t count = source.slots[i].count.load(std::memory_order_relaxed);
+                if(key != empty_key && count != 0)
+                {
+                    // Buckets 2i-1 and 2i merge into bucket i
+                    const std::int32_t index = static_cast<std::int32_t>(key >> 1);
+                    const std::int32_t copied_index = schema == source.schema ? index : (index + 1) >> 1;
+                    bool is_new_bucket = false;
+                    table->find_or_claim(bucket_key(copied_index, key & 1), is_new_bucket)->count.fetch_add(count, std::memory_order_relaxed);
+                }
+            }
+            return table.release();
+        }
+
+        // Replaces table by a bigger one, or by tables of lower schemas until it holds at most max_buckets.
+        // The replaced table is freed once no observation or collection can see it anymore.
+        void replace(Table* table)
+        {
+            std::lock_guard<std::mutex> lock(_replacement_mtx);
+            if(_table.load(std::memory_order_relaxed) != table || !needs_replacement(*table))
+            {
+                return;
+            }
+            // Waiting for in flight observations, later ones wait for the new table
+            table->frozen.store(true, std::memory_order_seq_cst);
+            wait_users();
+            std::unique_ptr<Table> replacement;
+            try
+            {
+                const bool reduced = table->populated.load(std::memory_order_relaxed) > _max_buckets && table->schema > native_histogram_min_schema;
+                replacement.reset(copy(*table, reduced ? table->schema - 1 : table->schema));
+                while(replacement->populated.load(std::memory_order_relaxed) > _max_buckets && replacement->schema > native_histogram_min_schema)
+                {
+                    replacement.reset(copy(*replacement, replacement->schema - 1));
+                }
+                // Merged buckets may fit a smaller table
+                if(table_size(replacement->populated.load(std::memory_order_relaxed)) < replacement->mask + 1)
+                {
+                    replacement.reset(copy(*replacement, replacement->schema));
+                }
+            }
+            catch(...)
+            {
+                table->frozen.store(false, std::memory_order_seq_cst);
+                throw;
+            }
+            _table.store(replacement.release(), std::memory_order_seq_cst);
+            wait_users();
+            delete table;
+        }
+
+        const std::size_t _max_buckets;
+        std::atomic<Table*> _table;
+        std::mutex _replacement_mtx;
+        mutable std::atomic<std::uint64_t> _epoch = {0};
+        mutable std::array<std::atomic<std::uint64_t>, 2> _users = {};
+        std::atomic<std::uint64_t> _zero_count;
+        std::atomic<std::uint64_t> _count;
+        atomic_double _sum;
+        const double _created;
+        const DoubleText _created_text;
+        TouchEpoch _touched;
+    };
+
+    class NativeHistogramMetric : public Metric, public NativeHistogram
+    {
+    public:
+        NativeHistogramMetric(const std::string &name, const std::string &description, const std::int32_t schema = 3, const std::size_t max_buckets = 160)
+            : Metric(name, description, MetricType::Histogram), NativeHistogram(schema, max_buckets)
+        {
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            serializer.serialize(no_labels, static_cast<const NativeHistogram&>(*this));
+        }
+    };
+
+    class NativeHistogramFamily : public MetricFamily<NativeHistogram>
+    {
+    public:
+        NativeHistogramFamily(const std::string &name, const std::string &description, const LabelNames &labels_names,
+                              const std::int32_t schema = 3, const std::size_t max_buckets = 160)
+            : MetricFamily(name, description, MetricType::Histogram, labels_names), _schema(schema), _max_buckets(max_buckets)
+        {
+            if(labels_names.contains("le"))
+            {
+                throw std::invalid_argument("Histogram label names cannot contain le");
+            }
+        }
+
+        std::shared_ptr<NativeHistogram> labels(const std::set<Label> &labels)
+        {
+            return MetricFamily::labels(labels, _schema, _max_buckets);
+        }
+
+        // Label values are given in label names declaration order, e.g. with_labels("GET", "200") for {"method", "code"}
+        template <typename... Values>
+        std::shared_ptr<NativeHistogram> with_labels(const Values&... values)
+        {
+            return MetricFamily::with_labels(std::array<LabelValue, sizeof...(Values)>{{values...}}, _schema, _max_buckets);
+        }
+
+    protected:
+        const std::int32_t _schema;
+        const std::size_t _max_buckets;
+    };
+
+    //////////////////////////////////////////////////////
+    //// SUMMARY METRIC
+    //////////////////////////////////////////////////////
+    const std::set<double> default_quantiles = {0.5, 0.9, 0.99};
+
+    // Default relative accuracy of summary quantile estimates
+    constexpr double summary_relative_accuracy = 0.01;
+    // Smallest and biggest values told apart by summary quantile estimates
+    constexpr double summary_min_value = 1e-9;
+    constexpr double summary_max_value = 1e9;
+    // Observations between two reads of the clock by a summary, while they come fast enough
+    constexpr std::uint64_t summary_clock_period = 64;
+
+    // Quantiles are estimated from a sketch of logarithmic buckets (DDSketch), so that any estimate
+    // is within relative_accuracy of an actual observation. Observations are kept in age_buckets
+    // sketches that are recycled in turn, making quantiles cover the last max_age. Each sketch holds
+    // log(summary_max_value / summary_min_value) / log((1 + relative_accuracy) / (1 - relative_accuracy))
+    // 32 bits counters: about 2000 at 1% (40KB per summary with 5 age buckets), 400 at 5%.
+    // Observing is a single relaxed increment of the shared sketch, which keeps it lock free without
+    // per thread buffers to merge on scrapes. The clock is read once every summary_clock_period
+    // observations when those take less than 1/summary_clock_period of a window, on every observation
+    // otherwise, and on each estimate. Up to summary_clock_period observations following a window change
+    // or a pause may be counted in the previous window.
+    // Summaries observe non negative values only: negative and NaN values are ignored, and values
+    // below summary_min_value are estimated as summary_min_value.
+    class Summary
+    {
+    public:
+        explicit Summary(const std::set<double>& quantiles = default_quantiles,
+                         const std::chrono::milliseconds max_age = std::chrono::minutes(10),
+                         const std::size_t age_buckets = 5, const double relative_accuracy = summary_relative_accuracy)
+            : _quantiles(quantiles.begin(), quantiles.end()),
+              _window_duration(std::max<std::int64_t>(1, std::chrono::duration_cast<std::chrono::nanoseconds>(max_age).count() / std::max<std::size_t>(1, age_buckets))),
+              _windows(std::max<std::size_t>(1, age_buckets)),
+              _period_start(steady_nanoseconds()), _window(_period_start.load(std::memory_order_relaxed) / _window_duration),
+              _sum(0), _count(0), _created(unix_time()), _created_text(_created)
+        {
+            for(const auto& quantile : _quantiles)
+            {
+                if(!(quantile >= 0 && quantile <= 1))
+                {
+                    throw std::invalid_argument("Summary quantiles must be between 0 and 1");
+                }
+                _quantile_labels.push_back({"quantile", format_double(quantile)});
+            }
+            if(!(relative_accuracy > 0 && relative_accuracy < 1))
+            {
+                throw std::invalid_argument("Summary relative accuracy must be between 0 and 1");
+            }
+            _log_gamma = std::log((1 + relative_accuracy) / (1 - relative_accuracy));
+            _sketch_size = static_cast<std::size_t>(std::ceil(std::log(summary_max_value / summary_min_value) / _log_gamma)) + 1;
+            const std::int64_t window = _window.load(std::memory_order_relaxed);
+            for(auto& w : _windows)
+            {
+                w.counts = std::vector<std::atomic<std::uint32_t>>(_sketch_size);
+                w.window.store(window, std::memory_order_relaxed);
+            }
+        }
+
+        void observe(const double value)
+        {
+            if(!(value >= 0))
+            {
+                return;
+            }
+            _touched.touch();
+            _sum += value;
+            const std::uint64_t count = _count.fetch_add(1, std::memory_order_relaxed);
+            std::int64_t window;
+            if(count % summary_clock_period == 0)
+            {
+                window = end_period();
+            }
+            else
+            {
+                window = _sparse.load(std::memory_order_relaxed) ? refresh_window() : _window.load(std::memory_order_relaxed);
+            }
+            current_sketch(window).counts[sketch_index(value)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        double sum() const
+        {
+            return _sum;
+        }
+
+        std::uint64_t count() const
+        {
+            return _count.load(std::memory_order_relaxed);
+        }
+
+        const std::vector<double>& quantiles() const
+        {
+            return _quantiles;
+        }
+
+        // quantile label of the quantile at index
+        const Label& quantile_label(const std::size_t index) const
+        {
+            return _quantile_labels[index];
+        }
+
+        // Epoch of the last update, see FamilyLimits
+        const TouchEpoch& touched() const
+        {
+            return _touched;
+        }
+
+        // Creation time of the summary, in seconds since the unix epoch
+        double created() const
+        {
+            return _created;
+        }
+
+        const DoubleText& created_text() const
+        {
+            return _created_text;
+        }
+
+        // Estimates of quantiles(), in the same order, over the observations of the last max_age.
+        // NaN when there was no observation.
+        std::vector<double> estimates() const
+        {
+            std::vector<double> res(_quantiles.size(), std::numeric_limits<double>::quiet_NaN());
+            const std::int64_t window = refresh_window();
+            auto is_recent = [&](const Window& w){return w.window.load(std::memory_order_relaxed) > window - static_cast<std::int64_t>(_windows.size());};
+
+            std::uint64_t total_count = 0;
+            for(const auto& w : _windows)
+            {
+                if(is_recent(w))
+                {
+                    for(const auto& count : w.counts)
+                    {
+                        total_count += count.load(std::memory_order_relaxed);
+                    }
+                }
+            }
+            if(total_count == 0)
+            {
+                return res;
+            }
+
+            // Quantiles are sorted, one walk over the merged sketches finds all of them
+            std::uint64_t cumulative_count = 0;
+            std::size_t quantile_index = 0;
+            for(std::size_t i = 0; i < _sketch_size && quantile_index < _quantiles.size(); i++)
+            {
+                for(const auto& w : _windows)
+                {
+                    if(is_recent(w))
+                    {
+                        cumulative_count += w.counts[i].load(std::memory_order_relaxed);
+                    }
+                }
+                while(quantile_index < _quantiles.size() && cumulative_count > _quantiles[quantile_index] * (total_count - 1))
+                {
+                    res[quantile_index++] = sketch_value(i);
+                }
+            }
+            return res;
+        }
+
+    protected:
+        struct Window
+        {
+            // Index of the time window the counts belong to
+            std::atomic<std::int64_t> window;
+            std::vector<std::atomic<std::uint32_t>> counts;
+        };
+
+        // Index of the sketch bucket holding value, values out of bounds go to the first or last bucket
+        std::size_t sketch_index(const double value) const
+        {
+            static const double min_log = std::log(summary_min_value);
+            if(!(value > summary_min_value))
+            {
+                return 0;
+            }
+            const double index = std::ceil((std::log(value) - min_log) / _log_gamma);
+            return std::min(static_cast<std::size_t>(index), _sketch_size - 1);
+        }
+
+        // Value estimate of a sketch bucket, evenly distant from its bounds in relative terms
+        double sketch_value(const std::size_t index) const
+        {
+            const double gamma = std::exp(_log_gamma);
+            return summary_min_value * std::exp(index * _log_gamma) * 2 / (gamma + 1);
+        }
+
+        static std::int64_t steady_nanoseconds()
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // Reads the clock into the window used by the next observations
+        std::int64_t refresh_window() const
+        {
+            const std::int64_t window = steady_nanoseconds() / _window_duration;
+            _window.store(window, std::memory_order_relaxed);
+            return window;
+        }
+
+        // Reads the clock once summary_clock_period observations are made, those that took long enough
+        // for the window to change unseen make the next observations read it each time
+        std::int64_t end_period()
+        {
+            const std::int64_t now = steady_nanoseconds();
+            const std::int64_t period = now - _period_start.exchange(now, std::memory_order_relaxed);
+            _sparse.store(period > _window_duration / static_cast<std::int64_t>(summary_clock_period), std::memory_order_relaxed);
+            const std::int64_t window = now / _window_duration;
+            _window.store(window, std::memory_order_relaxed);
+            return window;
+        }
+
+        Window& current_sketch(const std::int64_t window)
+        {
+            Window& w = _windows[static_cast<std::size_t>(window) % _windows.size()];
+            if(w.window.load(std::memory_order_acquire) < window)
+            {
+                // The sketch held an expired window, the first thread to see it recycles it.
+                // A thread late with the clock keeps writing to the newer window.
+                std::lock_guard<std::mutex> lock(_rotation_mtx);
+                if(w.window.load(std::memory_order_relaxed) < window)
+                {
+                    for(auto& count : w.counts)
+                    {
+                        count.store(0, std::memory_order_relaxed);
+                    }
+                    w.window.store(window, std::memory_order_release);
+                }
+            }
+            return w;
+        }
+
+        const std::vector<double> _quantiles;
+        std::vector<Label> _quantile_labels;
+        const std::int64_t _window_duration;
+        std::vector<Window> _windows;
+        double _log_gamma;
+        std::size_t _sketch_size;
+        // Clock read at the start of the current summary_clock_period observations
+        std::atomic<std::int64_t> _period_start;
+        // Whether observations come too slowly to read the clock once per period
+        std::atomic<bool> _sparse = {false};
+        // Window of the latest clock read
+        mutable std::atomic<std::int64_t> _window;
+        std::mutex _rotation_mtx;
+        atomic_double _sum;
+        std::atomic<std::uint64_t> _count;
+        const double _created;
+        const DoubleText _created_text;
+        TouchEpoch _touched;
+    };
+
+    class SummaryMetric : public Metric, public Summary
+    {
+    public:
+        SummaryMetric(const std::string &name, const std::string &description, const std::set<double>& quantiles = default_quantiles,
+                      const std::chrono::milliseconds max_age = std::chrono::minutes(10), const std::size_t age_buckets = 5,
+                      const double relative_accuracy = summary_relative_accuracy)
+            : Metric(name, description, MetricType::Summary), Summary(quantiles, max_age, age_buckets, relative_accuracy)
+        {
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            serializer.serialize(no_labels, static_cast<const Summary&>(*this));
+        }
+    };
+
+    class SummaryFamily : public MetricFamily<Summary>
+    {
+    public:
+        SummaryFamily(const std::string &name, const std::string &description, const LabelNames &labels_names,
+                      const std::set<double>& quantiles = default_quantiles,
+                      const std::chrono::milliseconds max_age = std::chrono::minutes(10), const std::size_t age_buckets = 5,
+                      const double relative_accuracy = summary_relative_accuracy)
+            : MetricFamily(name, description, MetricType::Summary, labels_names), _quantiles(quantiles), _max_age(max_age),
+              _age_buckets(age_buckets), _relative_accuracy(relative_accuracy)
+        {
+            if(labels_names.contains("quantile"))
+            {
+                throw std::invalid_argument("Summary label names cannot contain quantile");
+            }
+        }
+
+        std::shared_ptr<Summary> labels(const std::set<Label> &labels)
+        {
+            return MetricFamily::labels(labels, _quantiles, _max_age, _age_buckets, _relative_accuracy);
+        }
+
+        // Label values are given in label names declaration order, e.g. with_labels("GET", "200") for {"method", "code"}
+        template <typename... Values>
+        std::shared_ptr<Summary> with_labels(const Values&... values)
+        {
+            return MetricFamily::with_labels(std::array<LabelValue, sizeof...(Values)>{{values...}}, _quantiles, _max_age, _age_buckets, _relative_accuracy);
+        }
+
+    protected:
+        const std::set<double> _quantiles;
+        const std::chrono::milliseconds _max_age;
+        const std::size_t _age_buckets;
+        const double _relative_accuracy;
+    };
+
+    // Value of a family child that changes whenever it is updated, used to validate scrape caches. Updates change it
+    // after the other values they write, so that lines rendered while they are only partly written are rendered again
+    // once they are done.
+    inline double child_activity(const Counter& counter)
+    {
+        return counter.get();
+    }
+
+    // Setting a gauge to its current value leaves its cached line valid
+    inline double child_activity(const Gauge& gauge)
+    {
+        return gauge.get();
+    }
+
+    inline double child_activity(const Histogram& histogram)
+    {
+        return static_cast<double>(histogram.count());
+    }
+
+    inline double child_activity(const NativeHistogram& histogram)
+    {
+        return static_cast<double>(histogram.count());
+    }
+
+    inline double child_activity(const Summary& summary)
+    {
+        return static_cast<double>(summary.count());
+    }
+
+    //////////////////////////////////////////////////////
+    //// CALLBACK METRICS
+    //////////////////////////////////////////////////////
+
+    // Gauge whose value is read by calling callback on each serialization, rather than set on every change.
+    // The callback runs on the scraping thread and must be thread safe.
+    class CallbackGaugeMetric : public Metric
+    {
+    public:
+        CallbackGaugeMetric(const std::string &name, const std::string &description, const std::function<double()>& callback)
+            : Metric(name, description, MetricType::Gauge), _callback(callback)
+        {
+            if(!_callback)
+            {
+                throw std::invalid_argument("Callback of metric " + name + " is empty");
+            }
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            const Gauge gauge(_callback());
+            serializer.serialize(no_labels, gauge);
+        }
+
+    protected:
+        const std::function<double()> _callback;
+    };
+
+    // Counter whose value is read by calling callback on each serialization, e.g. a count kept by a library.
+    // The callback must return a value that never decreases.
+    class CallbackCounterMetric : public Metric
+    {
+    public:
+        CallbackCounterMetric(const std::string &name, const std::string &description, const std::function<double()>& callback)
+            : Metric(name, description, MetricType::Counter), _callback(callback), _created(unix_time())
+        {
+            if(!_callback)
+            {
+                throw std::invalid_argument("Callback of metric " + name + " is empty");
+            }
+        }
+
+        virtual void serialize(MetricSerializer& serializer) const override
+        {
+            const Reading counter(_callback(), _created);
+            serializer.serialize(no_labels, counter);
+        }
+
+    protected:
+        struct Reading : public Counter
+        {
+            Reading(const double value, const double created) : Counter(value, created) {}
+        };
+
+        const std::function<double()> _callback;
+        const double _created;
+    };
+
+    // Collectable whose metrics are built by callback on each collection, e.g. families of per queue
+    // depths computed from the application state only when scraped. The callback runs on the scraping
+    // thread and must be thread safe; the first of several metrics with the same name is kept.
+    class CallbackCollector : public Collectable
+    {
+    public:
+        using Callback = std::function<std::vector<std::shared_ptr<Metric>>()>;
+
+        explicit CallbackCollector(const Callback& callback) : _callback(callback)
+        {
+            if(!_callback)
+            {
+                throw std::invalid_argument("Callback of collector is empty");
+            }
+        }
+
+        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) override
+        {
+            std::shared_ptr<const MetricsSnapshot> collected = snapshot();
+            {
+                // Metrics are only weakly referenced by collect, the last collected ones are kept alive
+                std::lock_guard<std::mutex> lock(_collected_mtx);
+                _collected = collected;
+            }
+            metrics.insert(collected->begin(), collected->end());
+        }
+
+        virtual std::shared_ptr<const MetricsSnapshot> snapshot() override
+        {
+            std::shared_ptr<MetricsSnapshot> metrics = std::make_shared<MetricsSnapshot>();
+            for(auto& metric : _callback())
+            {
+                if(metric)
+                {
+                    metrics->emplace(metric->get_name(), metric);
+                }
+            }
+            return metrics;
+        }
+
+    protected:
+        const Callback _callback;
+        std::mutex _collected_mtx;
+        std::shared_ptr<const MetricsSnapshot> _collected = {};
+    };
+
+    //////////////////////////////////////////////////////
+    //// SELF METRICS
+    //////////////////////////////////////////////////////
+
+    // Metrics of the library itself, named oura_prometheus_*: the series count, label combinaisons created,
+    // lock contentions and memory of each family of a registry, read from their stats on each collection,
+    // along with the duration and serialized bytes of scrapes, see Exposer::enable_self_metrics.
+    // Nothing is measured beyond a few counters on slow paths until it is collected.
+    class SelfMetrics : public Collectable
+    {
+    public:
+        explicit SelfMetrics(const std::shared_ptr<Registry>& registry) : _registry(registry)
+        {
+            if(!registry)
+            {
+                throw std::invalid_argument("Registry of self metrics is null");
+            }
+            const std::vector<std::shared_ptr<Metric>> metrics = {_scrape_duration, _scrape_bytes, _registry_lock_contentions,
+                _family_series, _family_children_created, _family_lock_contentions, _family_memory};
+            for(const auto& metric : metrics)
+            {
+                _metrics->emplace(metric->get_name(), metric);
+            }
+        }
+
+        // Called by exposers once a scrape is serialized, with the serialized bytes before any compression
+        void record_scrape(const double seconds, const std::size_t bytes)
+        {
+            _scrape_duration->observe(seconds);
+            _scrape_bytes->add(static_cast<double>(bytes));
+        }
+
+        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) override
+        {
+            std::shared_ptr<const MetricsSnapshot> collected = snapshot();
+            metrics.insert(collected->begin(), collected->end());
+        }
+
+        virtual std::shared_ptr<const MetricsSnapshot> snapshot() override
+        {
+            update();
+            return _metrics;
+        }
+
+    protected:
+        // Families unregistered since the previous collection keep their last values
+        void update()
+        {
+            std::shared_ptr<Registry> registry = _registry.lock();
+            if(!registry)
+            {
+                return;
+            }
+            // Concurrent collections would add the same counter deltas twice
+            std::lock_guard<std::mutex> lock(_update_mtx);
+            follow(*_registry_lock_contentions, registry->lock_contentions());
+            for(const auto& p : *registry->registered())
+            {
+                const MetricStats stats = p.second->stats();
+                if(!stats.family)
+                {
+                    continue;
+                }
+                _family_series->with_labels(p.first)->set(static_cast<double>(stats.children));
+                _family_memory->with_labels(p.first)->set(static_cast<double>(stats.memory_bytes));
+                follow(*_family_children_created->with_labels(p.first), stats.children_created);
+                follow(*_family_lock_contentions->with_labels(p.first), stats.lock_contentions);
+            }
+        }
+
+        // Counters are set to totals kept by the library by adding their increase
+        static void follow(Counter& counter, const std::uint64_t total)
+        {
+            const double increase = static_cast<double>(total) - counter.get();
+            if(increase > 0)
+            {
+                counter.add(increase);
+            }
+        }
+
+        const std::weak_ptr<Registry> _registry;
+        std::mutex _update_mtx;
+        const std::shared_ptr<HistogramMetric> _scrape_duration = std::make_shared<HistogramMetric>(
+            "oura_prometheus_scrape_duration_seconds", "Duration of the serialization of scrapes");
+        const std::shared_ptr<CounterMetric> _scrape_bytes = std::make_shared<CounterMetric>(
+            "oura_prometheus_scrape_serialized_bytes_total", "Bytes serialized by scrapes, before compression");
+        const std::shared_ptr<CounterMetric> _registry_lock_contentions = std::make_shared<CounterMetric>(
+            "oura_prometheus_registry_lock_contentions_total", "Registrations that waited for another one");
+        const std::shared_ptr<GaugeFamily> _family_series = std::make_shared<GaugeFamily>(
+            "oura_prometheus_family_series", "Series of a family", std::set<std::string>{"family"});
+        const std::shared_ptr<CounterFamily> _family_children_created = std::make_shared<CounterFamily>(
+            "oura_prometheus_family_children_created_total", "Label combinaisons created in a family", std::set<std::string>{"family"});
+        const std::shared_ptr<CounterFamily> _family_lock_contentions = std::make_shared<CounterFamily>(
+            "oura_prometheus_family_lock_contentions_total", "Times the children index lock of a family was contended",
+            std::set<std::string>{"family"});
+        const std::shared_ptr<GaugeFamily> _family_memory = std::make_shared<GaugeFamily>(
+            "oura_prometheus_family_memory_bytes", "Memory used by the children of a family", std::set<std::string>{"family"});
+        const std::shared_ptr<MetricsSnapshot> _metrics = std::make_shared<MetricsSnapshot>();
+    };
+
+    //////////////////////////////////////////////////////
+    //// TIMERS
+    //////////////////////////////////////////////////////
+
+    // Clocks of timers give now() and the seconds between two of its values
+    struct SteadyClock
+    {
+        using time_point = std::chrono::steady_clock::time_point;
+
+        static time_point now()
+        {
+            return std::chrono::steady_clock::now();
+        }
+
+        static double seconds(const time_point start, const time_point end)
+        {
+            return std::chrono::duration<double>(end - start).count();
+        }
+    };
+
+#if defined(__x86_64__) || defined(__i386__)
+    // Time stamp counter of x86 processors, read in a few cycles for nanoseconds long sections. It must be
+    // invariant (constant_tsc), and is calibrated against steady_clock for 10 ms on its first conversion,
+    // which seconds_per_tick() can be called ahead of.
+    struct TscClock
+    {
+        using time_point = std::uint64_t;
+
+        static time_point now()
+        {
+            return __rdtsc();
+        }
+
+        static double seconds(const time_point start, const time_point end)
+        {
+            return static_cast<double>(end - start) * seconds_per_tick();
+        }
+
+        static double seconds_per_tick()
+        {
+            static const double value = calibrate();
+            return value;
+        }
+
+    private:
+        static double calibrate()
+        {
+            const auto steady_start = std::chrono::steady_clock::now();
+            const std::uint64_t tsc_start = __rdtsc();
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            const std::uint64_t tsc_end = __rdtsc();
+            const auto steady_end = std::chrono::steady_clock::now();
+            return std::chrono::duration<double>(steady_end - steady_start).count() / static_cast<double>(std::max<std::uint64_t>(1, tsc_end - tsc_start));
+        }
+    };
+#endif
+
+    // Durations are observed by histograms, summaries and local accumulators, and set to gauges
+    template <typename Observer>
+    typename std::enable_if<!std::is_base_of<Gauge, Observer>::value>::type record_duration(Observer& observer, const double seconds)
+    {
+        observer.observe(seconds);
+    }
+
+    inline void record_duration(Gauge& gauge, const double seconds)
+    {
+        gauge.set(seconds);
+    }
+
+    template <typename T>
+    struct is_shared_ptr : std::false_type
+    {
+    };
+
+    template <typename T>
+    struct is_shared_ptr<std::shared_ptr<T>> : std::true_type
+    {
+    };
+
+    // Records the seconds elapsed from its construction to its destruction or stop() into a metric, see record_duration.
+    // A metric given by reference must outlive the timer, one given by shared_ptr is held by it.
+    template <typename Clock>
+    class BasicScopedTimer
+    {
+    public:
+        // Handles, even non const lvalues, go to the shared_ptr overload
+        template <typename Observer, typename = typename std::enable_if<!is_shared_ptr<typename std::remove_cv<Observer>::type>::value>::type>
+        explicit BasicScopedTimer(Observer& observer)
+            : _observer(&observer), _record([](void* o, const double seconds){record_duration(*static_cast<Observer*>(o), seconds);}),
+              _start(Clock::now())
+        {
+        }
+
+        template <typename Observer>
+        explicit BasicScopedTimer(const std::shared_ptr<Observer>& observer) : BasicScopedTimer(*observer)
+        {
+            _owner = observer;
+        }
+
+        BasicScopedTimer(const BasicScopedTimer&) = delete;
+        BasicScopedTimer& operator=(const BasicScopedTimer&) = delete;
+
+        ~BasicScopedTimer()
+        {
+            stop();
+        }
+
+        // Records the elapsed seconds and returns them, only the first call records
+        double stop()
+        {
+            const double seconds = elapsed();
+            if(_observer != nullptr)
+            {
+                _record(_observer, seconds);
+                _observer = nullptr;
+            }
+            return seconds;
+        }
+
+        // Nothing is recorded afterwards
+        void cancel()
+        {
+            _observer = nullptr;
+        }
+
+        double elapsed() const
+        {
+            return Clock::seconds(_start, Clock::now());
+        }
+
+    protected:
+        void* _observer;
+        void (*_record)(void*, double);
+        std::shared_ptr<void> _owner = {};
+        const typename Clock::time_point _start;
+    };
+
+    using ScopedTimer = BasicScopedTimer<SteadyClock>;
+#if defined(__x86_64__) || defined(__i386__)
+    using TscScopedTimer = BasicScopedTimer<TscClock>;
+#endif
+
+    // Increments a gauge for its lifetime, e.g. to count the requests in progress
+    class InProgressTracker
+    {
+    public:
+        explicit InProgressTracker(Gauge& gauge) : _gauge(gauge)
+        {
+            _gauge.inc();
+        }
+
+        explicit InProgressTracker(const std::shared_ptr<Gauge>& gauge) : InProgressTracker(*gauge)
+        {
+            _owner = gauge;
+        }
+
+        InProgressTracker(const InProgressTracker&) = delete;
+        InProgressTracker& operator=(const InProgressTracker&) = delete;
+
+        ~InProgressTracker()
+        {
+            _gauge.dec();
+        }
+
+    protected:
+        Gauge& _gauge;
+        std::shared_ptr<Gauge> _owner = {};
+    };
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+    //////////////////////////////////////////////////////
+    //// STATIC METRIC FAMILIES (c++20)
+    //////////////////////////////////////////////////////
+
+    // String literal usable as a template argument
+    template <std::size_t N>
+    struct StaticName
+    {
+        constexpr StaticName(const char (&text)[N])
+        {
+            std::copy_n(text, N, value);
+        }
+
+        char value[N];
+    };
+
+    // Family whose metric name and label names are template arguments: they are checked at compile time,
+    // and label values are given in the order of the label names arguments, e.g.
+    // StaticMetricFamily<CounterFamily, "http_requests_total", "method", "code">, with_labels("GET", "200").
+    template <typename Family, StaticName Name, StaticName... LabelsNames>
+    class StaticMetricFamily : public Family
+    {
+        static constexpr std::size_t labels_count = sizeof...(LabelsNames);
+        static constexpr std::array<std::string_view, labels_count> labels_names = {{std::string_view(LabelsNames.value)...}};
+
+        static constexpr bool distinct_labels_names()
+        {
+            for(std::size_t i = 0; i < labels_count; i++)
+            {
+                for(std::size_t j = i + 1; j < labels_count; j++)
+                {
+                    if(labels_names[i] == labels_names[j])
+                    {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        static_assert(is_valid_metric_name(Name.value), "Metric name does not follow format");
+        static_assert((is_valid_label_name(LabelsNames.value) && ...), "Label name does not follow format");
+        static_assert(distinct_labels_names(), "Label names must be distinct");
+
+    public:
+        // Arguments following the description are the ones of Family after its label names
+        template <typename... Args>
+        explicit StaticMetricFamily(const std::string& description, Args&&... args)
+            : Family(Name.value, description, LabelNames{std::string(LabelsNames.value)...}, std::forward<Args>(args)...)
+        {
+        }
+
+        // Label values are given in label names arguments order, their count is checked at compile time
+        template <typename... Values>
+        auto with_labels(const Values&... values)
+        {
+            static_assert(sizeof...(Values) == labels_count, "Incorrect number of label given");
+            return Family::with_labels(values...);
+        }
+    };
+
+    template <StaticName Name, StaticName... LabelsNames>
+    using StaticCounterFamily = StaticMetricFamily<CounterFamily, Name, LabelsNames...>;
+
+    template <StaticName Name, StaticName... LabelsNames>
+    using StaticGaugeFamily = StaticMetricFamily<GaugeFamily, Name, LabelsNames...>;
+
+    template <StaticName Name, StaticName... LabelsNames>
+    using StaticHistogramFamily = StaticMetricFamily<HistogramFamily, Name, LabelsNames...>;
+
+    template <StaticName Name, StaticName... LabelsNames>
+    using StaticNativeHistogramFamily = StaticMetricFamily<NativeHistogramFamily, Name, LabelsNames...>;
+
+    template <StaticName Name, StaticName... LabelsNames>
+    using StaticSummaryFamily = StaticMetricFamily<SummaryFamily, Name, LabelsNames...>;
+#endif
+
+    inline std::string escape_double_quotes(const std::string& text)
+    {
+        std::string res;
+        res.reserve(text.size());
+        for(const char c : text)
+        {
+            if(c == '"')
+            {
+                res += '\\';
+            }
+            res += c;
+        }
+        return res;
+    }
+
+    // Number of children of the parts in which parallel serializations split big families
+    constexpr std::size_t default_serialization_part_size = 4096;
+
+    // Calls render(i, buffer) for every i of [0, count) from at most threads other threads, and consume(buffer)
+    // from the calling one in order of i as soon as each buffer is rendered, at most 2 * threads buffers being
+    // rendered ahead of the consumed one. The first exception thrown stops the other calls and is rethrown.
+    // Everything is done by the calling thread when no thread can be started.
+    template <typename Render, typename Consume>
+    void run_in_order(const std::size_t threads, const std::size_t count, const Render& render, const Consume& consume)
+    {
+        const std::size_t window = 2 * threads;
+        std::vector<std::string> buffers(std::min(window, count));
+        std::unique_ptr<bool[]> rendered(new bool[buffers.size()]());
+        std::mutex mtx;
+        std::condition_variable changed;
+        std::size_t next = 0;
+        std::size_t consumed = 0;
+        std::exception_ptr error;
+
+        auto work = [&](){
+            std::unique_lock<std::mutex> lock(mtx);
+            while(true)
+            {
+                changed.wait(lock, [&](){return error || next == count || next < consumed + window;});
+                if(error || next == count)
+                {
+                    return;
+                }
+                const std::size_t i = next++;
+                lock.unlock();
+                std::exception_ptr render_error;
+                try
+                {
+                    render(i, buffers[i % window]);
+                }
+                catch(...)
+                {
+                    render_error = std::current_exception();
+                }
+                lock.lock();
+                if(render_error && !error)
+                {
+                    error = render_error;
+                }
+                rendered[i % window] = true;
+                changed.notify_all();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        try
+        {
+            for(std::size_t t = 0; t < std::min(threads, count); t++)
+            {
+                workers.emplace_back(work);
+            }
+        }
+        catch(const std::system_error&)
+        {
+            // Running with the threads started, if any
+        }
+        if(workers.empty())
+        {
+            for(std::size_t i = 0; i < count; i++)
+            {
+                render(i, buffers.front());
+                consume(buffers.front());
+                buffers.front().clear();
+            }
+            return;
+        }
+
+        try
+        {
+            for(std::size_t i = 0; i < count; i++)
+            {
+                std::string& buffer = buffers[i % window];
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    changed.wait(lock, [&](){return error || rendered[i % window];});
+                    if(error)
+                    {
+                        break;
+                    }
+                    rendered[i % window] = false;
+                }
+                consume(buffer);
+                buffer.clear();
+                std::lock_guard<std::mutex> lock(mtx);
+                consumed++;
+                changed.notify_all();
+            }
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if(!error)
+            {
+                error = std::current_exception();
+            }
+            changed.notify_all();
+        }
+        for(auto& worker : workers)
+        {
+            worker.join();
+        }
+        if(error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // With more than one thread, metrics and parts of part_size children of bigger families are serialized
+    // by that many threads into buffers of their own, which are consumed in order: the output is unchanged,
+    // but chunks are cut between those buffers.
+    class TextSerializer : public Serializer
+    {
+    public:
+        using Serializer::serialize;
+
+        explicit TextSerializer(const std::size_t threads = 1, const std::size_t part_size = default_serialization_part_size)
+            : _threads(std::max<std::size_t>(1, threads)), _part_size(std::max<std::size_t>(1, part_size))
+        {
+        }
+
+        virtual void serialize(std::string& buffer, const MetricsSnapshot& metrics,
+                               const ChunkConsumer& consumer, const std::size_t chunk_size) override
+        {
+            if(_threads > 1)
+            {
+                serialize_in_parallel<TextMetricSerializer>(buffer, metrics, consumer, chunk_size, write_header);
+            }
+            else
+            {
+                TextMetricSerializer metric_serializer(buffer, consumer, chunk_size);
+                std::string name;
+                for(const auto& p : metrics)
+                {
+                    const Metric& metric = *p.second;
+                    metric_serializer.name = write_header(buffer, metric, name);
+                    metric.serialize(metric_serializer);
+                }
+            }
+            if(consumer && !buffer.empty())
+            {
+                consumer(buffer);
+                buffer.clear();
+            }
+        }
+
+        virtual const char* content_type() const override
+        {
+            return "text/plain; version=0.0.4; charset=utf-8";
+        }
+
+        std::size_t threads() const
+        {
+            return _threads;
+        }
+
+    protected:
+        // Appends the HELP and TYPE lines of metric, returns the name of its samples
+        static const std::string* write_header(std::string& buffer, const Metric& metric, std::string&)
+        {
+            buffer.append("# HELP ").append(metric.get_name()).append(" ");
+            append_escaped(buffer, metric.get_description(), false);
+            buffer.append("\n# TYPE ").append(metric.get_name()).append(" ");
+            buffer.append(metric_type_to_string(metric.get_type())).append("\n");
+            return &metric.get_name();
+        }
+
+        // Writer serializes children into a buffer, header(buffer, metric, name_storage) writes the lines preceding
+        // them and returns the name of their samples. Serialized data is appended to buffer, and consumed in chunks
+        // while the next metrics or parts are serialized.
+        template <typename Writer, typename Header>
+        void serialize_in_parallel(std::string& buffer, const MetricsSnapshot& metrics,
+                                   const ChunkConsumer& consumer, const std::size_t chunk_size, const Header& header)
+        {
+            const ChunkConsumer no_consumer;
+            const std::size_t no_chunk = std::numeric_limits<std::size_t>::max();
+            auto append = [&](const std::string& output){
+                buffer.append(output);
+                if(consumer && buffer.size() >= chunk_size)
+                {
+                    consumer(buffer);
+                    buffer.clear();
+                }
+            };
+
+            // Runs of small metrics are each serialized by a task, big families serialize their parts concurrently
+            std::vector<const Metric*> small_metrics;
+            auto serialize_small_metrics = [&](){
+                run_in_order(_threads, small_metrics.size(), [&](const std::size_t i, std::string& output){
+                    std::string name;
+                    Writer writer(output, no_consumer, no_chunk);
+                    writer.name = header(output, *small_metrics[i], name);
+                    small_metrics[i]->serialize(writer);
+                }, append);
+                small_metrics.clear();
+            };
+            std::string name;
+            std::string header_lines;
+            for(const auto& p : metrics)
+            {
+                const Metric& metric = *p.second;
+                if(metric.children_count() <= _part_size)
+                {
+                    small_metrics.push_back(&metric);
+                    continue;
+                }
+                serialize_small_metrics();
+                metric.serialize_parts(_part_size, [&](const std::size_t parts_count,
+                                                       const std::function<void(std::size_t, MetricSerializer&)>& serialize_part){
+                    header_lines.clear();
+                    const std::string* samples_name = header(header_lines, metric, name);
+                    append(header_lines);
+                    run_in_order(_threads, parts_count, [&](const std::size_t part, std::string& output){
+                        Writer writer(output, no_consumer, no_chunk);
+                        writer.name = samples_name;
+                        serialize_part(part, writer);
+                    }, append);
+                });
+            }
+            serialize_small_metrics();
+        }
+
+        const std::size_t _threads;
+        const std::size_t _part_size;
+
+        // Writes samples lines of metrics children
+        class TextMetricSerializer : public MetricSerializer
+        {
+        public:
+            TextMetricSerializer(std::string& buffer, const ChunkConsumer& consumer, const std::size_t chunk_size)
+                : _buffer(buffer), _consumer(consumer), _chunk_size(chunk_size)
+            {
+            }
+
+            virtual void serialize(const LabelSet& labels, const Counter& counter) override
+            {
+                write(labels, counter);
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Gauge& gauge) override
+            {
+                write(labels, gauge);
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Histogram& histogram) override
+            {
+                write(labels, histogram);
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Summary& summary) override
+            {
+                write(labels, summary);
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const NativeHistogram& histogram) override
+            {
+                write(labels, histogram);
+                consume_chunk();
+            }
+
+            // Name of the metric being serialized, samples names start with it
+            const std::string* name = nullptr;
+
+        protected:
+            void write(const LabelSet& labels, const Counter& counter)
+            {
+                sample("", labels, no_label, counter.get());
+            }
+
+            void write(const LabelSet& labels, const Gauge& gauge)
+            {
+                sample("", labels, no_label, gauge.get());
+            }
+
+            void write(const LabelSet& labels, const Histogram& histogram)
+            {
+                std::uint64_t cumulative_count = 0;
+                for(std::size_t i = 0; i < histogram.bounds().size(); i++)
+                {
+                    cumulative_count += histogram.bucket_count(i);
+                    sample("_bucket", labels, histogram.le_label(i), static_cast<double>(cumulative_count));
+                    if(_with_exemplars && histogram.exemplar(i, _exemplar))
+                    {
+                        append_exemplar();
+                    }
+                }
+                sample("_sum", labels, no_label, histogram.sum());
+                sample("_count", labels, no_label, static_cast<double>(cumulative_count));
+            }
+
+            void write(const LabelSet& labels, const Summary& summary)
+            {
+                const std::vector<double> estimates = summary.estimates();
+                for(std::size_t i = 0; i < estimates.size(); i++)
+                {
+                    sample("", labels, summary.quantile_label(i), estimates[i]);
+                }
+                sample("_sum", labels, no_label, summary.sum());
+                sample("_count", labels, no_label, static_cast<double>(summary.count()));
+            }
+
+            // The text format has no native histograms, populated buckets are written as classic ones
+            void write(const LabelSet& labels, const NativeHistogram& histogram)
+            {
+                histogram.collect(_native_histogram);
+                std::uint64_t cumulative_count = 0;
+                char le[max_double_size];
+                auto bucket = [&](const double upper_bound, const std::uint64_t count){
+                    cumulative_count += count;
+                    sample("_bucket", labels, "le", le, write_double(le, upper_bound), static_cast<double>(cumulative_count));
+                };
+                const std::int32_t schema = _native_histogram.schema;
+                for(auto it = _native_histogram.negative_buckets.rbegin(); it != _native_histogram.negative_buckets.rend(); ++it)
+                {
+                    // Negative buckets cover [-upper, -lower): their le is the greatest double below -lower,
+                    // which belongs to the next bucket
+                    bucket(std::nextafter(-native_histogram_lower_bound(it->first, schema), -std::numeric_limits<double>::infinity()), it->second);
+                }
+                bucket(_native_histogram.zero_threshold, _native_histogram.zero_count);
+                for(const auto& b : _native_histogram.positive_buckets)
+                {
+                    bucket(native_histogram_upper_bound(b.first, schema), b.second);
+                }
+                bucket(std::numeric_limits<double>::infinity(), std::max(_native_histogram.count, cumulative_count) - cumulative_count);
+                sample("_sum", labels, no_label, _native_histogram.sum);
+                sample("_count", labels, no_label, static_cast<double>(_native_histogram.count));
+            }
+
+            void sample(const char* suffix, const LabelSet& labels, const Label& additional_label, const double value)
+            {
+                if(additional_label.name.empty())
+                {
+                    sample(suffix, labels, nullptr, nullptr, 0, value);
+                }
+                else
+                {
+                    _escaped_value.clear();
+                    append_escaped(_escaped_value, additional_label.value);
+                    sample(suffix, labels, additional_label.name.c_str(), _escaped_value.data(), _escaped_value.size(), value);
+                }
+            }
+
+            // Additional label value must be escaped already, there is no additional label when its name is nullptr
+            void sample(const char* suffix, const LabelSet& labels, const char* additional_label_name,
+                        const char* additional_label_value, const std::size_t additional_label_value_size, const double value)
+            {
+                _buffer.append(*name).append(suffix);
+                if(!labels.empty() || additional_label_name != nullptr)
+                {
+                    _buffer += '{';
+                    labels.append_text(_buffer);
+                    if(additional_label_name != nullptr)
+                    {
+                        if(!labels.empty())
+                        {
+                            _buffer += ',';
+                        }
+                        _buffer.append(additional_label_name).append("=\"");
+                        _buffer.append(additional_label_value, additional_label_value_size);
+                        _buffer += '"';
+                    }
+                    _buffer += '}';
+                }
+                _buffer += ' ';
+                append_double(_buffer, value);
+                _buffer += '\n';
+            }
+
+            // Appends _exemplar to the sample line last written
+            void append_exemplar()
+            {
+                _buffer.pop_back();
+                _buffer.append(" # {").append(_exemplar.labels).append("} ");
+                append_double(_buffer, _exemplar.value);
+                _buffer += ' ';
+                append_double(_buffer, _exemplar.timestamp);
+                _buffer += '\n';
+            }
+
+            // Chunks are cut between children, so that consumers always get whole samples
+            void consume_chunk()
+            {
+                if(_buffer.size() >= _chunk_size && _consumer)
+                {
+                    _consumer(_buffer);
+                    _buffer.clear();
+                }
+            }
+
+            std::string& _buffer;
+            const ChunkConsumer& _consumer;
+            const std::size_t _chunk_size;
+            std::string _escaped_value;
+            NativeHistogramSnapshot _native_histogram;
+            // Only the OpenMetrics format has exemplars
+            bool _with_exemplars = false;
+            Exemplar _exemplar;
+        };
+    };
+
+    // Metrics with more children are not cached by default by CachingTextSerializer
+    constexpr std::size_t default_max_cached_children = 65536;
+
+    // Text serializer keeping the lines rendered for each child by the previous serialization: children
+    // whose labels and activity (see child_activity) are unchanged are copied from them instead of being
+    // rendered again. Summaries, whose quantiles move without observations, are always rendered.
+    // Caches hold a copy of the lines of their metric, and up to another one while children change, so
+    // metrics of more than max_cached_children children, whose lines are mostly copied anyway, are not cached.
+    // Caches are kept per serializer, which must only be used by one thread at a time.
+    class CachingTextSerializer : public TextSerializer
+    {
+    public:
+        using Serializer::serialize;
+
+        explicit CachingTextSerializer(const std::size_t max_cached_children = default_max_cached_children)
+            : _max_cached_children(max_cached_children)
+        {
+        }
+
+        virtual void serialize(std::string& buffer, const MetricsSnapshot& metrics,
+                               const ChunkConsumer& consumer, const std::size_t chunk_size) override
+        {
+            CachingMetricSerializer metric_serializer(buffer, consumer, chunk_size, _spare);
+            TextMetricSerializer uncached_serializer(buffer, consumer, chunk_size);
+            std::string name;
+            _generation++;
+            _rendered_count = 0;
+            for(const auto& p : metrics)
+            {
+                const Metric& metric = *p.second;
+                if(metric.children_count() > _max_cached_children)
+                {
+                    // Its cache, if any, is dropped below
+                    uncached_serializer.name = write_header(buffer, metric, name);
+                    metric.serialize(uncached_serializer);
+                    _rendered_count += metric.children_count();
+                    continue;
+                }
+                metric_serializer.name = write_header(buffer, metric, name);
+                // A cache is dropped with its metric, rather than used by another one allocated at the same address
+                MetricCache& cache = _caches[&metric];
+                if(cache.metric.lock() != p.second)
+                {
+                    cache = MetricCache();
+                    cache.metric = p.second;
+                }
+                cache.generation = _generation;
+                metric_serializer.begin(cache);
+                metric.serialize(metric_serializer);
+                metric_serializer.end();
+            }
+            for(auto it = _caches.begin(); it != _caches.end();)
+            {
+                it = it->second.generation == _generation ? std::next(it) : _caches.erase(it);
+            }
+            _rendered_count += metric_serializer.rendered_count;
+            if(consumer && !buffer.empty())
+            {
+                consumer(buffer);
+                buffer.clear();
+            }
+        }
+
+        // Number of children rendered by the last serialization, the others were copied from the cache
+        std::size_t rendered_count() const
+        {
+            return _rendered_count;
+        }
+
+    protected:
+        struct ChildCache
+        {
+            // Never matches when the child changed while it was rendered
+            const void* child;
+            // Label sets identifiers are never reused, unlike label strings addresses
+            std::uint64_t labels_id;
+            double activity;
+            std::size_t text_offset;
+            std::size_t text_size;
+        };
+
+        struct MetricCache
+        {
+            std::weak_ptr<Metric> metric;
+            std::uint64_t generation = 0;
+            // Lines of the children, in serialization order
+            std::string text;
+            std::vector<ChildCache> children;
+        };
+
+        // As long as children are copied from the cache in order, the cache is kept as is. Lines are written into the
+        // storage of spare from the first child that differs, and spare is then swapped with the cache of their metric.
+        class CachingMetricSerializer : public TextMetricSerializer
+        {
+        public:
+            CachingMetricSerializer(std::string& buffer, const ChunkConsumer& consumer, const std::size_t chunk_size, MetricCache& spare)
+                : TextMetricSerializer(buffer, consumer, chunk_size), _text(spare.text), _children(spare.children)
+            {
+            }
+
+            virtual void serialize(const LabelSet& labels, const Counter& counter) override
+            {
+                write_cached(labels, counter);
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Gauge& gauge) override
+            {
+                write_cached(labels, gauge);
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Histogram& histogram) override
+            {
+                write_cached(labels, histogram);
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Summary& summary) override
+            {
+                diverge();
+                const std::size_t start = _buffer.size();
+                write(labels, summary);
+                cache(labels, nullptr, 0, start);
+                rendered_count++;
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const NativeHistogram& histogram) override
+            {
+                write_cached(labels, histogram);
+                consume_chunk();
+            }
+
+            // Children given until end are looked up in cache, which is then replaced by them
+            void begin(MetricCache& cache)
+            {
+                _cache = &cache;
+                _unchanged_count = 0;
+                _diverged = false;
+            }
+
+            void end()
+            {
+                if(!_diverged && _unchanged_count == _cache->children.size())
+                {
+                    return;
+                }
+                diverge();
+                _cache->text.swap(_text);
+                _cache->children.swap(_children);
+            }
+
+            std::size_t rendered_count = 0;
+
+        protected:
+            template <typename Child>
+            void write_cached(const LabelSet& labels, const Child& child)
+            {
+                const double activity = child_activity(child);
+                const std::size_t position = _diverged ? _children.size() : _unchanged_count;
+                if(position < _cache->children.size())
+                {
+                    const ChildCache& cached = _cache->children[position];
+                    if(cached.child == &child && cached.labels_id == labels.id() && cached.activity == activity)
+                    {
+                        const std::size_t start = _buffer.size();
+                        _buffer.append(_cache->text, cached.text_offset, cached.text_size);
+                        if(_diverged)
+                        {
+                            cache(labels, &child, activity, start);
+                        }
+                        else
+                        {
+                            _unchanged_count++;
+                        }
+                        return;
+                    }
+                }
+                diverge();
+                const std::size_t start = _buffer.size();
+                write(labels, child);
+                rendered_count++;
+                // Updates made while rendering may not all be in the lines
+                cache(labels, child_activity(child) == activity ? &child : nullptr, activity, start);
+            }
+
+            // Starts the new cache with the children copied so far, unless it is started already
+            void diverge()
+            {
+                if(_diverged)
+                {
+                    return;
+                }
+                _diverged = true;
+                const std::vector<ChildCache>& cached = _cache->children;
+                const auto unchanged_end = cached.begin() + static_cast<std::ptrdiff_t>(_unchanged_count);
+                const std::size_t text_size = _unchanged_count == 0 ? 0 : cached[_unchanged_count - 1].text_offset + cached[_unchanged_count - 1].text_size;
+                // Reserving the size of the cache, spare keeps its storage across serializations
+                _text.reserve(_cache->text.size());
+                _children.reserve(cached.size());
+                _text.assign(_cache->text, 0, text_size);
+                _children.assign(cached.begin(), unchanged_end);
+            }
+
+            // Records the lines written from start for the next serialization
+            void cache(const LabelSet& labels, const void* child, const double activity, const std::size_t start)
+            {
+                _children.push_back({child, labels.id(), activity, _text.size(), _buffer.size() - start});
+                _text.append(_buffer, start, std::string::npos);
+            }
+
+            MetricCache* _cache = nullptr;
+            // Children copied from the cache in order before the first that differs, while not _diverged
+            std::size_t _unchanged_count = 0;
+            bool _diverged = false;
+            std::string& _text;
+            std::vector<ChildCache>& _children;
+        };
+
+        const std::size_t _max_cached_children;
+        std::unordered_map<const Metric*, MetricCache> _caches;
+        // Storage of the caches being built, reused across serializations
+        MetricCache _spare;
+        std::uint64_t _generation = 0;
+        std::size_t _rendered_count = 0;
+    };
+
+    // Writes metrics in the OpenMetrics text format (https://openmetrics.io): counters samples are
+    // suffixed with _total, counters, histograms and summaries have a _created sample, counters and
+    // histograms buckets their exemplars, and the exposition ends with # EOF. All metrics must thus be
+    // given to a single serialize call.
+    class OpenMetricsSerializer : public TextSerializer
+    {
+    public:
+        using Serializer::serialize;
+        using TextSerializer::TextSerializer;
+
+        virtual void serialize(std::string& buffer, const MetricsSnapshot& metrics,
+                               const ChunkConsumer& consumer, const std::size_t chunk_size) override
+        {
+            if(_threads > 1)
+            {
+                serialize_in_parallel<OpenMetricsMetricSerializer>(buffer, metrics, consumer, chunk_size, write_header);
+            }
+            else
+            {
+                OpenMetricsMetricSerializer metric_serializer(buffer, consumer, chunk_size);
+                std::string family_name;
+                for(const auto& p : metrics)
+                {
+                    const Metric& metric = *p.second;
+                    metric_serializer.name = write_header(buffer, metric, family_name);
+                    metric.serialize(metric_serializer);
+                }
+            }
+            buffer.append("# EOF\n");
+            if(consumer)
+            {
+                consumer(buffer);
+                buffer.clear();
+            }
+        }
+
+        virtual const char* content_type() const override
+        {
+            return "application/openmetrics-text; version=1.0.0; charset=utf-8";
+        }
+
+    protected:
+        // Appends the TYPE and HELP lines of metric, returns the name of its samples held by family_name
+        static const std::string* write_header(std::string& buffer, const Metric& metric, std::string& family_name)
+        {
+            // Counters families are named without the _total suffix of their samples
+            family_name = metric.get_name();
+            const std::string total_suffix = "_total";
+            if(metric.get_type() == MetricType::Counter && family_name.size() > total_suffix.size() &&
+               family_name.compare(family_name.size() - total_suffix.size(), total_suffix.size(), total_suffix) == 0)
+            {
+                family_name.resize(family_name.size() - total_suffix.size());
+            }
+            buffer.append("# TYPE ").append(family_name).append(" ");
+            buffer.append(metric_type_to_string(metric.get_type()));
+            buffer.append("\n# HELP ").append(family_name).append(" ");
+            append_escaped(buffer, metric.get_description());
+            buffer += '\n';
+            return &family_name;
+        }
+
+        class OpenMetricsMetricSerializer : public TextMetricSerializer
+        {
+        public:
+            OpenMetricsMetricSerializer(std::string& buffer, const ChunkConsumer& consumer, const std::size_t chunk_size)
+                : TextMetricSerializer(buffer, consumer, chunk_size)
+            {
+                _with_exemplars = true;
+            }
+
+            // Creation times are written once by each child
+            void created_sample(const LabelSet& labels, const DoubleText& created)
+            {
+                _buffer.append(*name).append("_created");
+                if(!labels.empty())
+                {
+                    _buffer += '{';
+                    labels.append_text(_buffer);
+                    _buffer += '}';
+                }
+                _buffer += ' ';
+                _buffer.append(created.text, created.size);
+                _buffer += '\n';
+            }
+
+            virtual void serialize(const LabelSet& labels, const Counter& counter) override
+            {
+                sample("_total", labels, no_label, counter.get());
+                if(counter.exemplar(_exemplar))
+                {
+                    append_exemplar();
+                }
+                created_sample(labels, counter.created_text());
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Histogram& histogram) override
+            {
+                write(labels, histogram);
+                created_sample(labels, histogram.created_text());
+                consume_chunk();
+            }
+
+            virtual void serialize(const LabelSet& labels, const Summary& summary) override
+            {
+                write(labels, summary);
+                created_sample(labels, summary.created_text());
+                consume_chunk();
+            }
+
+            // OpenMetrics 1.0 has no native histograms either
+            virtual void serialize(const LabelSet& labels, const NativeHistogram& histogram) override
+            {
+                write(labels, histogram);
+                created_sample(labels, histogram.created_text());
+                consume_chunk();
+            }
+        };
+    };
+
+    // Writes metrics in the Prometheus protobuf format, as a sequence of size delimited
+    // io.prometheus.client.MetricFamily messages. Native histograms are written with their
+    // exponential buckets, which only this format can carry.
+    class ProtobufSerializer : public Serializer
+    {
+    public:
+        using Serializer::serialize;
+
+        virtual void serialize(std::string& buffer, const MetricsSnapshot& metrics,
+                               const ChunkConsumer& consumer, const std::size_t chunk_size) override
+        {
+            ProtobufMetricSerializer metric_serializer(buffer);
+            for(const auto& p : metrics)
+            {
+                const Metric& metric = *p.second;
+                const std::size_t family = buffer.size();
+                string_field(buffer, 1, metric.get_name());
+                string_field(buffer, 2, metric.get_description());
+                varint_field(buffer, 3, metric_type_number(metric.get_type()));
+                metric.serialize(metric_serializer);
+                end_message(buffer, family, 0);
+                // The size of a family is only known once it is written, chunks are cut between families
+                if(consumer && buffer.size() >= chunk_size)
+                {
+                    consumer(buffer);
+                    buffer.clear();
+                }
+            }
+            if(consumer && !buffer.empty())
+            {
+                consumer(buffer);
+                buffer.clear();
+            }
+        }
+
+        virtual const char* content_type() const override
+        {
+            return "application/vnd.google.protobuf; proto=io.prometheus.client.MetricFamily; encoding=delimited";
+        }
+
+    protected:
+        // Protobuf wire types
+        static constexpr std::uint32_t varint_wire_type = 0;
+        static constexpr std::uint32_t fixed64_wire_type = 1;
+        static constexpr std::uint32_t length_delimited_wire_type = 2;
+
+        // io.prometheus.client.MetricType values
+        static std::uint64_t metric_type_number(const MetricType type)
+        {
+            switch(type)
+            {
+            case MetricType::Counter:
+                return 0;
+            case MetricType::Gauge:
+                return 1;
+            case MetricType::Summary:
+                return 2;
+            case MetricType::Histogram:
+                return 4;
+            }
+            return 3;
+        }
+
+        static std::size_t write_varint(char* output, std::uint64_t value)
+        {
+            std::size_t size = 0;
+            while(value >= 0x80)
+            {
+                output[size++] = static_cast<char>((value & 0x7f) | 0x80);
+                value >>= 7;
+            }
+            output[size++] = static_cast<char>(value);
+            return size;
+        }
+
+        static void varint(std::string& buffer, const std::uint64_t value)
+        {
+            char bytes[10];
+            buffer.append(bytes, write_varint(bytes, value));
+        }
+
+        // Encoding of signed (sint32 and sint64) fields
+        static std::uint64_t zigzag(const std::int64_t value)
+        {
+            return value < 0 ? ~(static_cast<std::uint64_t>(value) << 1) : static_cast<std::uint64_t>(value) << 1;
+        }
+
+        static void tag(std::string& buffer, const std::uint32_t field, const std::uint32_t wire_type)
+        {
+            varint(buffer, (field << 3) | wire_type);
+        }
+
+        static void varint_field(std::string& buffer, const std::uint32_t field, const std::uint64_t value)
+        {
+            tag(buffer, field, varint_wire_type);
+            varint(buffer, value);
+        }
+
+        static void double_field(std::string& buffer, const std::uint32_t field, const double value)
+        {
+            tag(buffer, field, fixed64_wire_type);
+            std::uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            // Little endian whatever the host byte order is
+            char bytes[8];
+            for(std::size_t i = 0; i < 8; i++)
+            {
+                bytes[i] = static_cast<char>(bits >> (8 * i));
+            }
+            buffer.append(bytes, 8);
+        }
+
+        static void string_field(std::string& buffer, const std::uint32_t field, const std::string& value)
+        {
+            tag(buffer, field, length_delimited_wire_type);
+            varint(buffer, value.size());
+            buffer.append(value);
+        }
+
+        // Nested messages are written in place from start, their tag and size are inserted in front
+        // of them once complete. Field 0 only inserts the size, for the top level delimited messages.
+        static void end_message(std::string& buffer, const std::size_t start, const std::uint32_t field)
+        {
+            char header[20];
+            std::size_t header_size = 0;
+            if(field != 0)
+            {
+                header_size += write_varint(header, (field << 3) | length_delimited_wire_type);
+            }
+            header_size += write_varint(header + header_size, buffer.size() - start);
+            buffer.insert(start, header, header_size);
+        }
+
+        // io.prometheus.client.Metric messages of metrics children
+        class ProtobufMetricSerializer : public MetricSerializer
+        {
+        public:
+            explicit ProtobufMetricSerializer(std::string& buffer) : _buffer(buffer) {}
+
+            virtual void serialize(const LabelSet& labels, const Counter& counter) override
+            {
+                const std::size_t metric = begin_metric(labels);
+                const std::size_t value = _buffer.size();
+                double_field(_buffer, 1, counter.get());
+                timestamp(3, counter.created());
+                end_message(_buffer, value, 3);
+                end_message(_buffer, metric, 4);
+            }
+
+            virtual void serialize(const LabelSet& labels, const Gauge& gauge) override
+            {
+                const std::size_t metric = begin_metric(labels);
+                const std::size_t value = _buffer.size();
+                double_field(_buffer, 1, gauge.get());
+                end_message(_buffer, value, 2);
+                end_message(_buffer, metric, 4);
+            }
+
+            virtual void serialize(const LabelSet& labels, const Histogram& histogram) override
+            {
+                const std::size_t metric = begin_metric(labels);
+                const std::size_t value = _buffer.size();
+                std::uint64_t cumulative_count = 0;
+                for(std::size_t i = 0; i < histogram.bounds().size(); i++)
+                {
+                    cumulative_count += histogram.bucket_count(i);
+                    // The +Inf bucket is implied by the sample count
+                    if(i + 1 < histogram.bounds().size())
+                    {
+                        const std::size_t bucket = _buffer.size();
+                        varint_field(_buffer, 1, cumulative_count);
+                        double_field(_buffer, 2, histogram.bounds()[i]);
+                        end_message(_buffer, bucket, 3);
+                    }
+                }
+                varint_field(_buffer, 1, cumulative_count);
+                double_field(_buffer, 2, histogram.sum());
+                timestamp(15, histogram.created());
+                end_message(_buffer, value, 7);
+                end_message(_buffer, metric, 4);
+            }
+
+            virtual void serialize(const LabelSet& labels, const Summary& summary) override
+            {
+                const std::size_t metric = begin_metric(labels);
+                const std::size_t value = _buffer.size();
+                varint_field(_buffer, 1, summary.count());
+                double_field(_buffer, 2, summary.sum());
+                const std::vector<double> estimates = summary.estimates();
+                for(std::size_t i = 0; i < estimates.size(); i++)
+                {
+                    const std::size_t quantile = _buffer.size();
+                    double_field(_buffer, 1, summary.quantiles()[i]);
+                    double_field(_buffer, 2, estimates[i]);
+                    end_message(_buffer, quantile, 3);
+                }
+                timestamp(4, summary.created());
+                end_message(_buffer, value, 4);
+                end_message(_buffer, metric, 4);
+            }
+
+            virtual void serialize(const LabelSet& labels, const NativeHistogram& histogram) override
+            {
+                histogram.collect(_native_histogram);
+                const std::size_t metric = begin_metric(labels);
+                const std::size_t value = _buffer.size();
+                varint_field(_buffer, 1, _native_histogram.count);
+                double_field(_buffer, 2, _native_histogram.sum);
+                varint_field(_buffer, 5, zigzag(_native_histogram.schema));
+                double_field(_buffer, 6, _native_histogram.zero_threshold);
+                varint_field(_buffer, 7, _native_histogram.zero_count);
+                buckets(_native_histogram.negative_buckets, 9, 10);
+                buckets(_native_histogram.positive_buckets, 12, 13);
+                timestamp(15, histogram.created());
+                end_message(_buffer, value, 7);
+                end_message(_buffer, metric, 4);
+            }
+
+        protected:
+            // Starts a Metric message with its label pairs
+            std::size_t begin_metric(const LabelSet& labels)
+            {
+                const std::size_t metric = _buffer.size();
+                for(std::size_t i = 0; i < labels.size(); i++)
+                {
+                    const std::size_t label_pair = _buffer.size();
+                    string_field(_buffer, 1, labels.name(i));
+                    string_field(_buffer, 2, labels.value(i));
+                    end_message(_buffer, label_pair, 1);
+                }
+                return metric;
+            }
+
+            void timestamp(const std::uint32_t field, const double time)
+            {
+                const std::size_t start = _buffer.size();
+                const double seconds = std::floor(time);
+                varint_field(_buffer, 1, static_cast<std::uint64_t>(static_cast<std::int64_t>(seconds)));
+                varint_field(_buffer, 2, static_cast<std::uint64_t>((time - seconds) * 1e9));
+                end_message(_buffer, start, field);
+            }
+
+            // Buckets as spans of consecutive indexes, each one starting at an offset from the end of the
+            // previous one (from 0 for the first one), followed by the packed deltas between bucket counts
+            void buckets(const std::vector<std::pair<std::int32_t, std::uint64_t>>& buckets,
+                         const std::uint32_t span_field, const std::uint32_t delta_field)
+            {
+                if(buckets.empty())
+                {
+                    return;
+                }
+                std::int32_t next_index = 0;
+                for(std::size_t start = 0; start < buckets.size();)
+                {
+                    std::size_t end = start + 1;
+                    while(end < buckets.size() && buckets[end].first == buckets[end - 1].first + 1)
+                    {
+                        end++;
+                    }
+                    const std::size_t span = _buffer.size();
+                    varint_field(_buffer, 1, zigzag(buckets[start].first - next_index));
+                    varint_field(_buffer, 2, end - start);
+                    end_message(_buffer, span, span_field);
+                    next_index = buckets[end - 1].first + 1;
+                    start = end;
+                }
+                const std::size_t deltas = _buffer.size();
+                std::int64_t previous_count = 0;
+                for(const auto& bucket : buckets)
+                {
+                    varint(_buffer, zigzag(static_cast<std::int64_t>(bucket.second) - previous_count));
+                    previous_count = static_cast<std::int64_t>(bucket.second);
+                }
+                end_message(_buffer, deltas, delta_field);
+            }
+
+            std::string& _buffer;
+            NativeHistogramSnapshot _native_histogram;
+        };
     };
 
 } // namespace oura_prometheus
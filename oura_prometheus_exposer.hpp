@@ -0,0 +1,779 @@
+#ifndef OURA_PROMETHEUS_EXPOSER_LIB_H
+#define OURA_PROMETHEUS_EXPOSER_LIB_H
+
+#include "oura_prometheus.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+#if !defined(__linux__)
+#error "oura_prometheus Exposer relies on epoll and is only available on linux"
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+// Defining OURA_PROMETHEUS_WITH_ZLIB enables gzip compressed responses, zlib must then be linked (-lz)
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace oura_prometheus
+{
+    //////////////////////////////////////////////////////
+    //// HTTP EXPOSER
+    //////////////////////////////////////////////////////
+
+    // Whether an Accept-Encoding header value (lower cased, without spaces) accepts encoding
+    inline bool accepts_encoding(const std::string& accept_encoding, const std::string& encoding)
+    {
+        std::size_t start = 0;
+        while(start < accept_encoding.size())
+        {
+            std::size_t end = accept_encoding.find(',', start);
+            end = end == std::string::npos ? accept_encoding.size() : end;
+            const std::size_t parameters = std::min(accept_encoding.find(';', start), end);
+            const std::string coding = accept_encoding.substr(start, parameters - start);
+            if(coding == encoding || coding == "*")
+            {
+                // q=0 explicitly refuses the encoding
+                const std::size_t quality = accept_encoding.find("q=", parameters);
+                return quality >= end || std::strtod(accept_encoding.c_str() + quality + 2, nullptr) > 0;
+            }
+            start = end + 1;
+        }
+        return false;
+    }
+
+    // Format asked by an Accept header value (lower cased, without spaces): the known media type of highest
+    // quality, the first one listed on ties, and the text format when none is known. The most specific media
+    // range of a format gives its quality, and a null quality refuses it: acceptable is set to false when the
+    // text format would be used but is refused, e.g. by */*;q=0.
+    inline ExpositionFormat negotiate_format(const std::string& accept, bool& acceptable)
+    {
+        struct Preference
+        {
+            // 2 for a media type, 1 for text/* and 0 for */*, -1 when the format is not listed
+            int specificity = -1;
+            double quality = 0;
+            std::size_t position = 0;
+        };
+        std::array<Preference, 3> preferences = {};
+        std::size_t position = 0;
+        std::size_t start = 0;
+        while(start < accept.size())
+        {
+            std::size_t end = accept.find(',', start);
+            end = end == std::string::npos ? accept.size() : end;
+            const std::string media_range = accept.substr(start, end - start);
+            const std::string media_type = media_range.substr(0, media_range.find(';'));
+            const std::size_t quality_parameter = media_range.find(";q=");
+            const double quality = quality_parameter == std::string::npos ? 1 : std::strtod(media_range.c_str() + quality_parameter + 3, nullptr);
+            start = end + 1;
+            position++;
+
+            ExpositionFormat candidate;
+            int specificity = 2;
+            if(media_type == "application/vnd.google.protobuf")
+            {
+                // Only size delimited MetricFamily messages are written
+                const std::size_t encoding = media_range.find(";encoding=");
+                if(media_range.find(";proto=io.prometheus.client.metricfamily") == std::string::npos ||
+                   (encoding != std::string::npos && media_range.compare(encoding, 19, ";encoding=delimited") != 0))
+                {
+                    continue;
+                }
+                candidate = ExpositionFormat::Protobuf;
+            }
+            else if(media_type == "application/openmetrics-text")
+            {
+                candidate = ExpositionFormat::OpenMetrics;
+            }
+            else if(media_type == "text/plain" || media_type == "text/*" || media_type == "*/*")
+            {
+                candidate = ExpositionFormat::Text;
+                specificity = media_type == "text/plain" ? 2 : media_type == "text/*" ? 1 : 0;
+            }
+            else
+            {
+                continue;
+            }
+            Preference& preference = preferences[static_cast<std::size_t>(candidate)];
+            if(specificity > preference.specificity)
+            {
+                preference.specificity = specificity;
+                preference.quality = quality;
+                preference.position = position;
+            }
+        }
+
+        ExpositionFormat format = ExpositionFormat::Text;
+        const Preference* best = nullptr;
+        for(std::size_t i = 0; i < preferences.size(); i++)
+        {
+            const Preference& preference = preferences[i];
+            if(preference.quality > 0 && (best == nullptr || preference.quality > best->quality ||
+                                          (preference.quality == best->quality && preference.position < best->position)))
+            {
+                format = static_cast<ExpositionFormat>(i);
+                best = &preference;
+            }
+        }
+        acceptable = best != nullptr || preferences[static_cast<std::size_t>(ExpositionFormat::Text)].specificity < 0;
+        return format;
+    }
+
+    inline ExpositionFormat negotiate_format(const std::string& accept)
+    {
+        bool acceptable;
+        return negotiate_format(accept, acceptable);
+    }
+
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+    // Streaming gzip compressor, its zlib state is reused from one stream to the next
+    class GzipCompressor
+    {
+    public:
+        explicit GzipCompressor(const int level = Z_DEFAULT_COMPRESSION)
+        {
+            _stream = z_stream();
+            // 16 added to the window bits selects the gzip format
+            if(deflateInit2(&_stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                throw std::runtime_error("Cannot initialize gzip compression");
+            }
+        }
+
+        GzipCompressor(const GzipCompressor&) = delete;
+        GzipCompressor& operator=(const GzipCompressor&) = delete;
+
+        ~GzipCompressor()
+        {
+            deflateEnd(&_stream);
+        }
+
+        // Drops the stream being compressed, e.g. after a failed serialization
+        void reset()
+        {
+            deflateReset(&_stream);
+        }
+
+        // Appends the compressed chunk to output. Finishing writes the end of the gzip stream
+        // and readies the compressor for a new one.
+        void compress(const std::string& chunk, std::string& output, const bool finish = false)
+        {
+            _stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data()));
+            _stream.avail_in = static_cast<uInt>(chunk.size());
+            int result;
+            do
+            {
+                const std::size_t output_size = output.size();
+                output.resize(output_size + output_chunk_size);
+                _stream.next_out = reinterpret_cast<Bytef*>(&output[output_size]);
+                _stream.avail_out = static_cast<uInt>(output_chunk_size);
+                result = deflate(&_stream, finish ? Z_FINISH : Z_NO_FLUSH);
+                output.resize(output_size + output_chunk_size - _stream.avail_out);
+                if(result == Z_STREAM_ERROR)
+                {
+                    throw std::runtime_error("gzip compression failed");
+                }
+            } while(finish ? result != Z_STREAM_END : _stream.avail_out == 0);
+            if(finish)
+            {
+                deflateReset(&_stream);
+            }
+        }
+
+    protected:
+        static constexpr std::size_t output_chunk_size = 16384;
+
+        z_stream _stream;
+    };
+#endif
+
+    // Serves the metrics of registered collectables over HTTP on /metrics.
+    // Connections are handled by an epoll event loop running on a dedicated thread,
+    // so scrapes never run on, nor block, application threads.
+    class Exposer
+    {
+    public:
+        // Port 0 binds an ephemeral port, see port(). Text scrapes are serialized by serialization_threads
+        // threads, see TextSerializer.
+        explicit Exposer(const std::uint16_t port, const std::string& bind_address = "0.0.0.0", const std::size_t serialization_threads = 1)
+            : _text_serializer(serialization_threads), _open_metrics_serializer(serialization_threads)
+        {
+            _listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if(_listen_fd < 0)
+            {
+                throw_system_error("Cannot create exposer socket");
+            }
+            const int enable = 1;
+            ::setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            if(::inet_pton(AF_INET, bind_address.c_str(), &address.sin_addr) != 1)
+            {
+                close_fds();
+                throw std::invalid_argument("Exposer bind address is not a valid IPv4 address");
+            }
+            if(::bind(_listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+               || ::listen(_listen_fd, SOMAXCONN) != 0)
+            {
+                close_fds();
+                throw_system_error("Cannot listen on exposer address");
+            }
+            socklen_t address_size = sizeof(address);
+            ::getsockname(_listen_fd, reinterpret_cast<sockaddr*>(&address), &address_size);
+            _port = ntohs(address.sin_port);
+
+            _epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+            _stop_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if(_epoll_fd < 0 || _stop_fd < 0)
+            {
+                close_fds();
+                throw_system_error("Cannot create exposer event loop");
+            }
+            watch(_listen_fd, EPOLLIN);
+            watch(_stop_fd, EPOLLIN);
+
+            _thread = std::thread(&Exposer::run, this);
+        }
+
+        Exposer(const Exposer&) = delete;
+        Exposer& operator=(const Exposer&) = delete;
+
+        ~Exposer()
+        {
+            // eventfd writes only fail on counter overflow, the loop is woken up anyway
+            const std::uint64_t value = 1;
+            ssize_t written = ::write(_stop_fd, &value, sizeof(value));
+            (void)written;
+            _thread.join();
+            for(const auto& p : _connections)
+            {
+                ::close(p.first);
+            }
+            close_fds();
+        }
+
+        std::uint16_t port() const
+        {
+            return _port;
+        }
+
+        // Scrapes made less than window after the previous one in the same format and encoding get the same
+        // response, e.g. those of a pair of Prometheus servers. A null window, the default, renders every scrape.
+        void share_responses(const std::chrono::milliseconds window)
+        {
+            _sharing_window_ms.store(window.count());
+        }
+
+        // Sequential text scrapes only render the children that changed since the previous one, see
+        // CachingTextSerializer. It costs a copy of the exposition, so it is disabled by default.
+        void cache_text_serializations(const bool enabled)
+        {
+            _text_caching.store(enabled);
+        }
+
+        // Collectables are only weakly referenced, they stop being exposed once destroyed
+        void register_collectable(const std::shared_ptr<Collectable>& collectable)
+        {
+            std::lock_guard<std::mutex> lock(_collectables_mtx);
+            _collectables.push_back(collectable);
+        }
+
+        // Exposes self_metrics and records the duration and size of each scrape rendered in it, as long as it is alive
+        void enable_self_metrics(const std::shared_ptr<SelfMetrics>& self_metrics)
+        {
+            std::lock_guard<std::mutex> lock(_collectables_mtx);
+            _collectables.push_back(self_metrics);
+            _self_metrics = self_metrics;
+        }
+
+    protected:
+        struct SharedResponse
+        {
+            bool rendered = false;
+            std::chrono::steady_clock::time_point rendered_time = {};
+            std::string body;
+        };
+
+        struct Connection
+        {
+            std::string input;
+            std::string output;
+            std::size_t output_offset = 0;
+            bool close_after_output = false;
+            // The peer shut its side down, requests already received are still answered
+            bool input_closed = false;
+        };
+
+        // Biggest request accepted, scrape requests are a few hundred bytes
+        static constexpr std::size_t max_request_size = 8192;
+
+        // Size of the serialized text chunks handed to compression
+        static constexpr std::size_t serialization_chunk_size = 65536;
+
+        void run()
+        {
+            epoll_event events[64];
+            while(true)
+            {
+                const int events_count = ::epoll_wait(_epoll_fd, events, 64, -1);
+                if(events_count < 0 && errno != EINTR)
+                {
+                    return;
+                }
+                for(int i = 0; i < events_count; i++)
+                {
+                    const int fd = events[i].data.fd;
+                    if(fd == _stop_fd)
+                    {
+                        return;
+                    }
+                    else if(fd == _listen_fd)
+                    {
+                        accept_connections();
+                    }
+                    else if(events[i].events & (EPOLLERR | EPOLLHUP))
+                    {
+                        close_connection(fd);
+                    }
+                    else
+                    {
+                        if(events[i].events & EPOLLIN)
+                        {
+                            read_requests(fd);
+                        }
+                        if((events[i].events & EPOLLOUT) && _connections.count(fd) != 0)
+                        {
+                            write_responses(fd);
+                        }
+                    }
+                }
+            }
+        }
+
+        void accept_connections()
+        {
+            int fd;
+            while((fd = ::accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+            {
+                _connections[fd];
+                watch(fd, EPOLLIN);
+            }
+        }
+
+        void read_requests(const int fd)
+        {
+            Connection& connection = _connections[fd];
+            char chunk[4096];
+            while(true)
+            {
+                const ssize_t size = ::read(fd, chunk, sizeof(chunk));
+                if(size > 0)
+                {
+                    connection.input.append(chunk, static_cast<std::size_t>(size));
+                }
+                else if(size < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                else if(size == 0)
+                {
+                    connection.input_closed = true;
+                    break;
+                }
+                else if(errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    close_connection(fd);
+                    return;
+                }
+                else
+                {
+                    break;
+                }
+            }
+
+            // Answering every complete request, pipelined ones included
+            std::size_t headers_end;
+            while(!connection.close_after_output && (headers_end = connection.input.find("\r\n\r\n")) != std::string::npos)
+            {
+                handle_request(connection, headers_end);
+                connection.input.erase(0, headers_end + 4);
+            }
+            // No request can follow, the connection is closed once the responses are written
+            connection.close_after_output = connection.close_after_output || connection.input_closed;
+            if(connection.input.size() > max_request_size)
+            {
+                close_connection(fd);
+                return;
+            }
+            write_responses(fd);
+        }
+
+        void handle_request(Connection& connection, const std::size_t headers_end)
+        {
+            const std::string& request = connection.input;
+            const std::size_t method_end = request.find(' ');
+            const std::size_t target_end = method_end == std::string::npos ? std::string::npos : request.find(' ', method_end + 1);
+            const std::size_t line_end = request.find("\r\n");
+            if(target_end == std::string::npos || target_end > line_end)
+            {
+                connection.close_after_output = true;
+                respond(connection, "400 Bad Request", "text/plain", "Bad Request\n");
+                return;
+            }
+
+            // HTTP/1.1 connections are kept alive unless asked otherwise, HTTP/1.0 ones are closed
+            const std::string version = request.substr(target_end + 1, line_end - target_end - 1);
+            const std::string connection_header = header_value(request, line_end, headers_end, "connection");
+            connection.close_after_output = version == "HTTP/1.1" ? connection_header == "close" : connection_header != "keep-alive";
+
+            const std::string method = request.substr(0, method_end);
+            std::string target = request.substr(method_end + 1, target_end - method_end - 1);
+            target = target.substr(0, target.find('?'));
+            if(target != "/metrics")
+            {
+                respond(connection, "404 Not Found", "text/plain", "Not Found\n");
+            }
+            else if(method != "GET")
+            {
+                respond(connection, "405 Method Not Allowed", "text/plain", "Method Not Allowed\n");
+            }
+            else
+            {
+                bool acceptable = true;
+                const ExpositionFormat format = negotiate_format(header_value(request, line_end, headers_end, "accept"), acceptable);
+                if(!acceptable)
+                {
+                    respond(connection, "406 Not Acceptable", "text/plain", "Not Acceptable\n", nullptr, true);
+                    return;
+                }
+                Serializer& serializer = select_serializer(format);
+                bool gzip = false;
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+                gzip = accepts_encoding(header_value(request, line_end, headers_end, "accept-encoding"), "gzip");
+#endif
+                // Scrapes made within the sharing window of a previous one in the same format get its response
+                const std::chrono::milliseconds window(_sharing_window_ms.load());
+                const auto now = std::chrono::steady_clock::now();
+                std::string* body = &_body;
+                bool rendered = true;
+                if(window.count() > 0)
+                {
+                    SharedResponse& response = _responses[2 * static_cast<std::size_t>(format) + (gzip ? 1 : 0)];
+                    if(!response.rendered || now - response.rendered_time >= window)
+                    {
+                        rendered = render(serializer, gzip, response.body);
+                        response.rendered = rendered;
+                        response.rendered_time = now;
+                    }
+                    body = &response.body;
+                }
+                else
+                {
+                    rendered = render(serializer, gzip, _body);
+                }
+                // Responses are only kept while they can be shared
+                for(auto& response : _responses)
+                {
+                    if(response.rendered && &response.body != body && now - response.rendered_time >= window)
+                    {
+                        response = SharedResponse();
+                    }
+                }
+                if(!rendered)
+                {
+                    body->clear();
+                    respond(connection, "500 Internal Server Error", "text/plain", "Internal Server Error\n");
+                    return;
+                }
+                respond(connection, "200 OK", serializer.content_type(), *body, gzip ? "gzip" : nullptr, true);
+            }
+        }
+
+        // Returns false when the metrics could not be rendered, e.g. when a callback or the compression failed,
+        // snapshots are released either way
+        bool render(Serializer& serializer, const bool gzip, std::string& body)
+        {
+            const auto begin = std::chrono::steady_clock::now();
+            body.clear();
+            std::shared_ptr<SelfMetrics> self_metrics;
+            std::size_t serialized_bytes = 0;
+            try
+            {
+                const MetricsSnapshot& metrics = collect_metrics(self_metrics);
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+                if(gzip)
+                {
+                    // Compressing chunks as they are serialized, the whole exposition is never held in memory
+                    auto compress_chunk = [this, &body, &serialized_bytes](const std::string& chunk){
+                        serialized_bytes += chunk.size();
+                        _gzip.compress(chunk, body);
+                    };
+                    serializer.serialize(_chunk, metrics, compress_chunk, serialization_chunk_size);
+                    _gzip.compress(std::string(), body, true);
+                }
+                else
+#endif
+                {
+                    (void)gzip;
+                    serializer.serialize(body, metrics);
+                    serialized_bytes = body.size();
+                }
+            }
+            catch(...)
+            {
+                release_metrics();
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+                _chunk.clear();
+                _gzip.reset();
+#endif
+                return false;
+            }
+            release_metrics();
+            if(self_metrics)
+            {
+                self_metrics->record_scrape(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(),
+                                            serialized_bytes);
+            }
+            return true;
+        }
+
+        Serializer& select_serializer(const ExpositionFormat format)
+        {
+            switch(format)
+            {
+            case ExpositionFormat::OpenMetrics:
+                return _open_metrics_serializer;
+            case ExpositionFormat::Protobuf:
+                return _protobuf_serializer;
+            default:
+                if(_text_caching.load() && _text_serializer.threads() == 1)
+                {
+                    return _caching_text_serializer;
+                }
+                return _text_serializer;
+            }
+        }
+
+        // Metrics of all collectables, as formats such as OpenMetrics are written by a single serialization.
+        // Collectables snapshots are only merged when there are several, a metric name is then exposed once.
+        // Self metrics, when enabled, are kept alive until the scrape is recorded.
+        const MetricsSnapshot& collect_metrics(std::shared_ptr<SelfMetrics>& self_metrics)
+        {
+            std::lock_guard<std::mutex> lock(_collectables_mtx);
+            self_metrics = _self_metrics.lock();
+            for(auto it = _collectables.begin(); it != _collectables.end();)
+            {
+                if(auto collectable = it->lock())
+                {
+                    _snapshots.push_back(collectable->snapshot());
+                    ++it;
+                }
+                else
+                {
+                    it = _collectables.erase(it);
+                }
+            }
+            if(_snapshots.size() == 1)
+            {
+                return *_snapshots.front();
+            }
+            for(const auto& snapshot : _snapshots)
+            {
+                _merged_metrics.insert(snapshot->begin(), snapshot->end());
+            }
+            return _merged_metrics;
+        }
+
+        void release_metrics()
+        {
+            _snapshots.clear();
+            _merged_metrics.clear();
+        }
+
+        // Negotiated responses tell caches which request headers they depend on
+        void respond(Connection& connection, const char* status, const char* content_type, const std::string& body,
+                     const char* content_encoding = nullptr, const bool negotiated = false)
+        {
+            char content_length[32];
+            std::snprintf(content_length, sizeof(content_length), "%zu", body.size());
+            connection.output.append("HTTP/1.1 ").append(status).append("\r\nContent-Type: ").append(content_type);
+            if(content_encoding != nullptr)
+            {
+                connection.output.append("\r\nContent-Encoding: ").append(content_encoding);
+            }
+            if(negotiated)
+            {
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+                connection.output.append("\r\nVary: Accept, Accept-Encoding");
+#else
+                connection.output.append("\r\nVary: Accept");
+#endif
+            }
+            connection.output.append("\r\nContent-Length: ").append(content_length);
+            connection.output.append(connection.close_after_output ? "\r\nConnection: close\r\n\r\n" : "\r\n\r\n");
+            connection.output.append(body);
+        }
+
+        void write_responses(const int fd)
+        {
+            Connection& connection = _connections[fd];
+            while(connection.output_offset < connection.output.size())
+            {
+                const ssize_t size = ::send(fd, connection.output.data() + connection.output_offset,
+                                            connection.output.size() - connection.output_offset, MSG_NOSIGNAL);
+                if(size > 0)
+                {
+                    connection.output_offset += static_cast<std::size_t>(size);
+                }
+                else if(size < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                else if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    // Waiting for the socket to be writable again, a shut down input would be readable forever
+                    watch(fd, connection.input_closed ? EPOLLOUT : EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+                    return;
+                }
+                else
+                {
+                    close_connection(fd);
+                    return;
+                }
+            }
+            // Keeping buffers capacity for the next request of the connection
+            connection.output.clear();
+            connection.output_offset = 0;
+            if(connection.close_after_output)
+            {
+                close_connection(fd);
+            }
+            else
+            {
+                watch(fd, EPOLLIN, EPOLL_CTL_MOD);
+            }
+        }
+
+        void close_connection(const int fd)
+        {
+            ::epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            ::close(fd);
+            _connections.erase(fd);
+        }
+
+        void watch(const int fd, const std::uint32_t events, const int operation = EPOLL_CTL_ADD)
+        {
+            epoll_event event = {};
+            event.events = events;
+            event.data.fd = fd;
+            ::epoll_ctl(_epoll_fd, operation, fd, &event);
+        }
+
+        // Value of a request header, lower cased, or an empty string
+        static std::string header_value(const std::string& request, std::size_t line_end, const std::size_t headers_end, const std::string& name)
+        {
+            while(line_end < headers_end)
+            {
+                const std::size_t line_start = line_end + 2;
+                line_end = request.find("\r\n", line_start);
+                const std::size_t colon = request.find(':', line_start);
+                if(colon >= line_end || colon - line_start != name.size())
+                {
+                    continue;
+                }
+                bool same_name = true;
+                for(std::size_t i = 0; i < name.size() && same_name; i++)
+                {
+                    same_name = std::tolower(static_cast<unsigned char>(request[line_start + i])) == name[i];
+                }
+                if(same_name)
+                {
+                    std::string value;
+                    for(std::size_t i = colon + 1; i < line_end; i++)
+                    {
+                        if(request[i] != ' ' && request[i] != '\t')
+                        {
+                            value += static_cast<char>(std::tolower(static_cast<unsigned char>(request[i])));
+                        }
+                    }
+                    return value;
+                }
+            }
+            return "";
+        }
+
+        void close_fds()
+        {
+            for(const int fd : {_listen_fd, _epoll_fd, _stop_fd})
+            {
+                if(fd >= 0)
+                {
+                    ::close(fd);
+                }
+            }
+        }
+
+        static void throw_system_error(const std::string& message)
+        {
+            throw std::runtime_error(message + ": " + std::strerror(errno));
+        }
+
+        int _listen_fd = -1;
+        int _epoll_fd = -1;
+        int _stop_fd = -1;
+        std::uint16_t _port = 0;
+
+        std::mutex _collectables_mtx;
+        std::vector<std::weak_ptr<Collectable>> _collectables = {};
+        std::weak_ptr<SelfMetrics> _self_metrics = {};
+        std::atomic<std::int64_t> _sharing_window_ms = {0};
+        std::atomic<bool> _text_caching = {false};
+
+        // Only used from the event loop thread
+        std::map<int, Connection> _connections = {};
+        std::vector<std::shared_ptr<const MetricsSnapshot>> _snapshots = {};
+        MetricsSnapshot _merged_metrics = {};
+        // Last response of each format and encoding within the sharing window, and body of unshared responses
+        std::array<SharedResponse, 6> _responses = {};
+        std::string _body;
+        CachingTextSerializer _caching_text_serializer;
+        TextSerializer _text_serializer;
+        OpenMetricsSerializer _open_metrics_serializer;
+        ProtobufSerializer _protobuf_serializer;
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+        std::string _chunk;
+        GzipCompressor _gzip;
+#endif
+
+        std::thread _thread;
+    };
+
+} // namespace oura_prometheus
+
+#endif
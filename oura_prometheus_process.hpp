@@ -0,0 +1,414 @@
+#ifndef OURA_PROMETHEUS_PROCESS_LIB_H
+#define OURA_PROMETHEUS_PROCESS_LIB_H
+
+#include "oura_prometheus.hpp"
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <stdexcept>
+
+#if !defined(__linux__)
+#error "oura_prometheus ProcessCollector reads /proc and is only available on linux"
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+namespace oura_prometheus
+{
+    //////////////////////////////////////////////////////
+    //// PROCESS COLLECTOR
+    //////////////////////////////////////////////////////
+
+    struct ProcessCollectorOptions
+    {
+        // Collections within this duration of the previous read get its metrics, e.g. those of several scrapers
+        std::chrono::milliseconds cache_duration = std::chrono::seconds(1);
+        // Exposes the cpu time of each thread, labelled by thread name and id.
+        // Each collection labels the threads alive when it runs, the label strings of exited threads are freed
+        // with the last collection exposing them.
+        bool per_thread_cpu = false;
+    };
+
+    // Standard process metrics, read at collection time: process_cpu_seconds_total, process_resident_memory_bytes,
+    // process_virtual_memory_bytes, process_open_fds, process_max_fds, process_start_time_seconds and process_threads.
+    // /proc/self files are opened once, and again in a forked child, and read with pread into preallocated buffers,
+    // metrics whose file cannot be read are left out of the collection. The collector's own fds are not counted.
+    class ProcessCollector : public Collectable
+    {
+    public:
+        explicit ProcessCollector(const ProcessCollectorOptions& options = ProcessCollectorOptions())
+            : _options(options), _ticks_per_second(static_cast<double>(::sysconf(_SC_CLK_TCK)))
+        {
+            if(!open_fds() || !read_boot_time())
+            {
+                const int error = errno;
+                close_fds();
+                throw std::runtime_error(std::string("Cannot read /proc: ") + std::strerror(error));
+            }
+        }
+
+        ProcessCollector(const ProcessCollector&) = delete;
+        ProcessCollector& operator=(const ProcessCollector&) = delete;
+
+        ~ProcessCollector()
+        {
+            close_fds();
+        }
+
+        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) override
+        {
+            std::shared_ptr<const MetricsSnapshot> collected = snapshot();
+            metrics.insert(collected->begin(), collected->end());
+        }
+
+        // Metrics of the last read, kept alive until the next one
+        virtual std::shared_ptr<const MetricsSnapshot> snapshot() override
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            const auto now = std::chrono::steady_clock::now();
+            // /proc/self fds opened by the parent still describe it in a forked child
+            const bool forked = ::getpid() != _pid;
+            if(forked)
+            {
+                close_fds();
+                open_fds();
+            }
+            if(!_metrics || forked || now - _read_time >= _options.cache_duration)
+            {
+                _metrics = read();
+                _read_time = now;
+            }
+            return _metrics;
+        }
+
+    protected:
+        // Counter of a value read from /proc, created when its process or thread started
+        struct ReadCounter : public Counter
+        {
+            ReadCounter(const double value, const double created) : Counter(value, created) {}
+        };
+
+        class ReadCounterMetric : public Metric
+        {
+        public:
+            ReadCounterMetric(const std::string& name, const std::string& description, const double value, const double created)
+                : Metric(name, description, MetricType::Counter), _counter(value, created)
+            {
+            }
+
+            virtual void serialize(MetricSerializer& serializer) const override
+            {
+                serializer.serialize(no_labels, _counter);
+            }
+
+        protected:
+            const ReadCounter _counter;
+        };
+
+        class ThreadsCpuMetric : public Metric
+        {
+        public:
+            ThreadsCpuMetric()
+                : Metric("process_thread_cpu_seconds_total", "Total user and system CPU time spent by a thread in seconds", MetricType::Counter)
+            {
+            }
+
+            void add(const std::string& name, const std::string& tid, const double seconds, const double created)
+            {
+                _threads.emplace_back(std::unique_ptr<const LabelSet>(new LabelSet({{"thread", name}, {"tid", tid}})),
+                                      std::unique_ptr<const ReadCounter>(new ReadCounter(seconds, created)));
+            }
+
+            virtual void serialize(MetricSerializer& serializer) const override
+            {
+                for(const auto& thread : _threads)
+                {
+                    serializer.serialize(*thread.first, *thread.second);
+                }
+            }
+
+            virtual std::size_t children_count() const override
+            {
+                return _threads.size();
+            }
+
+        protected:
+            std::vector<std::pair<std::unique_ptr<const LabelSet>, std::unique_ptr<const ReadCounter>>> _threads = {};
+        };
+
+        // Fields of a stat file used, numbered as in proc(5)
+        struct Stat
+        {
+            std::string name;
+            // Fields 14 and 15
+            double cpu_ticks = 0;
+            // Field 20
+            double threads = 0;
+            // Field 22, since boot
+            double start_ticks = 0;
+            // Field 23
+            double virtual_memory_bytes = 0;
+        };
+
+        std::shared_ptr<const MetricsSnapshot> read()
+        {
+            std::shared_ptr<MetricsSnapshot> metrics = std::make_shared<MetricsSnapshot>();
+            auto add = [&metrics](const std::shared_ptr<Metric>& metric){metrics->emplace(metric->get_name(), metric);};
+            auto add_gauge = [&add](const char* name, const char* description, const double value){
+                add(std::make_shared<GaugeMetric>(name, description, value));
+            };
+
+            Stat stat;
+            if(read_file(_stat_fd) && parse_stat(_buffer.data(), stat))
+            {
+                const double start_time = start_seconds(stat);
+                add(std::make_shared<ReadCounterMetric>("process_cpu_seconds_total", "Total user and system CPU time spent in seconds",
+                                                        stat.cpu_ticks / _ticks_per_second, start_time));
+                add_gauge("process_start_time_seconds", "Start time of the process since unix epoch in seconds", start_time);
+                add_gauge("process_virtual_memory_bytes", "Virtual memory size in bytes", stat.virtual_memory_bytes);
+                add_gauge("process_threads", "Number of OS threads in the process", stat.threads);
+            }
+            if(read_file(_status_fd))
+            {
+                // Resident set size, in kB
+                if(const char* line = std::strstr(_buffer.data(), "\nVmRSS:"))
+                {
+                    add_gauge("process_resident_memory_bytes", "Resident memory size in bytes", 1024.0 * std::strtod(line + 7, nullptr));
+                }
+            }
+            std::size_t fds_count = 0;
+            const bool fds_listed = for_each_entry(_fd_dir, [this, &fds_count](const char* fd){
+                const int number = std::atoi(fd);
+                if(number != _stat_fd && number != _status_fd && number != _fd_dir && number != _task_dir)
+                {
+                    fds_count++;
+                }
+            });
+            if(fds_listed)
+            {
+                add_gauge("process_open_fds", "Number of open file descriptors", static_cast<double>(fds_count));
+            }
+            rlimit fds_limit = {};
+            if(::getrlimit(RLIMIT_NOFILE, &fds_limit) == 0)
+            {
+                add_gauge("process_max_fds", "Maximum number of open file descriptors", static_cast<double>(fds_limit.rlim_cur));
+            }
+            if(_options.per_thread_cpu)
+            {
+                std::shared_ptr<ThreadsCpuMetric> threads = std::make_shared<ThreadsCpuMetric>();
+                const bool listed = for_each_entry(_task_dir, [&](const char* tid){
+                    // Threads exiting meanwhile are skipped
+                    std::snprintf(_path.data(), _path.size(), "%s/stat", tid);
+                    const int fd = ::openat(_task_dir, _path.data(), O_RDONLY | O_CLOEXEC);
+                    if(fd < 0)
+                    {
+                        return;
+                    }
+                    Stat thread_stat;
+                    if(read_file(fd) && parse_stat(_buffer.data(), thread_stat))
+                    {
+                        threads->add(thread_stat.name, tid, thread_stat.cpu_ticks / _ticks_per_second, start_seconds(thread_stat));
+                    }
+                    ::close(fd);
+                });
+                if(listed)
+                {
+                    add(threads);
+                }
+            }
+            return metrics;
+        }
+
+        // Reads the file into _buffer as a null terminated string, longer files are truncated
+        bool read_file(const int fd)
+        {
+            ssize_t size;
+            do
+            {
+                size = ::pread(fd, _buffer.data(), _buffer.size() - 1, 0);
+            }
+            while(size < 0 && errno == EINTR);
+            if(size <= 0)
+            {
+                return false;
+            }
+            _buffer[static_cast<std::size_t>(size)] = '\0';
+            return true;
+        }
+
+        // Calls function with the name of each entry of the directory but . and .., returns whether it could be listed
+        template <typename Function>
+        bool for_each_entry(const int dir_fd, const Function& function)
+        {
+            // Layout of the entries returned by getdents64
+            struct Dirent
+            {
+                std::uint64_t inode;
+                std::int64_t offset;
+                unsigned short size;
+                unsigned char type;
+                char name[1];
+            };
+            if(::lseek(dir_fd, 0, SEEK_SET) != 0)
+            {
+                return false;
+            }
+            while(true)
+            {
+                const long size = ::syscall(SYS_getdents64, dir_fd, _entries.data(), _entries.size());
+                if(size < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if(size <= 0)
+                {
+                    return size == 0;
+                }
+                for(long offset = 0; offset < size;)
+                {
+                    const Dirent* entry = reinterpret_cast<const Dirent*>(_entries.data() + offset);
+                    if(std::strcmp(entry->name, ".") != 0 && std::strcmp(entry->name, "..") != 0)
+                    {
+                        function(entry->name);
+                    }
+                    offset += entry->size;
+                }
+            }
+        }
+
+        // The name may hold spaces and parentheses, the other fields follow the last parenthesis
+        static bool parse_stat(const char* buffer, Stat& stat)
+        {
+            const char* name_begin = std::strchr(buffer, '(');
+            const char* name_end = std::strrchr(buffer, ')');
+            if(name_begin == nullptr || name_end == nullptr || name_end < name_begin)
+            {
+                return false;
+            }
+            stat.name.assign(name_begin + 1, name_end);
+            // Field 3 is the state letter
+            const char* field = std::strchr(name_end, ' ');
+            field = field != nullptr ? std::strchr(field + 1, ' ') : nullptr;
+            if(field == nullptr)
+            {
+                return false;
+            }
+            for(int index = 4; index <= 23; index++)
+            {
+                char* end = nullptr;
+                const double value = static_cast<double>(std::strtoull(field, &end, 10));
+                if(end == field)
+                {
+                    return false;
+                }
+                field = end;
+                if(index == 14 || index == 15)
+                {
+                    stat.cpu_ticks += value;
+                }
+                else if(index == 20)
+                {
+                    stat.threads = value;
+                }
+                else if(index == 22)
+                {
+                    stat.start_ticks = value;
+                }
+                else if(index == 23)
+                {
+                    stat.virtual_memory_bytes = value;
+                }
+            }
+            return true;
+        }
+
+        double start_seconds(const Stat& stat) const
+        {
+            return _boot_time + stat.start_ticks / _ticks_per_second;
+        }
+
+        // Boot time, which start times are relative to, from the btime line of /proc/stat
+        bool read_boot_time()
+        {
+            const int fd = ::open("/proc/stat", O_RDONLY | O_CLOEXEC);
+            if(fd < 0)
+            {
+                return false;
+            }
+            // The file grows with the cpus count, it is read once
+            std::string content;
+            ssize_t size;
+            while((size = ::read(fd, _buffer.data(), _buffer.size())) > 0 || (size < 0 && errno == EINTR))
+            {
+                content.append(_buffer.data(), static_cast<std::size_t>(std::max<ssize_t>(size, 0)));
+            }
+            ::close(fd);
+            const std::size_t line = content.find("\nbtime ");
+            if(line == std::string::npos)
+            {
+                errno = ENOENT;
+                return false;
+            }
+            _boot_time = std::strtod(content.c_str() + line + 7, nullptr);
+            return true;
+        }
+
+        // Opens the /proc/self files of the current process, those which cannot be opened stay at -1
+        bool open_fds()
+        {
+            _pid = ::getpid();
+            _stat_fd = ::open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+            _status_fd = ::open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+            _fd_dir = ::open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if(_options.per_thread_cpu)
+            {
+                _task_dir = ::open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            }
+            return _stat_fd >= 0 && _status_fd >= 0 && _fd_dir >= 0 && (!_options.per_thread_cpu || _task_dir >= 0);
+        }
+
+        void close_fds()
+        {
+            for(int* fd : {&_stat_fd, &_status_fd, &_fd_dir, &_task_dir})
+            {
+                if(*fd >= 0)
+                {
+                    ::close(*fd);
+                    *fd = -1;
+                }
+            }
+        }
+
+        const ProcessCollectorOptions _options;
+        const double _ticks_per_second;
+        double _boot_time = 0;
+        pid_t _pid = 0;
+        int _stat_fd = -1;
+        int _status_fd = -1;
+        int _fd_dir = -1;
+        int _task_dir = -1;
+
+        std::mutex _mtx;
+        std::chrono::steady_clock::time_point _read_time = {};
+        std::shared_ptr<const MetricsSnapshot> _metrics = {};
+        // Only used with _mtx locked
+        std::array<char, 4096> _buffer = {};
+        // Holds the 8 bytes aligned entries of getdents64
+        alignas(std::uint64_t) std::array<char, 4096> _entries = {};
+        std::array<char, 32> _path = {};
+    };
+
+} // namespace oura_prometheus
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef OURA_PROMETHEUS_PUSHER_LIB_H
+#define OURA_PROMETHEUS_PUSHER_LIB_H
+
+#include "oura_prometheus.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+#if !defined(__linux__)
+#error "oura_prometheus Pusher relies on POSIX sockets and is only available on linux"
+#endif
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+namespace oura_prometheus
+{
+    //////////////////////////////////////////////////////
+    //// PUSHGATEWAY PUSHER
+    //////////////////////////////////////////////////////
+
+    // Path segment of a grouping key label value: values holding a / or empty ones are base64url
+    // encoded, as the Pushgateway expects them, the others are percent encoded
+    inline std::string push_path_segment(const std::string& name, const std::string& value)
+    {
+        if(value.empty() || value.find('/') != std::string::npos)
+        {
+            static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+            std::string encoded;
+            std::uint32_t bits = 0;
+            int bits_count = 0;
+            for(const char c : value)
+            {
+                bits = (bits << 8) | static_cast<unsigned char>(c);
+                bits_count += 8;
+                while(bits_count >= 6)
+                {
+                    bits_count -= 6;
+                    encoded += alphabet[(bits >> bits_count) & 0x3f];
+                }
+            }
+            if(bits_count > 0)
+            {
+                encoded += alphabet[(bits << (6 - bits_count)) & 0x3f];
+            }
+            // The Pushgateway decodes an empty value from a lone padding character
+            encoded.append(encoded.empty() ? 1 : (4 - encoded.size() % 4) % 4, '=');
+            return name + "@base64/" + encoded;
+        }
+        std::string encoded = name + "/";
+        for(const char c : value)
+        {
+            if(std::isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '_' || c == '.' || c == '~')
+            {
+                encoded += c;
+            }
+            else
+            {
+                char escaped[4];
+                std::snprintf(escaped, sizeof(escaped), "%%%02X", static_cast<unsigned char>(c));
+                encoded += escaped;
+            }
+        }
+        return encoded;
+    }
+
+    struct PushOptions
+    {
+        // Time between two pushes
+        std::chrono::milliseconds interval = std::chrono::seconds(10);
+        // Delay before retrying a failed push, doubling on each failure up to interval
+        std::chrono::milliseconds initial_backoff = std::chrono::milliseconds(100);
+        // Timeout of connections, sends and receives
+        std::chrono::milliseconds timeout = std::chrono::seconds(5);
+        // Text or Protobuf, the Pushgateway does not read OpenMetrics
+        ExpositionFormat format = ExpositionFormat::Text;
+        // Labels other than job of the grouping key
+        std::vector<Label> grouping_labels = {};
+    };
+
+    // Pushes the metrics of registered collectables to a Pushgateway from a dedicated thread, every interval,
+    // on push() and once more on destruction, e.g. for batch jobs that cannot be scraped. Each push replaces
+    // the metrics of the group (HTTP PUT). Only the latest metrics are ever held: a failed push is retried
+    // after a backoff with the metrics collected at that time, rather than queued.
+    class Pusher
+    {
+    public:
+        Pusher(const std::string& host, const std::uint16_t port, const std::string& job, const PushOptions& options = PushOptions())
+            : _host(host), _port(port), _options(options)
+        {
+            if(job.empty())
+            {
+                throw std::invalid_argument("Pushed job name is empty");
+            }
+            if(options.format == ExpositionFormat::OpenMetrics)
+            {
+                throw std::invalid_argument("Metrics cannot be pushed in the OpenMetrics format");
+            }
+            _path = "/metrics/" + push_path_segment("job", job);
+            for(const Label& label : options.grouping_labels)
+            {
+                check_label_name_format(label.name);
+                _path += "/" + push_path_segment(label.name, label.value);
+            }
+            _thread = std::thread(&Pusher::run, this);
+        }
+
+        Pusher(const Pusher&) = delete;
+        Pusher& operator=(const Pusher&) = delete;
+
+        // Makes a last push attempt of the current metrics, without retrying it
+        ~Pusher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                _stop = true;
+            }
+            _wake_up.notify_one();
+            _thread.join();
+        }
+
+        // Collectables are only weakly referenced, they stop being pushed once destroyed
+        void register_collectable(const std::shared_ptr<Collectable>& collectable)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _collectables.push_back(collectable);
+        }
+
+        // Asks for a push without waiting for the interval to elapse, returns without waiting for it
+        void push()
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                _push_requested = true;
+            }
+            _wake_up.notify_one();
+        }
+
+        const std::string& path() const
+        {
+            return _path;
+        }
+
+        // Pushes accepted with a 2xx status
+        std::uint64_t pushes_count() const
+        {
+            return _pushes_count.load();
+        }
+
+        std::uint64_t failures_count() const
+        {
+            return _failures_count.load();
+        }
+
+    protected:
+        void run()
+        {
+            std::chrono::milliseconds backoff = _options.initial_backoff;
+            auto next_push = std::chrono::steady_clock::now() + _options.interval;
+            std::unique_lock<std::mutex> lock(_mtx);
+            while(true)
+            {
+                _wake_up.wait_until(lock, next_push, [this](){return _stop || _push_requested;});
+                const bool last = _stop;
+                _push_requested = false;
+                lock.unlock();
+                const bool pushed = push_metrics();
+                lock.lock();
+                if(last)
+                {
+                    return;
+                }
+                if(pushed)
+                {
+                    backoff = _options.initial_backoff;
+                    next_push = std::chrono::steady_clock::now() + _options.interval;
+                }
+                else
+                {
+                    next_push = std::chrono::steady_clock::now() + std::min(backoff, _options.interval);
+                    backoff = std::min(backoff * 2, _options.interval);
+                }
+            }
+        }
+
+        // Collection and serialization read metrics as scrapes do, they never block updates. Nothing is pushed
+        // while no collectable is alive, an empty push would delete the metrics of the group. Collectables are
+        // collected without the lock held, so that registrations and push() never wait for their callbacks.
+        // A collection or serialization that throws is counted as a failed push.
+        bool push_metrics()
+        {
+            std::vector<std::shared_ptr<Collectable>> collectables;
+            {
+                std::lock_guard<std::mutex> lock(_mtx);
+                for(auto it = _collectables.begin(); it != _collectables.end();)
+                {
+                    if(auto collectable = it->lock())
+                    {
+                        collectables.push_back(std::move(collectable));
+                        ++it;
+                    }
+                    else
+                    {
+                        it = _collectables.erase(it);
+                    }
+                }
+            }
+            if(collectables.empty())
+            {
+                return true;
+            }
+            Serializer& serializer = _options.format == ExpositionFormat::Protobuf
+                ? static_cast<Serializer&>(_protobuf_serializer) : _text_serializer;
+            bool pushed = false;
+            try
+            {
+                MetricsSnapshot metrics;
+                for(const auto& collectable : collectables)
+                {
+                    const std::shared_ptr<const MetricsSnapshot> snapshot = collectable->snapshot();
+                    metrics.insert(snapshot->begin(), snapshot->end());
+                }
+                _body.clear();
+                serializer.serialize(_body, metrics);
+                pushed = send_request(serializer.content_type());
+            }
+            catch(...)
+            {
+                // Counted as a failure and retried after the backoff, as failed requests are
+            }
+            (pushed ? _pushes_count : _failures_count).fetch_add(1);
+            return pushed;
+        }
+
+        // Sends the body in a PUT request on a new connection, returns whether the response status is 2xx
+        bool send_request(const char* content_type)
+        {
+            const int fd = connect_to_gateway();
+            if(fd < 0)
+            {
+                return false;
+            }
+            _request.assign("PUT ").append(_path).append(" HTTP/1.1\r\nHost: ").append(_host);
+            _request.append(":").append(std::to_string(_port)).append("\r\nContent-Type: ").append(content_type);
+            _request.append("\r\nContent-Length: ").append(std::to_string(_body.size()));
+            _request.append("\r\nConnection: close\r\n\r\n").append(_body);
+            bool sent = true;
+            for(std::size_t offset = 0; sent && offset < _request.size();)
+            {
+                const ssize_t size = ::send(fd, _request.data() + offset, _request.size() - offset, MSG_NOSIGNAL);
+                if(size > 0)
+                {
+                    offset += static_cast<std::size_t>(size);
+                }
+                else
+                {
+                    sent = size < 0 && errno == EINTR;
+                }
+            }
+            // Only the status line is read, "HTTP/1.1 2xx"
+            char status[12];
+            std::size_t status_size = 0;
+            while(sent && status_size < sizeof(status))
+            {
+                const ssize_t size = ::recv(fd, status + status_size, sizeof(status) - status_size, 0);
+                if(size > 0)
+                {
+                    status_size += static_cast<std::size_t>(size);
+                }
+                else if(size == 0 || errno != EINTR)
+                {
+                    break;
+                }
+            }
+            ::close(fd);
+            return status_size == sizeof(status) && std::memcmp(status, "HTTP/1.", 7) == 0 && status[9] == '2';
+        }
+
+        int connect_to_gateway()
+        {
+            addrinfo hints = {};
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            addrinfo* addresses = nullptr;
+            if(::getaddrinfo(_host.c_str(), std::to_string(_port).c_str(), &hints, &addresses) != 0)
+            {
+                return -1;
+            }
+            int fd = -1;
+            for(addrinfo* address = addresses; address != nullptr && fd < 0; address = address->ai_next)
+            {
+                fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+                if(fd < 0)
+                {
+                    continue;
+                }
+                // Timeouts also bound connect on linux
+                timeval timeout = {};
+                timeout.tv_sec = static_cast<time_t>(_options.timeout.count() / 1000);
+                timeout.tv_usec = static_cast<suseconds_t>(_options.timeout.count() % 1000 * 1000);
+                ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                if(::connect(fd, address->ai_addr, address->ai_addrlen) != 0)
+                {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+            ::freeaddrinfo(addresses);
+            return fd;
+        }
+
+        const std::string _host;
+        const std::uint16_t _port;
+        const PushOptions _options;
+        std::string _path;
+
+        std::mutex _mtx;
+        std::condition_variable _wake_up;
+        bool _stop = false;
+        bool _push_requested = false;
+        std::vector<std::weak_ptr<Collectable>> _collectables = {};
+
+        std::atomic<std::uint64_t> _pushes_count = {0};
+        std::atomic<std::uint64_t> _failures_count = {0};
+
+        // Only used from the push thread
+        std::string _body;
+        std::string _request;
+        TextSerializer _text_serializer;
+        ProtobufSerializer _protobuf_serializer;
+
+        std::thread _thread;
+    };
+
+} // namespace oura_prometheus
+
+#endif
@@ -0,0 +1,461 @@
+#ifndef OURA_PROMETHEUS_SHARED_LIB_H
+#define OURA_PROMETHEUS_SHARED_LIB_H
+
+#include "oura_prometheus.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if !defined(__linux__)
+#error "oura_prometheus SharedRegistry relies on shared memory mappings and is only available on linux"
+#endif
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace oura_prometheus
+{
+    //////////////////////////////////////////////////////
+    //// SHARED MEMORY REGISTRY
+    //////////////////////////////////////////////////////
+
+    // Updates of other processes go through the shared mapping, they must not fall back on locks
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared metrics need lock free 64 bits atomics");
+
+    // A slot of shared memory, holding an integer or the bits of a double
+    using SharedSlot = std::atomic<std::uint64_t>;
+
+    inline double load_shared_double(const SharedSlot& slot)
+    {
+        const std::uint64_t bits = slot.load(std::memory_order_relaxed);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    inline void store_shared_double(SharedSlot& slot, const double value)
+    {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        slot.store(bits, std::memory_order_relaxed);
+    }
+
+    inline void add_shared_double(SharedSlot& slot, const double value)
+    {
+        std::uint64_t current = slot.load(std::memory_order_relaxed);
+        while(true)
+        {
+            double sum;
+            std::memcpy(&sum, &current, sizeof(sum));
+            sum += value;
+            std::uint64_t bits;
+            std::memcpy(&bits, &sum, sizeof(bits));
+            if(slot.compare_exchange_weak(current, bits, std::memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+
+    // How the slots of workers are exposed
+    enum class SharedAggregation
+    {
+        // A single series per child, summing the values of all workers
+        Merged,
+        // A series per child and worker, labelled by worker index
+        PerWorker
+    };
+
+    // Label of per worker series
+    const std::string shared_worker_label = "worker";
+
+    class SharedRegistry;
+
+    // Handles of shared children are plain values, valid as long as their registry is. They update the slots
+    // of the worker of their process.
+    class SharedChild
+    {
+    protected:
+        friend class SharedRegistry;
+
+        SharedChild(SharedSlot* const* worker_slots, const std::size_t offset) : _worker_slots(worker_slots), _offset(offset) {}
+
+        SharedSlot& slot(const std::size_t index) const
+        {
+            return (*_worker_slots)[_offset + index];
+        }
+
+        SharedSlot* const* _worker_slots;
+        std::size_t _offset;
+    };
+
+    class SharedCounter : public SharedChild
+    {
+    public:
+        void inc()
+        {
+            add(1);
+        }
+
+        // Values that are not positive are ignored, as by Counter
+        void add(const double value)
+        {
+            if(value > 0.0)
+            {
+                add_shared_double(slot(0), value);
+            }
+        }
+
+    protected:
+        friend class SharedRegistry;
+
+        using SharedChild::SharedChild;
+    };
+
+    class SharedGauge : public SharedChild
+    {
+    public:
+        void set(const double value)
+        {
+            store_shared_double(slot(0), value);
+        }
+
+        void inc(const double value = 1)
+        {
+            add_shared_double(slot(0), value);
+        }
+
+        void dec(const double value = 1)
+        {
+            add_shared_double(slot(0), -value);
+        }
+
+    protected:
+        friend class SharedRegistry;
+
+        using SharedChild::SharedChild;
+    };
+
+    // Buckets counts, not accumulated, come first and the sum last
+    class SharedHistogram : public SharedChild
+    {
+    public:
+        void observe(const double value)
+        {
+            const std::size_t index = std::isnan(value) ? _bounds->size() - 1
+                : std::lower_bound(_bounds->begin(), _bounds->end(), value) - _bounds->begin();
+            slot(index).fetch_add(1, std::memory_order_relaxed);
+            add_shared_double(slot(_bounds->size()), value);
+        }
+
+    protected:
+        friend class SharedRegistry;
+
+        SharedHistogram(SharedSlot* const* worker_slots, const std::size_t offset, const std::vector<double>* bounds)
+            : SharedChild(worker_slots, offset), _bounds(bounds)
+        {
+        }
+
+        const std::vector<double>* _bounds;
+    };
+
+    // Metrics of pre-forked workers, held in a shared memory segment mapped before forking them. Children are declared
+    // in the parent process, which fixes the segment layout: each worker gets the same slots, and updates them with lock
+    // free atomics without any IPC. Collections, e.g. by an exposer of the parent, read the slots of every worker into
+    // families of the library, either merged or per worker.
+    // A worker replacing a dead one takes over its index and carries its values on, gauges of dead workers keep their
+    // last value.
+    class SharedRegistry : public Collectable
+    {
+    public:
+        SharedRegistry(const std::size_t workers_count, const std::size_t slots_per_worker = 4096,
+                       const SharedAggregation aggregation = SharedAggregation::Merged)
+            : _workers_count(workers_count), _slots_per_worker(slots_per_worker), _aggregation(aggregation), _creator(::getpid())
+        {
+            if(workers_count == 0 || slots_per_worker == 0)
+            {
+                throw std::invalid_argument("Shared registry needs workers and slots");
+            }
+            _size = workers_count * slots_per_worker * sizeof(SharedSlot);
+            void* memory = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if(memory == MAP_FAILED)
+            {
+                throw std::runtime_error(std::string("Cannot map shared metrics: ") + std::strerror(errno));
+            }
+            _slots = static_cast<SharedSlot*>(memory);
+            for(std::size_t i = 0; i < workers_count * slots_per_worker; i++)
+            {
+                new(&_slots[i]) SharedSlot(0);
+            }
+            _worker_slots = _slots;
+        }
+
+        SharedRegistry(const SharedRegistry&) = delete;
+        SharedRegistry& operator=(const SharedRegistry&) = delete;
+
+        ~SharedRegistry()
+        {
+            ::munmap(_slots, _size);
+        }
+
+        // Index of the worker updates of this process go to, called by each worker once forked. It is 0 until then.
+        void set_worker(const std::size_t worker)
+        {
+            if(worker >= _workers_count)
+            {
+                throw std::invalid_argument("Worker index exceeds the workers count of the shared registry");
+            }
+            _worker_slots = _slots + worker * _slots_per_worker;
+        }
+
+        std::size_t worker() const
+        {
+            return static_cast<std::size_t>(_worker_slots - _slots) / _slots_per_worker;
+        }
+
+        std::size_t workers_count() const
+        {
+            return _workers_count;
+        }
+
+        // Children of a name share a family, declaring the same child twice gives the same handle
+        SharedCounter counter(const std::string& name, const std::string& description, const std::set<Label>& labels = {})
+        {
+            return SharedCounter(&_worker_slots, declare(name, description, MetricType::Counter, labels, {}).first);
+        }
+
+        SharedGauge gauge(const std::string& name, const std::string& description, const std::set<Label>& labels = {})
+        {
+            return SharedGauge(&_worker_slots, declare(name, description, MetricType::Gauge, labels, {}).first);
+        }
+
+        SharedHistogram histogram(const std::string& name, const std::string& description,
+                                  const std::set<double>& buckets = default_buckets, const std::set<Label>& labels = {})
+        {
+            const auto declared = declare(name, description, MetricType::Histogram, labels, buckets);
+            return SharedHistogram(&_worker_slots, declared.first, &declared.second->bounds);
+        }
+
+        virtual void collect(std::map<std::string, std::weak_ptr<Metric>>& metrics) override
+        {
+            std::shared_ptr<const MetricsSnapshot> collected = snapshot();
+            metrics.insert(collected->begin(), collected->end());
+        }
+
+        // Families are updated from the slots of all workers on each collection
+        virtual std::shared_ptr<const MetricsSnapshot> snapshot() override
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            for(Mirror& mirror : _mirrors)
+            {
+                update(mirror);
+            }
+            return _metrics;
+        }
+
+    protected:
+        struct Family
+        {
+            MetricType type;
+            std::set<std::string> labels_names;
+            // Upper bounds of histograms buckets, ending with +Inf
+            std::vector<double> bounds;
+            std::shared_ptr<Metric> metric;
+        };
+
+        // Exposed child reading the slots at offset of a range of workers
+        struct Mirror
+        {
+            MetricType type;
+            std::size_t offset;
+            std::size_t first_worker;
+            std::size_t workers;
+            std::shared_ptr<Counter> counter;
+            std::shared_ptr<Gauge> gauge;
+            std::shared_ptr<Histogram> histogram;
+        };
+
+        // Offset of the child slots and its family
+        std::pair<std::size_t, const Family*> declare(const std::string& name, const std::string& description, const MetricType type,
+                                                      const std::set<Label>& labels, const std::set<double>& buckets)
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            if(::getpid() != _creator)
+            {
+                throw std::logic_error("Shared metrics must be declared before forking workers");
+            }
+            std::set<std::string> labels_names;
+            for(const Label& label : labels)
+            {
+                labels_names.insert(label.name);
+            }
+            if(_aggregation == SharedAggregation::PerWorker && labels_names.count(shared_worker_label) != 0)
+            {
+                throw std::invalid_argument("Label " + shared_worker_label + " is reserved to per worker shared metrics");
+            }
+            auto family = _families.find(name);
+            if(family == _families.end())
+            {
+                family = _families.emplace(name, make_family(name, description, type, labels_names, buckets)).first;
+                _metrics->emplace(name, family->second.metric);
+            }
+            else if(family->second.type != type || family->second.labels_names != labels_names ||
+                    (type == MetricType::Histogram && Histogram(buckets).bounds() != family->second.bounds))
+            {
+                throw std::invalid_argument("Shared metric " + name + " is already declared with another type, labels or buckets");
+            }
+
+            const auto child = _offsets.find({name, labels});
+            if(child != _offsets.end())
+            {
+                return {child->second, &family->second};
+            }
+            const std::size_t slots_count = type == MetricType::Histogram ? family->second.bounds.size() + 1 : 1;
+            if(_next_offset + slots_count > _slots_per_worker)
+            {
+                throw std::runtime_error("Shared registry has no slot left for " + name);
+            }
+            const std::size_t offset = _next_offset;
+            _offsets.emplace(std::make_pair(name, labels), offset);
+            _next_offset += slots_count;
+
+            if(_aggregation == SharedAggregation::Merged)
+            {
+                _mirrors.push_back(make_mirror(family->second, labels, offset, 0, _workers_count));
+            }
+            else
+            {
+                for(std::size_t worker = 0; worker < _workers_count; worker++)
+                {
+                    std::set<Label> worker_labels = labels;
+                    worker_labels.insert({shared_worker_label, std::to_string(worker)});
+                    _mirrors.push_back(make_mirror(family->second, worker_labels, offset, worker, 1));
+                }
+            }
+            return {offset, &family->second};
+        }
+
+        Family make_family(const std::string& name, const std::string& description, const MetricType type,
+                           const std::set<std::string>& labels_names, const std::set<double>& buckets) const
+        {
+            std::set<std::string> exposed_names = labels_names;
+            if(_aggregation == SharedAggregation::PerWorker)
+            {
+                exposed_names.insert(shared_worker_label);
+            }
+            Family family = {type, labels_names, {}, nullptr};
+            switch(type)
+            {
+            case MetricType::Counter:
+                family.metric = std::make_shared<CounterFamily>(name, description, exposed_names);
+                break;
+            case MetricType::Gauge:
+                family.metric = std::make_shared<GaugeFamily>(name, description, exposed_names);
+                break;
+            default:
+                std::shared_ptr<HistogramFamily> histograms = std::make_shared<HistogramFamily>(name, description, exposed_names, buckets);
+                family.bounds = Histogram(buckets).bounds();
+                family.metric = histograms;
+                break;
+            }
+            return family;
+        }
+
+        static Mirror make_mirror(const Family& family, const std::set<Label>& labels, const std::size_t offset,
+                                  const std::size_t first_worker, const std::size_t workers)
+        {
+            Mirror mirror = {family.type, offset, first_worker, workers, nullptr, nullptr, nullptr};
+            switch(family.type)
+            {
+            case MetricType::Counter:
+                mirror.counter = static_cast<CounterFamily&>(*family.metric).labels(labels);
+                break;
+            case MetricType::Gauge:
+                mirror.gauge = static_cast<GaugeFamily&>(*family.metric).labels(labels);
+                break;
+            default:
+                mirror.histogram = static_cast<HistogramFamily&>(*family.metric).labels(labels);
+                break;
+            }
+            return mirror;
+        }
+
+        SharedSlot& slot(const std::size_t worker, const std::size_t offset) const
+        {
+            return _slots[worker * _slots_per_worker + offset];
+        }
+
+        // Exposed counters and histograms only ever grow, they are brought up to the shared values by adding their increase
+        void update(Mirror& mirror)
+        {
+            const std::size_t last_worker = mirror.first_worker + mirror.workers;
+            if(mirror.type == MetricType::Counter || mirror.type == MetricType::Gauge)
+            {
+                double value = 0;
+                for(std::size_t worker = mirror.first_worker; worker < last_worker; worker++)
+                {
+                    value += load_shared_double(slot(worker, mirror.offset));
+                }
+                if(mirror.gauge)
+                {
+                    mirror.gauge->set(value);
+                }
+                else if(value > mirror.counter->get())
+                {
+                    mirror.counter->add(value - mirror.counter->get());
+                }
+                return;
+            }
+            Histogram& histogram = *mirror.histogram;
+            const std::size_t buckets_count = histogram.bounds().size();
+            _counts.assign(buckets_count, 0);
+            double sum = 0;
+            for(std::size_t worker = mirror.first_worker; worker < last_worker; worker++)
+            {
+                for(std::size_t i = 0; i < buckets_count; i++)
+                {
+                    _counts[i] += slot(worker, mirror.offset + i).load(std::memory_order_relaxed);
+                }
+                sum += load_shared_double(slot(worker, mirror.offset + buckets_count));
+            }
+            for(std::size_t i = 0; i < buckets_count; i++)
+            {
+                _counts[i] -= std::min(_counts[i], histogram.bucket_count(i));
+            }
+            histogram.observe_many(_counts, sum - histogram.sum());
+        }
+
+        const std::size_t _workers_count;
+        const std::size_t _slots_per_worker;
+        const SharedAggregation _aggregation;
+        const pid_t _creator;
+        std::size_t _size = 0;
+        SharedSlot* _slots = nullptr;
+        // Slots of the worker of this process
+        SharedSlot* _worker_slots = nullptr;
+
+        std::mutex _mtx;
+        std::size_t _next_offset = 0;
+        std::map<std::string, Family> _families = {};
+        std::map<std::pair<std::string, std::set<Label>>, std::size_t> _offsets = {};
+        std::vector<Mirror> _mirrors = {};
+        const std::shared_ptr<MetricsSnapshot> _metrics = std::make_shared<MetricsSnapshot>();
+        // Only used with _mtx locked
+        std::vector<std::uint64_t> _counts = {};
+    };
+
+} // namespace oura_prometheus
+
+#endif
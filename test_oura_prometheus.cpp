@@ -2,6 +2,17 @@
 
 #include "catch.hpp"
 #include "oura_prometheus.hpp"
+#include "oura_prometheus_exposer.hpp"
+#include "oura_prometheus_pusher.hpp"
+#include "oura_prometheus_process.hpp"
+#include "oura_prometheus_shared.hpp"
+
+#include <future>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/wait.h>
 
 namespace oura_prometheus
 {
@@ -13,6 +24,28 @@ namespace oura_prometheus
         REQUIRE(d == 5);
         d = 3;
         REQUIRE(d == 3);
+
+        WHEN("it is changed from several threads")
+        {
+            atomic_double shared(0);
+            std::vector<std::thread> threads;
+            for(int i = 0; i < 4; i++)
+            {
+                threads.emplace_back([&shared](){
+                    for(int j = 0; j < 10000; j++)
+                    {
+                        shared += 2;
+                        shared -= 1;
+                    }
+                });
+            }
+            for(auto& thread : threads)
+            {
+                thread.join();
+            }
+            THEN("no change is lost")
+                REQUIRE(shared == 40000);
+        }
     }
 
     SCENARIO("metric_type_to_string calls", "[MetricType]")
@@ -27,6 +60,95 @@ namespace oura_prometheus
     {
         REQUIRE(escape_double_quotes("test") == "test");
         REQUIRE(escape_double_quotes("test\"") == "test\\\"");
+        REQUIRE(escape_double_quotes("\"a\"\"") == "\\\"a\\\"\\\"");
+    }
+
+    SCENARIO("append_escaped calls", "[append_escaped]")
+    {
+        std::string buffer = "v=";
+        append_escaped(buffer, "a\\b\"c\nd");
+        REQUIRE(buffer == "v=a\\\\b\\\"c\\nd");
+        buffer.clear();
+        append_escaped(buffer, "a\"b\n", false);
+        REQUIRE(buffer == "a\"b\\n");
+    }
+
+    SCENARIO("label set text rendering", "[LabelSet]")
+    {
+        LabelSet labels({{"l2", "b\""}, {"l1", "a"}});
+        std::string text;
+        labels.append_text(text);
+        REQUIRE(text == "l1=\"a\",l2=\"b\\\"\"");
+        REQUIRE(&labels.text() == &labels.text());
+        REQUIRE(labels.size() == 2);
+        REQUIRE(labels.name(1) == "l2");
+        REQUIRE(labels.value(1) == "b\"");
+        text.clear();
+        no_labels.append_text(text);
+        REQUIRE(text.empty());
+    }
+
+    SCENARIO("label interning", "[LabelInterner]")
+    {
+        LabelInterner& interner = LabelInterner::instance();
+        const std::size_t size = interner.size();
+        const LabelInterner::InternedString* values[] = {interner.intern("interned\nvalue"), interner.intern(std::string("interned\nvalue"))};
+        REQUIRE(values[1] == values[0]);
+        REQUIRE(values[0]->value == "interned\nvalue");
+        REQUIRE(values[0]->escaped() == "interned\\nvalue");
+        REQUIRE(interner.size() == size + 1);
+        interner.release(values, 1);
+        REQUIRE(interner.size() == size + 1);
+        interner.release(values + 1, 1);
+        REQUIRE(interner.size() == size);
+        const LabelInterner::InternedString* plain = interner.intern("plain");
+        REQUIRE(&plain->escaped() == &plain->value);
+        interner.release(&plain, 1);
+
+        GIVEN("label sets of the same labels")
+        {
+            LabelSet first({{"method", "GET"}, {"code", "200"}});
+            LabelSet second({{"code", "200"}, {"method", "GET"}});
+            LabelSet other({{"code", "200"}, {"method", "POST"}});
+
+            THEN("they share their strings and compare equal")
+            {
+                REQUIRE(&first.name(0) == &second.name(0));
+                REQUIRE(&first.value(1) == &second.value(1));
+                REQUIRE_FALSE(first < second);
+                REQUIRE_FALSE(second < first);
+                REQUIRE(first < other);
+                REQUIRE(first.matches({{"code", "200"}, {"method", "GET"}}));
+                REQUIRE_FALSE(first.matches({{"code", "200"}}));
+            }
+        }
+
+        GIVEN("a label set whose value is not used by other label sets")
+        {
+            const std::size_t size = interner.size();
+            std::unique_ptr<LabelSet> labels(new LabelSet(std::set<Label>{{"unused_name", "unused_value"}}));
+            REQUIRE(interner.size() == size + 2);
+
+            WHEN("it is destroyed")
+            {
+                labels.reset();
+                THEN("its strings are freed")
+                    REQUIRE(interner.size() == size);
+            }
+        }
+    }
+
+    SCENARIO("format_double calls", "[format_double]")
+    {
+        REQUIRE(format_double(0.005) == "0.005");
+        REQUIRE(format_double(2.5) == "2.5");
+        REQUIRE(format_double(10) == "10");
+        REQUIRE(format_double(1e6) == "1000000");
+        REQUIRE(format_double(1e-9) == "1e-09");
+        REQUIRE(format_double(0.1 + 0.2) == "0.30000000000000004");
+        REQUIRE(format_double(std::numeric_limits<double>::infinity()) == "+Inf");
+        REQUIRE(format_double(-std::numeric_limits<double>::infinity()) == "-Inf");
+        REQUIRE(format_double(std::numeric_limits<double>::quiet_NaN()) == "NaN");
     }
 
     SCENARIO("check_name_format calls", "[check_name_format]")
@@ -35,8 +157,14 @@ namespace oura_prometheus
         REQUIRE_THROWS_AS(check_name_format(s), std::invalid_argument);
         s = "1";
         REQUIRE_THROWS_AS(check_name_format(s), std::invalid_argument);
+        s = "metric-name";
+        REQUIRE_THROWS_AS(check_name_format(s), std::invalid_argument);
+        s = std::string("metric\0name", 11);
+        REQUIRE_THROWS_AS(check_name_format(s), std::invalid_argument);
         s = "_MeTriC:NaMe";
         REQUIRE_NOTHROW(check_name_format(s));
+        s = "metric_name_2";
+        REQUIRE_NOTHROW(check_name_format(s));
     }
 
     SCENARIO("check_label_name_format calls", "[check_label_name_format]")
@@ -45,10 +173,28 @@ namespace oura_prometheus
         REQUIRE_THROWS_AS(check_label_name_format(s), std::invalid_argument);
         s = "2";
         REQUIRE_THROWS_AS(check_label_name_format(s), std::invalid_argument);
+        s = "label:name";
+        REQUIRE_THROWS_AS(check_label_name_format(s), std::invalid_argument);
         s = "_LaBeL_NaMe";
         REQUIRE_NOTHROW(check_label_name_format(s));
     }
 
+    SCENARIO("compile time name checks", "[check_name_format]")
+    {
+        static_assert(is_valid_metric_name("_MeTriC:NaMe_2") && !is_valid_metric_name("2metric") && !is_valid_metric_name(""), "");
+        static_assert(is_valid_label_name("_LaBeL_2") && !is_valid_label_name("label:name"), "");
+        for(int c = 1; c < 256; c++)
+        {
+            const std::string name(1, static_cast<char>(c));
+            const bool is_letter = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+            const bool is_digit = c >= '0' && c <= '9';
+            REQUIRE(follows_name_format(name, metric_name_char) == (is_letter || c == ':'));
+            REQUIRE(follows_name_format(name, label_name_char) == is_letter);
+            REQUIRE(follows_name_format("a" + name, label_name_char) == (is_letter || is_digit));
+            REQUIRE(is_valid_metric_name(name.c_str()) == follows_name_format(name, metric_name_char));
+        }
+    }
+
     SCENARIO("registry methods calls", "[Registry]")
     {
         GIVEN("an empty registry")
@@ -99,6 +245,72 @@ namespace oura_prometheus
                         REQUIRE_FALSE(was_registered);
                 }
             }
+
+            WHEN("metrics are registered in bulk")
+            {
+                std::vector<std::shared_ptr<Metric>> metrics = {
+                    std::make_shared<GaugeMetric>("gauge_a", "Test gauge"),
+                    std::make_shared<GaugeMetric>("gauge_b", "Test gauge"),
+                    std::make_shared<GaugeMetric>("gauge_a", "Test gauge with same name")};
+
+                THEN("metrics with a new name are registered")
+                {
+                    REQUIRE(registry.register_metrics(metrics) == 2);
+                    REQUIRE(registry.size() == 2);
+                    REQUIRE(registry.get_metric("gauge_a") == metrics[0]);
+                    REQUIRE(registry.register_metrics(metrics) == 0);
+                }
+            }
+        }
+    }
+
+    SCENARIO("registry snapshots", "[Registry]")
+    {
+        GIVEN("a registry with a metric")
+        {
+            Registry registry;
+            registry.register_metric(std::make_shared<GaugeMetric>("my_gauge", "Test gauge"));
+            std::shared_ptr<const MetricsSnapshot> snapshot = registry.snapshot();
+
+            WHEN("metrics are registered and unregistered after the snapshot")
+            {
+                registry.register_metric(std::make_shared<GaugeMetric>("my_gauge_2", "Test gauge"));
+                registry.unregister_metric("my_gauge");
+
+                THEN("the snapshot is unchanged")
+                {
+                    REQUIRE(snapshot->size() == 1);
+                    REQUIRE(snapshot->count("my_gauge") == 1);
+                    REQUIRE(registry.snapshot()->count("my_gauge_2") == 1);
+                    REQUIRE(registry.size() == 1);
+                }
+            }
+
+            WHEN("metrics are collected while others are registered")
+            {
+                std::thread registering_thread([&registry](){
+                    for(int i = 0; i < 200; i++)
+                    {
+                        registry.register_metric(std::make_shared<GaugeMetric>("gauge_" + std::to_string(i), "Test gauge"));
+                    }
+                });
+                std::size_t collected_count = 0;
+                bool collected_count_never_decreased = true;
+                while(collected_count < 201)
+                {
+                    std::map<std::string, std::weak_ptr<Metric>> metrics;
+                    registry.collect(metrics);
+                    collected_count_never_decreased = collected_count_never_decreased && metrics.size() >= collected_count;
+                    collected_count = metrics.size();
+                }
+                registering_thread.join();
+
+                THEN("every collection sees a consistent registry")
+                {
+                    REQUIRE(collected_count_never_decreased);
+                    REQUIRE(registry.size() == 201);
+                }
+            }
         }
     }
 
@@ -106,7 +318,7 @@ namespace oura_prometheus
     {
         GIVEN("a metric family with some labels") 
         {
-            GaugeFamily f = GaugeFamily("my_gauge", "used for tests", {"l1", "l2"});
+            GaugeFamily f("my_gauge", "used for tests", {"l1", "l2"});
             std::shared_ptr<Gauge> gauge_1 = f.labels({{"l1", "0"},{"l2", "0"}});
             if(gauge_1)
             {
@@ -147,5 +359,2460 @@ namespace oura_prometheus
         }
     }
 
+    SCENARIO("counter increments", "[Counter]")
+    {
+        GIVEN("a counter")
+        {
+            CounterMetric counter("my_counter", "used for tests");
+
+            WHEN("whole and fractional values are added from several threads")
+            {
+                std::vector<std::thread> threads;
+                for(int i = 0; i < 4; i++)
+                {
+                    threads.emplace_back([&counter](){
+                        for(int j = 0; j < 10000; j++)
+                        {
+                            counter.inc();
+                            counter.add(2);
+                            counter.add(0.5);
+                        }
+                    });
+                }
+                for(auto& thread : threads)
+                {
+                    thread.join();
+                }
+
+                THEN("no addition is lost")
+                    REQUIRE(counter.get() == 140000);
+            }
+
+            WHEN("values beyond the exact integers of doubles are added")
+            {
+                counter.add(1e300);
+                counter.inc();
+                THEN("they are added as doubles")
+                    REQUIRE(counter.get() == 1e300);
+            }
+        }
+    }
+
+    SCENARIO("sharded counters", "[Counter]")
+    {
+        GIVEN("a sharded counter")
+        {
+            CounterMetric counter("my_counter", "used for tests", CounterStorage::Sharded);
+            REQUIRE(counter.storage() == CounterStorage::Sharded);
+            REQUIRE(counter.get() == 0);
+
+            WHEN("it is incremented from several threads")
+            {
+                std::vector<std::thread> threads;
+                for(int i = 0; i < 8; i++)
+                {
+                    threads.emplace_back([&counter](){
+                        for(int j = 0; j < 10000; j++)
+                        {
+                            counter.inc();
+                        }
+                    });
+                }
+                for(auto& thread : threads)
+                {
+                    thread.join();
+                }
+
+                THEN("no increment is lost")
+                    REQUIRE(counter.get() == 80000);
+            }
+
+            WHEN("a negative value is added")
+            {
+                counter.add(2.5);
+                counter.add(-1);
+                THEN("it is ignored")
+                    REQUIRE(counter.get() == 2.5);
+            }
+        }
+
+        GIVEN("a sharded counter family")
+        {
+            CounterFamily f("my_counter", "used for tests", {"l1"}, CounterStorage::Sharded);
+            THEN("its children are sharded")
+                REQUIRE(f.labels({{"l1", "0"}})->storage() == CounterStorage::Sharded);
+        }
+    }
+
+    SCENARIO("histogram observations", "[Histogram]")
+    {
+        GIVEN("a histogram with some buckets")
+        {
+            Histogram h({0.1, 1, 10});
+
+            THEN("values are mapped to the first bucket greater or equal to them")
+            {
+                REQUIRE(h.bucket_index(0.05) == 0);
+                REQUIRE(h.bucket_index(0.1) == 0);
+                REQUIRE(h.bucket_index(0.5) == 1);
+                REQUIRE(h.bucket_index(10) == 2);
+                REQUIRE(h.bucket_index(11) == 3);
+                REQUIRE(h.bucket_index(std::numeric_limits<double>::quiet_NaN()) == 3);
+            }
+
+            WHEN("some values are observed")
+            {
+                h.observe(0.05);
+                h.observe(0.5);
+                h.observe(0.7);
+                h.observe(100);
+                std::map<double, double> buckets = h.buckets();
+
+                THEN("bucket counts are cumulative")
+                {
+                    REQUIRE(buckets.size() == 4);
+                    REQUIRE(buckets[0.1] == 1);
+                    REQUIRE(buckets[1] == 3);
+                    REQUIRE(buckets[10] == 3);
+                    REQUIRE(buckets[std::numeric_limits<double>::infinity()] == 4);
+                }
+            }
+        }
+    }
+
+    SCENARIO("local accumulators", "[LocalCounter][LocalHistogram]")
+    {
+        GIVEN("a counter and a local accumulator flushing every 3 updates")
+        {
+            std::shared_ptr<Counter> counter = std::make_shared<Counter>();
+            LocalFlushPolicy policy;
+            policy.max_pending = 3;
+            std::unique_ptr<LocalCounter> local(new LocalCounter(counter, policy));
+
+            WHEN("it is updated less than 3 times")
+            {
+                local->inc();
+                local->add(2);
+                local->add(-1);
+                THEN("the counter reads include them until a flush moves them into it")
+                {
+                    REQUIRE(counter->get() == 3);
+                    REQUIRE(local->pending() == 3);
+                    local->flush();
+                    REQUIRE(counter->get() == 3);
+                    REQUIRE(local->pending() == 0);
+                }
+            }
+
+            WHEN("it is updated 3 times")
+            {
+                local->inc();
+                local->inc();
+                local->inc();
+                THEN("the updates are flushed")
+                    REQUIRE(counter->get() == 3);
+            }
+
+            WHEN("it is destroyed")
+            {
+                local->add(1.5);
+                local.reset();
+                THEN("pending updates are flushed")
+                    REQUIRE(counter->get() == 1.5);
+            }
+        }
+
+        GIVEN("a local counter accumulator with a null delay")
+        {
+            std::shared_ptr<Counter> counter = std::make_shared<Counter>();
+            LocalFlushPolicy policy;
+            policy.max_delay = std::chrono::milliseconds(0);
+            LocalCounter local(counter, policy);
+
+            WHEN("it is updated local_clock_period times")
+            {
+                for(std::size_t i = 0; i < local_clock_period; i++)
+                {
+                    local.inc();
+                }
+                THEN("the updates are flushed")
+                    REQUIRE(counter->get() == local_clock_period);
+            }
+        }
+
+        GIVEN("a histogram and a local accumulator")
+        {
+            std::shared_ptr<Histogram> histogram = std::make_shared<Histogram>(std::set<double>{0.1, 1, 10});
+            std::unique_ptr<LocalHistogram> local(new LocalHistogram(histogram));
+
+            WHEN("values are observed and flushed")
+            {
+                local->observe(0.05);
+                local->observe(0.5);
+                local->observe(100);
+                REQUIRE(histogram->count() == 3);
+                REQUIRE(histogram->bucket_count(3) == 1);
+                REQUIRE(local->pending() == 3);
+                local.reset();
+                std::map<double, double> buckets = histogram->buckets();
+
+                THEN("the histogram holds them")
+                {
+                    REQUIRE(histogram->count() == 3);
+                    REQUIRE(histogram->sum() == Approx(100.55));
+                    REQUIRE(buckets[0.1] == 1);
+                    REQUIRE(buckets[1] == 2);
+                    REQUIRE(buckets[10] == 2);
+                }
+            }
+        }
+
+        GIVEN("a family child updated by a local accumulator that is no longer used")
+        {
+            std::shared_ptr<CounterFamily> family = std::make_shared<CounterFamily>("processed_total", "used for tests", std::set<std::string>{"l1"});
+            LocalCounter local(family->with_labels("batch"));
+            local.add(5);
+
+            WHEN("the family is scraped")
+            {
+                std::string buffer;
+                TextSerializer().serialize(buffer, MetricsSnapshot{{family->get_name(), family}});
+
+                THEN("the pending additions are exposed")
+                {
+                    REQUIRE(local.pending() == 5);
+                    REQUIRE(buffer.find("\nprocessed_total{l1=\"batch\"} 5\n") != std::string::npos);
+                }
+            }
+        }
+
+        GIVEN("local accumulators flushing often while their metrics are read")
+        {
+            std::shared_ptr<Counter> counter = std::make_shared<Counter>();
+            std::shared_ptr<Histogram> histogram = std::make_shared<Histogram>(std::set<double>{1});
+            std::atomic<bool> done(false);
+            std::thread writer([&](){
+                LocalFlushPolicy policy;
+                policy.max_pending = 7;
+                LocalCounter local_counter(counter, policy);
+                LocalHistogram local_histogram(histogram, policy);
+                for(int i = 0; i < 20000; i++)
+                {
+                    local_counter.inc();
+                    local_histogram.observe(0.5);
+                }
+                done = true;
+            });
+            bool increasing = true;
+            double counter_value = 0;
+            std::uint64_t histogram_count = 0;
+            while(!done)
+            {
+                const double value = counter->get();
+                const std::uint64_t count = histogram->count();
+                increasing = increasing && value >= counter_value && count >= histogram_count;
+                counter_value = value;
+                histogram_count = count;
+            }
+            writer.join();
+
+            THEN("reads never count an update twice nor miss a flushed one")
+            {
+                REQUIRE(increasing);
+                REQUIRE(counter->get() == 20000);
+                REQUIRE(histogram->count() == 20000);
+                REQUIRE(histogram->bucket_count(0) == 20000);
+            }
+        }
+
+        GIVEN("local accumulators flushing every update")
+        {
+            std::shared_ptr<Counter> counter = std::make_shared<Counter>();
+            std::shared_ptr<Histogram> histogram = std::make_shared<Histogram>(std::set<double>{1});
+            LocalFlushPolicy policy;
+            policy.max_pending = 1;
+            LocalCounter local_counter(counter, policy);
+            LocalHistogram local_histogram(histogram, policy);
+
+            WHEN("they are updated once")
+            {
+                local_counter.inc();
+                local_histogram.observe(0.5);
+                THEN("the update is flushed")
+                {
+                    REQUIRE(counter->get() == 1);
+                    REQUIRE(histogram->count() == 1);
+                    REQUIRE(local_histogram.pending() == 0);
+                }
+            }
+        }
+    }
+
+    SCENARIO("scoped timers", "[ScopedTimer]")
+    {
+        GIVEN("metrics timing a section")
+        {
+            std::shared_ptr<HistogramFamily> family = std::make_shared<HistogramFamily>("section_seconds", "used for tests", std::set<std::string>{"name"});
+            Summary summary;
+            GaugeMetric last_duration("last_duration_seconds", "used for tests");
+
+            WHEN("timers go out of scope")
+            {
+                {
+                    ScopedTimer histogram_timer(family->with_labels("sleep"));
+                    ScopedTimer summary_timer(summary);
+                    ScopedTimer gauge_timer(last_duration);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                }
+
+                THEN("the elapsed seconds are recorded")
+                {
+                    std::shared_ptr<Histogram> histogram = family->with_labels("sleep");
+                    REQUIRE(histogram->count() == 1);
+                    REQUIRE(histogram->sum() >= 0.005);
+                    REQUIRE(summary.count() == 1);
+                    REQUIRE(last_duration.get() >= 0.005);
+                    REQUIRE(last_duration.get() < 10);
+                }
+            }
+
+            WHEN("timers are given handles held in variables")
+            {
+                std::shared_ptr<Histogram> histogram = family->with_labels("handle");
+                std::shared_ptr<Summary> shared_summary = std::make_shared<Summary>();
+                const std::shared_ptr<Summary>& const_summary = shared_summary;
+                {
+                    ScopedTimer histogram_timer(histogram);
+                    ScopedTimer summary_timer(const_summary);
+                    histogram.reset();
+                }
+
+                THEN("they observe the metrics")
+                {
+                    REQUIRE(family->with_labels("handle")->count() == 1);
+                    REQUIRE(shared_summary->count() == 1);
+                }
+            }
+
+            WHEN("timers are stopped or cancelled")
+            {
+                ScopedTimer stopped(summary);
+                const double seconds = stopped.stop();
+                stopped.stop();
+                {
+                    ScopedTimer cancelled(summary);
+                    cancelled.cancel();
+                }
+
+                THEN("only the first stop is recorded")
+                {
+                    REQUIRE(summary.count() == 1);
+                    REQUIRE(summary.sum() == seconds);
+                }
+            }
+
+#if defined(__x86_64__) || defined(__i386__)
+            WHEN("the time stamp counter times the section")
+            {
+                {
+                    TscScopedTimer timer(summary);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                }
+
+                THEN("its ticks are converted to seconds")
+                {
+                    REQUIRE(TscClock::seconds_per_tick() > 0);
+                    REQUIRE(summary.sum() >= 0.004);
+                    REQUIRE(summary.sum() < 10);
+                }
+            }
+#endif
+        }
+
+        GIVEN("a gauge of sections in progress")
+        {
+            Gauge in_progress;
+            {
+                std::shared_ptr<Gauge> handle = std::make_shared<Gauge>();
+                InProgressTracker first(in_progress);
+                InProgressTracker second(in_progress);
+                InProgressTracker shared(handle);
+                REQUIRE(in_progress.get() == 2);
+                REQUIRE(handle->get() == 1);
+            }
+            THEN("it goes back down once they end")
+                REQUIRE(in_progress.get() == 0);
+
+            THEN("it can be set to the current time")
+            {
+                in_progress.set_to_current_time();
+                REQUIRE(in_progress.get() == Approx(unix_time()).margin(60));
+            }
+        }
+    }
+
+    SCENARIO("histogram serialization", "[Histogram][TextSerializer]")
+    {
+        GIVEN("a histogram metric with some observations")
+        {
+            std::shared_ptr<HistogramMetric> h = std::make_shared<HistogramMetric>("my_histogram", "used for tests", std::set<double>{0.5, 2.5});
+            h->observe(0.25);
+            h->observe(1);
+            h->observe(3);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{h->get_name(), h}};
+
+            WHEN("it is serialized")
+            {
+                std::stringstream stream;
+                TextSerializer().serialize(stream, metrics);
+
+                THEN("buckets, sum and count are exposed")
+                    REQUIRE(stream.str() ==
+                        "# HELP my_histogram used for tests\n"
+                        "# TYPE my_histogram histogram\n"
+                        "my_histogram_bucket{le=\"0.5\"} 1\n"
+                        "my_histogram_bucket{le=\"2.5\"} 2\n"
+                        "my_histogram_bucket{le=\"+Inf\"} 3\n"
+                        "my_histogram_sum 4.25\n"
+                        "my_histogram_count 3\n");
+            }
+        }
+
+        GIVEN("a histogram family")
+        {
+            THEN("le cannot be used as a label name")
+                REQUIRE_THROWS_AS(HistogramFamily("my_histogram", "used for tests", {"le"}), std::invalid_argument);
+
+            THEN("its type is histogram")
+                REQUIRE(HistogramFamily("my_histogram", "used for tests", {"l1"}).get_type() == MetricType::Histogram);
+        }
+    }
+
+#if defined(__cpp_nontype_template_args) && __cpp_nontype_template_args >= 201911L
+    SCENARIO("static metric families", "[StaticMetricFamily]")
+    {
+        GIVEN("a static counter family")
+        {
+            StaticCounterFamily<"http_requests_total", "method", "code"> family("used for tests");
+
+            WHEN("children are given label values in label names arguments order")
+            {
+                family.with_labels("GET", "200")->inc();
+                family.with_labels(std::string("GET"), "200")->inc();
+                family.with_labels("POST", "500")->inc();
+
+                THEN("they are the children of the matching label set")
+                {
+                    REQUIRE(family.size() == 2);
+                    REQUIRE(family.get_name() == "http_requests_total");
+                    REQUIRE(family.labels({{"code", "200"}, {"method", "GET"}})->get() == 2);
+                    REQUIRE(family.labels({{"code", "500"}, {"method", "POST"}})->get() == 1);
+                }
+            }
+        }
+
+        GIVEN("a static histogram family")
+        {
+            StaticHistogramFamily<"latency_seconds", "path"> family("used for tests", std::set<double>{1, 2});
+
+            THEN("family arguments follow the description")
+            {
+                family.with_labels("/")->observe(1.5);
+                REQUIRE(family.with_labels("/")->bounds().size() == 3);
+                REQUIRE(family.with_labels("/")->count() == 1);
+            }
+        }
+    }
+#endif
 
+    SCENARIO("concurrent labels method calls", "[MetricFamily]")
+    {
+        GIVEN("a counter family used from several threads")
+        {
+            CounterFamily f("my_counter", "used for tests", {"l1", "l2"}, CounterStorage::Sharded);
+            std::vector<std::thread> threads;
+            for(int i = 0; i < 8; i++)
+            {
+                threads.emplace_back([&f](){
+                    for(int j = 0; j < 1000; j++)
+                    {
+                        f.labels({{"l1", std::to_string(j % 100)}, {"l2", "x"}})->inc();
+                    }
+                });
+            }
+            for(auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            THEN("each label combinaison is created once")
+            {
+                REQUIRE(f.size() == 100);
+                for(int j = 0; j < 100; j++)
+                {
+                    REQUIRE(f.labels({{"l1", std::to_string(j)}, {"l2", "x"}})->get() == 80);
+                }
+            }
+        }
+    }
+
+    SCENARIO("label combinaisons created during a serialization", "[MetricFamily]")
+    {
+        GIVEN("a counter family being serialized chunk by chunk")
+        {
+            std::shared_ptr<CounterFamily> family = std::make_shared<CounterFamily>("my_counter", "used for tests", std::set<std::string>{"l1"});
+            family->labels({{"l1", "a"}})->inc();
+            family->labels({{"l1", "b"}})->inc();
+            const MetricsSnapshot metrics = {{family->get_name(), family}};
+            std::string buffer;
+            std::size_t chunks_count = 0;
+            bool created_meanwhile = false;
+            std::future<void> creation;
+
+            WHEN("another thread creates a child while a chunk is consumed")
+            {
+                TextSerializer().serialize(buffer, metrics, [&](const std::string&){
+                    if(chunks_count++ == 0)
+                    {
+                        creation = std::async(std::launch::async, [&family](){family->labels({{"l1", "c"}})->inc();});
+                        created_meanwhile = creation.wait_for(std::chrono::seconds(1)) == std::future_status::ready;
+                    }
+                }, 1);
+                creation.wait();
+
+                THEN("the creation does not wait for the serialization to end")
+                {
+                    REQUIRE(created_meanwhile);
+                    REQUIRE(family->size() == 3);
+                }
+            }
+        }
+    }
+
+    SCENARIO("family children storage", "[MetricFamily]")
+    {
+        GIVEN("a family with a few children")
+        {
+            std::shared_ptr<Counter> first_child;
+            std::shared_ptr<Counter> second_child;
+            {
+                CounterFamily family("my_counter", "used for tests", {"l"});
+                first_child = family.with_labels("b");
+                second_child = family.with_labels("a");
+                first_child->inc();
+
+                THEN("children are laid out in creation order")
+                    REQUIRE(first_child.get() < second_child.get());
+            }
+
+            THEN("children handles outlive their family")
+            {
+                second_child->inc();
+                REQUIRE(first_child->get() == 1);
+                REQUIRE(second_child->get() == 1);
+            }
+        }
+
+        GIVEN("children arenas")
+        {
+            ChildrenArena arena;
+            void* small = arena.allocate(24, 8);
+            void* aligned = arena.allocate(8, 64);
+
+            THEN("allocations are aligned and grow the arena by chunks")
+            {
+                REQUIRE(reinterpret_cast<std::uintptr_t>(small) % 8 == 0);
+                REQUIRE(reinterpret_cast<std::uintptr_t>(aligned) % 64 == 0);
+                REQUIRE(arena.capacity() == arena_min_chunk_size);
+                arena.allocate(2 * arena_min_chunk_size, 8);
+                REQUIRE(arena.capacity() >= 3 * arena_min_chunk_size);
+            }
+        }
+    }
+
+    SCENARIO("family limits", "[MetricFamily]")
+    {
+        GIVEN("a family limited to 2 children dropping overflowed ones")
+        {
+            std::shared_ptr<CounterFamily> family = std::make_shared<CounterFamily>("my_counter", "used for tests", std::set<std::string>{"l"});
+            FamilyLimits limits;
+            limits.max_cardinality = 2;
+            family->set_limits(limits);
+            family->with_labels("a")->inc();
+            family->with_labels("b")->inc();
+            std::shared_ptr<Counter> dropped = family->with_labels("c");
+            dropped->inc();
+
+            THEN("overflowed children are not exposed")
+            {
+                REQUIRE(family->size() == 2);
+                REQUIRE(family->with_labels("d") == dropped);
+                REQUIRE(family->with_labels("a") != dropped);
+                std::string buffer;
+                std::map<std::string, std::weak_ptr<Metric>> metrics = {{family->get_name(), family}};
+                TextSerializer().serialize(buffer, metrics);
+                REQUIRE(buffer.find("l=\"c\"") == std::string::npos);
+            }
+
+            THEN("limits cannot change once children exist")
+                REQUIRE_THROWS_AS(family->set_limits(limits), std::logic_error);
+        }
+
+        GIVEN("a family limited to 1 child collapsing overflowed ones")
+        {
+            GaugeFamily family("my_gauge", "used for tests", {"l1", "l2"});
+            FamilyLimits limits;
+            limits.max_cardinality = 1;
+            limits.overflow_policy = OverflowPolicy::Collapse;
+            family.set_limits(limits);
+            family.with_labels("a", "b")->set(1);
+            family.with_labels("c", "d")->inc();
+            family.with_labels("e", "f")->inc();
+
+            THEN("overflowed children share an other child")
+            {
+                REQUIRE(family.size() == 2);
+                REQUIRE(family.with_labels("other", "other")->get() == 2);
+            }
+        }
+
+        GIVEN("a family whose children expire")
+        {
+            std::shared_ptr<CounterFamily> family = std::make_shared<CounterFamily>("my_counter", "used for tests", std::set<std::string>{"l"});
+            FamilyLimits limits;
+            limits.ttl = std::chrono::milliseconds(20);
+            family->set_limits(limits);
+            std::shared_ptr<Counter> updated = family->with_labels("updated");
+            std::shared_ptr<Counter> idle = family->with_labels("idle");
+            idle->inc();
+            // Updates are seen by sweeps, the first one sees both children in use
+            REQUIRE(family->remove_expired() == 0);
+
+            WHEN("only one child is updated for longer than the ttl")
+            {
+                idle.reset();
+                std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                updated->inc();
+                REQUIRE(family->remove_expired() == 1);
+
+                THEN("the idle child is removed")
+                {
+                    REQUIRE(family->size() == 1);
+                    REQUIRE(family->with_labels("updated") == updated);
+                    REQUIRE(family->with_labels("idle")->get() == 0);
+                }
+            }
+
+            WHEN("children held by a handle are idle for longer than the ttl")
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                REQUIRE(family->remove_expired() == 0);
+
+                THEN("they are kept, along with their updates")
+                {
+                    idle->inc();
+                    REQUIRE(family->with_labels("idle") == idle);
+                    REQUIRE(family->with_labels("idle")->get() == 2);
+                }
+            }
+
+            WHEN("children are looked up while others expire")
+            {
+                updated.reset();
+                idle.reset();
+                std::atomic<bool> stop(false);
+                std::vector<std::thread> threads;
+                for(int i = 0; i < 4; i++)
+                {
+                    threads.emplace_back([&family, &stop, i](){
+                        for(int j = 0; !stop; j++)
+                        {
+                            family->with_labels(std::to_string(i * 100 + j % 100))->inc();
+                        }
+                    });
+                }
+                std::size_t removed_count = 0;
+                for(int i = 0; i < 20; i++)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+                    removed_count += family->remove_expired();
+                }
+                stop = true;
+                for(auto& thread : threads)
+                {
+                    thread.join();
+                }
+
+                THEN("idle children are removed")
+                {
+                    REQUIRE(family->size() <= 402);
+                    REQUIRE(removed_count >= 2);
+                    REQUIRE(family->with_labels("updated")->get() == 0);
+                }
+            }
+        }
+
+        GIVEN("a gauge family whose children expire")
+        {
+            GaugeFamily family("my_gauge", "used for tests", {"l"});
+            FamilyLimits limits;
+            limits.ttl = std::chrono::milliseconds(20);
+            family.set_limits(limits);
+            // Neither looked up nor held by a handle, only its updates keep it
+            Gauge* steady = family.with_labels("steady").get();
+            steady->set(1);
+            family.with_labels("nan")->set(std::numeric_limits<double>::quiet_NaN());
+            REQUIRE(family.remove_expired() == 0);
+
+            WHEN("one is set to its current value for longer than the ttl")
+            {
+                for(int i = 0; i < 3; i++)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(15));
+                    steady->set(1);
+                    family.remove_expired();
+                }
+
+                THEN("only the other one is removed")
+                {
+                    REQUIRE(family.size() == 1);
+                    REQUIRE(family.with_labels("steady")->get() == 1);
+                }
+            }
+        }
+
+        GIVEN("a full family whose children expire")
+        {
+            CounterFamily family("my_counter", "used for tests", {"l"});
+            FamilyLimits limits;
+            limits.max_cardinality = 1;
+            limits.ttl = std::chrono::milliseconds(20);
+            family.set_limits(limits);
+            family.with_labels("a")->inc();
+            std::shared_ptr<Counter> dropped = family.with_labels("b");
+            REQUIRE(family.with_labels("c") == dropped);
+
+            WHEN("its child expires")
+            {
+                family.remove_expired();
+                std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                REQUIRE(family.remove_expired() == 1);
+
+                THEN("a new label combinaison gets a child of its own")
+                {
+                    REQUIRE(family.with_labels("c") != dropped);
+                    REQUIRE(family.size() == 1);
+                }
+            }
+        }
+
+        GIVEN("a registry holding a family whose children expire")
+        {
+            std::shared_ptr<Registry> registry = std::make_shared<Registry>();
+            std::shared_ptr<CounterFamily> family = std::make_shared<CounterFamily>("my_counter", "used for tests", std::set<std::string>{"l"});
+            FamilyLimits limits;
+            limits.ttl = std::chrono::milliseconds(20);
+            family->set_limits(limits);
+            registry->register_metric(family);
+            family->with_labels("idle")->inc();
+            TextSerializer serializer;
+            std::string text;
+            serializer.serialize(text, *registry->snapshot());
+
+            WHEN("the idle child is only serialized for longer than the ttl")
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(30));
+                serializer.serialize(text, MetricsSnapshot{{family->get_name(), family}});
+                const std::size_t size = family->size();
+                text.clear();
+                serializer.serialize(text, *registry->snapshot());
+
+                THEN("it is removed by the registry collection")
+                {
+                    REQUIRE(size == 1);
+                    REQUIRE(family->size() == 0);
+                    REQUIRE(text.find("idle") == std::string::npos);
+                }
+            }
+        }
+    }
+
+    SCENARIO("with_labels method calls", "[MetricFamily]")
+    {
+        GIVEN("a metric family with some labels")
+        {
+            GaugeFamily f("my_gauge", "used for tests", {"method", "code"});
+            std::shared_ptr<Gauge> gauge_1 = f.labels({{"method", "GET"}, {"code", "200"}});
+
+            WHEN("values are given in label names declaration order")
+            {
+                const std::string code = "200";
+                std::shared_ptr<Gauge> gauge_2 = f.with_labels("GET", code);
+                THEN("it should return the metric of the matching label set")
+                    REQUIRE(gauge_2 == gauge_1);
+            }
+
+            WHEN("label names are given by a set")
+            {
+                GaugeFamily sorted("my_gauge", "used for tests", std::set<std::string>{"method", "code"});
+                std::shared_ptr<Gauge> gauge_2 = sorted.with_labels("200", "GET");
+                THEN("values are given in sorted names order")
+                    REQUIRE(sorted.labels({{"method", "GET"}, {"code", "200"}}) == gauge_2);
+            }
+
+            WHEN("a new label combinaison is given")
+            {
+                std::shared_ptr<Gauge> gauge_2 = f.with_labels("GET", "404");
+                THEN("it should be reachable from the label set")
+                {
+                    REQUIRE(gauge_2 != gauge_1);
+                    REQUIRE(f.labels({{"method", "GET"}, {"code", "404"}}) == gauge_2);
+                    REQUIRE(f.size() == 2);
+                }
+            }
+
+            WHEN("a wrong number of values is given")
+                THEN("it should raise invalid_argument exception")
+                {
+                    REQUIRE_THROWS_AS(f.with_labels("200"), std::invalid_argument);
+                    REQUIRE_THROWS_AS(f.with_labels("200", "GET", "x"), std::invalid_argument);
+                    REQUIRE_THROWS_AS(f.with_labels(), std::invalid_argument);
+                }
+
+            WHEN("label names are repeated")
+                THEN("it should raise invalid_argument exception")
+                    REQUIRE_THROWS_AS(GaugeFamily("my_gauge", "used for tests", {"code", "code"}), std::invalid_argument);
+        }
+    }
+
+    SCENARIO("text serialization", "[TextSerializer]")
+    {
+        GIVEN("some metrics")
+        {
+            std::shared_ptr<CounterMetric> counter = std::make_shared<CounterMetric>("my_counter", "used for\ntests");
+            counter->add(1234567);
+            std::shared_ptr<GaugeFamily> gauges = std::make_shared<GaugeFamily>("my_gauge", "used for tests", std::set<std::string>{"l1", "l2"});
+            gauges->with_labels("a", "b")->set(0.5);
+            gauges->with_labels("x\"y", "\\")->set(-2);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{counter->get_name(), counter}, {gauges->get_name(), gauges}};
+            const std::string expected =
+                "# HELP my_counter used for\\ntests\n"
+                "# TYPE my_counter counter\n"
+                "my_counter 1234567\n"
+                "# HELP my_gauge used for tests\n"
+                "# TYPE my_gauge gauge\n"
+                "my_gauge{l1=\"a\",l2=\"b\"} 0.5\n"
+                "my_gauge{l1=\"x\\\"y\",l2=\"\\\\\"} -2\n";
+
+            WHEN("they are serialized into a buffer")
+            {
+                std::string buffer;
+                TextSerializer serializer;
+                serializer.serialize(buffer, metrics);
+
+                THEN("the buffer holds the text exposition")
+                    REQUIRE(buffer == expected);
+
+                THEN("the buffer can be reused")
+                {
+                    buffer.clear();
+                    serializer.serialize(buffer, metrics);
+                    REQUIRE(buffer == expected);
+                }
+            }
+
+            WHEN("they are serialized chunk by chunk")
+            {
+                std::string buffer;
+                std::vector<std::string> chunks;
+                TextSerializer().serialize(buffer, metrics, [&chunks](const std::string& chunk){chunks.push_back(chunk);}, 1);
+
+                THEN("chunks hold whole samples and add up to the text exposition")
+                {
+                    REQUIRE(chunks.size() == 3);
+                    REQUIRE(chunks[1] == "# HELP my_gauge used for tests\n# TYPE my_gauge gauge\nmy_gauge{l1=\"a\",l2=\"b\"} 0.5\n");
+                    REQUIRE(chunks[0] + chunks[1] + chunks[2] == expected);
+                    REQUIRE(buffer.empty());
+                }
+            }
+
+            WHEN("they are serialized into a stream")
+            {
+                std::stringstream stream;
+                TextSerializer().serialize(stream, metrics);
+
+                THEN("the stream holds the text exposition")
+                    REQUIRE(stream.str() == expected);
+            }
+        }
+    }
+
+    SCENARIO("cached text serialization", "[CachingTextSerializer]")
+    {
+        GIVEN("some metrics and a caching serializer")
+        {
+            std::shared_ptr<CounterFamily> counters = std::make_shared<CounterFamily>("a_total", "used for tests", std::set<std::string>{"l1"});
+            std::shared_ptr<HistogramFamily> histograms = std::make_shared<HistogramFamily>("b_seconds", "used for tests", std::set<std::string>{"l1"});
+            std::shared_ptr<SummaryMetric> summary = std::make_shared<SummaryMetric>("c_seconds", "used for tests");
+            for(int i = 0; i < 10; i++)
+            {
+                counters->with_labels(std::to_string(i))->add(i);
+                histograms->with_labels(std::to_string(i))->observe(i);
+            }
+            summary->observe(1);
+            const MetricsSnapshot metrics = {{counters->get_name(), counters}, {histograms->get_name(), histograms}, {summary->get_name(), summary}};
+            CachingTextSerializer serializer;
+            std::string buffer;
+            serializer.serialize(buffer, metrics);
+            REQUIRE(serializer.rendered_count() == 21);
+
+            WHEN("some children are updated or created before the next serialization")
+            {
+                counters->with_labels("3")->inc();
+                histograms->with_labels("7")->observe(2);
+                counters->with_labels("new")->inc();
+                buffer.clear();
+                serializer.serialize(buffer, metrics);
+                std::string expected;
+                TextSerializer().serialize(expected, metrics);
+
+                THEN("only them and the summary are rendered")
+                {
+                    REQUIRE(serializer.rendered_count() == 4);
+                    REQUIRE(buffer == expected);
+                }
+            }
+
+            WHEN("nothing changes")
+            {
+                buffer.clear();
+                serializer.serialize(buffer, metrics);
+                std::string expected;
+                TextSerializer().serialize(expected, metrics);
+
+                THEN("lines are copied from the cache")
+                {
+                    REQUIRE(serializer.rendered_count() == 1);
+                    REQUIRE(buffer == expected);
+                }
+            }
+
+            WHEN("a metric is replaced by another one of the same name")
+            {
+                std::shared_ptr<CounterFamily> other = std::make_shared<CounterFamily>("a_total", "used for tests", std::set<std::string>{"l1"});
+                other->with_labels("0")->add(5);
+                const MetricsSnapshot other_metrics = {{other->get_name(), other}};
+                buffer.clear();
+                serializer.serialize(buffer, other_metrics);
+
+                THEN("its children are rendered")
+                {
+                    REQUIRE(serializer.rendered_count() == 1);
+                    REQUIRE(buffer == "# HELP a_total used for tests\n# TYPE a_total counter\na_total{l1=\"0\"} 5\n");
+                }
+            }
+        }
+
+        GIVEN("histograms updated while they are serialized with caching")
+        {
+            std::shared_ptr<HistogramMetric> histogram = std::make_shared<HistogramMetric>("a_seconds", "used for tests", std::set<double>{1, 2});
+            std::shared_ptr<NativeHistogramMetric> native_histogram = std::make_shared<NativeHistogramMetric>("b_seconds", "used for tests");
+            const MetricsSnapshot metrics = {{histogram->get_name(), histogram}, {native_histogram->get_name(), native_histogram}};
+            CachingTextSerializer serializer;
+            std::string buffer;
+            std::atomic<bool> done(false);
+            std::thread writer([&](){
+                for(int i = 0; i < 20000; i++)
+                {
+                    histogram->observe_many({0, 1, 1}, 5);
+                    native_histogram->observe(i % 100);
+                }
+                done = true;
+            });
+            while(!done)
+            {
+                buffer.clear();
+                serializer.serialize(buffer, metrics);
+            }
+            writer.join();
+
+            WHEN("they are serialized once the updates are done")
+            {
+                buffer.clear();
+                serializer.serialize(buffer, metrics);
+                std::string expected;
+                TextSerializer().serialize(expected, metrics);
+
+                THEN("no line rendered during an update is left in the cache")
+                    REQUIRE(buffer == expected);
+            }
+        }
+
+        GIVEN("a caching serializer and a family of more children than it caches")
+        {
+            std::shared_ptr<CounterFamily> counters = std::make_shared<CounterFamily>("a_total", "used for tests", std::set<std::string>{"l1"});
+            for(int i = 0; i < 10; i++)
+            {
+                counters->with_labels(std::to_string(i))->add(i);
+            }
+            const MetricsSnapshot metrics = {{counters->get_name(), counters}};
+            CachingTextSerializer serializer(5);
+            std::string buffer;
+            serializer.serialize(buffer, metrics);
+
+            WHEN("it is serialized again")
+            {
+                buffer.clear();
+                serializer.serialize(buffer, metrics);
+                std::string expected;
+                TextSerializer().serialize(expected, metrics);
+
+                THEN("its children are rendered")
+                {
+                    REQUIRE(serializer.rendered_count() == 10);
+                    REQUIRE(buffer == expected);
+                }
+            }
+        }
+    }
+
+    SCENARIO("parallel serialization", "[TextSerializer]")
+    {
+        GIVEN("small metrics and a family bigger than the parts size")
+        {
+            std::shared_ptr<CounterMetric> counter = std::make_shared<CounterMetric>("a_total", "used for tests");
+            counter->inc();
+            std::shared_ptr<GaugeFamily> empty = std::make_shared<GaugeFamily>("b_gauge", "used for tests", std::set<std::string>{"l1"});
+            std::shared_ptr<HistogramFamily> histograms = std::make_shared<HistogramFamily>("c_seconds", "used for tests", std::set<std::string>{"l1"});
+            std::shared_ptr<CounterFamily> counters = std::make_shared<CounterFamily>("d_total", "used for tests", std::set<std::string>{"l1"});
+            for(int i = 0; i < 100; i++)
+            {
+                histograms->with_labels(std::to_string(i))->observe(i);
+                counters->with_labels(std::to_string(i))->add(i);
+            }
+            const MetricsSnapshot metrics = {{counter->get_name(), counter}, {empty->get_name(), empty},
+                                             {histograms->get_name(), histograms}, {counters->get_name(), counters}};
+
+            WHEN("they are serialized by several threads")
+            {
+                std::string text;
+                TextSerializer().serialize(text, metrics);
+                std::string parallel_text;
+                TextSerializer(4, 7).serialize(parallel_text, metrics);
+                std::string open_metrics;
+                OpenMetricsSerializer().serialize(open_metrics, metrics);
+                std::string parallel_open_metrics;
+                OpenMetricsSerializer(3, 10).serialize(parallel_open_metrics, metrics);
+
+                THEN("the output is the sequential one")
+                {
+                    REQUIRE(parallel_text == text);
+                    REQUIRE(parallel_open_metrics == open_metrics);
+                }
+            }
+
+            WHEN("they are serialized by several threads chunk by chunk")
+            {
+                std::string buffer;
+                std::string chunks;
+                std::size_t chunks_count = 0;
+                TextSerializer(2, 16).serialize(buffer, metrics, [&](const std::string& chunk){
+                    chunks += chunk;
+                    chunks_count++;
+                }, 1000);
+                std::string text;
+                TextSerializer().serialize(text, metrics);
+
+                THEN("chunks add up to the sequential output")
+                {
+                    REQUIRE(chunks == text);
+                    REQUIRE(chunks_count > 1);
+                    REQUIRE(buffer.empty());
+                }
+            }
+
+            WHEN("they are serialized by several threads for a consumer that fails")
+            {
+                std::string buffer;
+                std::size_t chunks_count = 0;
+                auto serialize = [&](){
+                    TextSerializer(2, 16).serialize(buffer, metrics, [&](const std::string&){
+                        if(++chunks_count == 2)
+                        {
+                            throw std::runtime_error("connection closed");
+                        }
+                    }, 100);
+                };
+                THEN("the consumer exception is forwarded once the serialization stopped")
+                {
+                    REQUIRE_THROWS_AS(serialize(), std::runtime_error);
+                    REQUIRE(chunks_count == 2);
+                }
+            }
+        }
+
+        GIVEN("a metric whose serialization fails")
+        {
+            class FailingMetric : public Metric
+            {
+            public:
+                FailingMetric() : Metric("failing", "used for tests", MetricType::Gauge) {}
+
+                virtual void serialize(MetricSerializer&) const override
+                {
+                    throw std::runtime_error("serialization failed");
+                }
+            };
+            std::shared_ptr<CounterMetric> counter = std::make_shared<CounterMetric>("a_total", "used for tests");
+            std::shared_ptr<FailingMetric> failing = std::make_shared<FailingMetric>();
+            const MetricsSnapshot metrics = {{counter->get_name(), counter}, {failing->get_name(), failing}};
+
+            THEN("serializing it from several threads forwards the exception")
+            {
+                std::string buffer;
+                REQUIRE_THROWS_AS(TextSerializer(4).serialize(buffer, metrics), std::runtime_error);
+            }
+        }
+    }
+
+    SCENARIO("callback metrics", "[CallbackCollector]")
+    {
+        GIVEN("metrics read by callbacks")
+        {
+            std::atomic<int> queue_depth(3);
+            std::atomic<int> calls(0);
+            std::shared_ptr<CallbackGaugeMetric> gauge = std::make_shared<CallbackGaugeMetric>("queue_depth", "used for tests",
+                [&](){calls++; return static_cast<double>(queue_depth.load());});
+            std::shared_ptr<CallbackCounterMetric> counter = std::make_shared<CallbackCounterMetric>("jobs_total", "used for tests",
+                [](){return 42.0;});
+            Registry registry;
+            registry.register_metric(gauge);
+            registry.register_metric(counter);
+            REQUIRE(calls == 0);
+
+            WHEN("they are serialized")
+            {
+                queue_depth = 5;
+                std::string buffer;
+                TextSerializer().serialize(buffer, *registry.snapshot());
+
+                THEN("callbacks are called once and give the values")
+                {
+                    REQUIRE(calls == 1);
+                    REQUIRE(buffer ==
+                        "# HELP jobs_total used for tests\n"
+                        "# TYPE jobs_total counter\n"
+                        "jobs_total 42\n"
+                        "# HELP queue_depth used for tests\n"
+                        "# TYPE queue_depth gauge\n"
+                        "queue_depth 5\n");
+                }
+            }
+
+            THEN("an empty callback is rejected")
+                REQUIRE_THROWS_AS(CallbackGaugeMetric("g", "used for tests", std::function<double()>()), std::invalid_argument);
+        }
+
+        GIVEN("a collector building a family on each collection")
+        {
+            std::vector<int> pools = {2, 7};
+            std::shared_ptr<CallbackCollector> collector = std::make_shared<CallbackCollector>([&pools](){
+                std::shared_ptr<GaugeFamily> sizes = std::make_shared<GaugeFamily>("pool_size", "used for tests", std::set<std::string>{"pool"});
+                for(std::size_t i = 0; i < pools.size(); i++)
+                {
+                    sizes->with_labels(std::to_string(i))->set(pools[i]);
+                }
+                return std::vector<std::shared_ptr<Metric>>{sizes, nullptr};
+            });
+
+            WHEN("it is collected")
+            {
+                pools[1] = 8;
+                std::map<std::string, std::weak_ptr<Metric>> metrics;
+                collector->collect(metrics);
+                std::string buffer;
+                TextSerializer().serialize(buffer, metrics);
+
+                THEN("the collected metrics are alive and hold the current state")
+                {
+                    REQUIRE(metrics.size() == 1);
+                    REQUIRE(buffer ==
+                        "# HELP pool_size used for tests\n"
+                        "# TYPE pool_size gauge\n"
+                        "pool_size{pool=\"0\"} 2\n"
+                        "pool_size{pool=\"1\"} 8\n");
+                }
+            }
+
+            THEN("its snapshots are built anew")
+                REQUIRE(collector->snapshot() != collector->snapshot());
+        }
+    }
+
+    SCENARIO("self metrics", "[SelfMetrics]")
+    {
+        GIVEN("self metrics of a registry holding a family")
+        {
+            std::shared_ptr<Registry> registry = std::make_shared<Registry>();
+            std::shared_ptr<CounterFamily> family = std::make_shared<CounterFamily>("requests_total", "used for tests", std::set<std::string>{"code"});
+            registry->register_metric(family);
+            registry->register_metric(std::make_shared<GaugeMetric>("g", "used for tests"));
+            std::shared_ptr<SelfMetrics> self_metrics = std::make_shared<SelfMetrics>(registry);
+            family->with_labels("200")->inc();
+            family->with_labels("404")->inc();
+            family->with_labels("200")->inc();
+
+            THEN("the family stats count its children and memory")
+            {
+                const MetricStats stats = family->stats();
+                REQUIRE(stats.family);
+                REQUIRE(stats.children == 2);
+                REQUIRE(stats.children_created == 2);
+                REQUIRE(stats.lock_contentions == 0);
+                REQUIRE(stats.memory_bytes >= arena_min_chunk_size);
+                REQUIRE_FALSE(GaugeMetric("g", "used for tests").stats().family);
+            }
+
+            WHEN("a scrape is recorded and the self metrics are serialized")
+            {
+                self_metrics->record_scrape(0.002, 100);
+                std::string buffer;
+                TextSerializer().serialize(buffer, *self_metrics->snapshot());
+
+                THEN("they expose the scrape and the families of the registry alone")
+                {
+                    REQUIRE(buffer.find("\noura_prometheus_family_series{family=\"requests_total\"} 2\n") != std::string::npos);
+                    REQUIRE(buffer.find("\noura_prometheus_family_children_created_total{family=\"requests_total\"} 2\n") != std::string::npos);
+                    REQUIRE(buffer.find("\noura_prometheus_family_lock_contentions_total{family=\"requests_total\"} 0\n") != std::string::npos);
+                    REQUIRE(buffer.find("\noura_prometheus_family_memory_bytes{family=\"requests_total\"} ") != std::string::npos);
+                    REQUIRE(buffer.find("family=\"g\"") == std::string::npos);
+                    REQUIRE(buffer.find("\noura_prometheus_registry_lock_contentions_total 0\n") != std::string::npos);
+                    REQUIRE(buffer.find("\noura_prometheus_scrape_duration_seconds_bucket{le=\"0.005\"} 1\n") != std::string::npos);
+                    REQUIRE(buffer.find("\noura_prometheus_scrape_serialized_bytes_total 100\n") != std::string::npos);
+                }
+            }
+
+            WHEN("children are created between collections")
+            {
+                self_metrics->snapshot();
+                family->with_labels("500")->inc();
+                std::string buffer;
+                TextSerializer().serialize(buffer, *self_metrics->snapshot());
+
+                THEN("counters follow the totals of the family")
+                    REQUIRE(buffer.find("\noura_prometheus_family_children_created_total{family=\"requests_total\"} 3\n") != std::string::npos);
+            }
+
+            THEN("a null registry is rejected")
+                REQUIRE_THROWS_AS(SelfMetrics(nullptr), std::invalid_argument);
+        }
+    }
+
+    SCENARIO("OpenMetrics serialization", "[OpenMetricsSerializer]")
+    {
+        GIVEN("some metrics")
+        {
+            std::shared_ptr<CounterMetric> counter = std::make_shared<CounterMetric>("requests_total", "used for \"tests\"");
+            counter->add(3);
+            std::shared_ptr<GaugeMetric> gauge = std::make_shared<GaugeMetric>("temperature", "used for tests", 21.5);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{counter->get_name(), counter}, {gauge->get_name(), gauge}};
+
+            WHEN("they are serialized")
+            {
+                std::string buffer;
+                OpenMetricsSerializer().serialize(buffer, metrics);
+
+                THEN("counters samples are suffixed and the exposition ends with EOF")
+                {
+                    const std::string created = "requests_created " + format_double(counter->created()) + "\n";
+                    REQUIRE(buffer ==
+                        "# TYPE requests counter\n"
+                        "# HELP requests used for \\\"tests\\\"\n"
+                        "requests_total 3\n" + created +
+                        "# TYPE temperature gauge\n"
+                        "# HELP temperature used for tests\n"
+                        "temperature 21.5\n"
+                        "# EOF\n");
+                }
+            }
+        }
+
+        GIVEN("a summary family")
+        {
+            std::shared_ptr<SummaryFamily> f = std::make_shared<SummaryFamily>("latency_seconds", "used for tests", std::set<std::string>{"path"}, std::set<double>{});
+            std::shared_ptr<Summary> summary = f->with_labels("/");
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{f->get_name(), f}};
+
+            WHEN("it is serialized")
+            {
+                std::string buffer;
+                OpenMetricsSerializer().serialize(buffer, metrics);
+
+                THEN("each child has a labelled _created sample")
+                    REQUIRE(buffer.find("\nlatency_seconds_created{path=\"/\"} " + format_double(summary->created()) + "\n") != std::string::npos);
+            }
+        }
+    }
+
+    SCENARIO("exemplars", "[Exemplar]")
+    {
+        GIVEN("a counter and a histogram with exemplars")
+        {
+            std::shared_ptr<CounterMetric> counter = std::make_shared<CounterMetric>("requests_total", "used for tests");
+            std::shared_ptr<HistogramMetric> histogram = std::make_shared<HistogramMetric>("latency_seconds", "used for tests", std::set<double>{0.1, 1});
+            Exemplar exemplar;
+            REQUIRE_FALSE(counter->exemplar(exemplar));
+            const std::string trace_id = "4bf92f3577b34da6a3ce929d0e0e4736";
+            counter->inc({{"trace_id", trace_id}});
+            counter->add(2, {{"trace_id", "a\"b"}, {"span_id", "1"}});
+            histogram->observe(0.5, {{"trace_id", trace_id}});
+            histogram->observe(0.05);
+
+            THEN("the latest exemplar of each is kept")
+            {
+                REQUIRE(counter->get() == 3);
+                REQUIRE(counter->exemplar(exemplar));
+                REQUIRE(exemplar.labels == "trace_id=\"a\\\"b\",span_id=\"1\"");
+                REQUIRE(exemplar.value == 2);
+                REQUIRE(exemplar.timestamp == Approx(unix_time()).margin(60));
+                REQUIRE_FALSE(histogram->exemplar(0, exemplar));
+                REQUIRE(histogram->exemplar(1, exemplar));
+                REQUIRE(exemplar.labels == "trace_id=\"" + trace_id + "\"");
+                REQUIRE(exemplar.value == 0.5);
+            }
+
+            THEN("they are written by the OpenMetrics serializer only")
+            {
+                std::map<std::string, std::weak_ptr<Metric>> metrics = {{counter->get_name(), counter}, {histogram->get_name(), histogram}};
+                std::string open_metrics;
+                OpenMetricsSerializer().serialize(open_metrics, metrics);
+                std::string text;
+                TextSerializer().serialize(text, metrics);
+                REQUIRE(histogram->exemplar(1, exemplar));
+                const std::string suffix = " # {" + exemplar.labels + "} 0.5 " + format_double(exemplar.timestamp) + "\n";
+                REQUIRE(open_metrics.find("\nlatency_seconds_bucket{le=\"1\"} 2" + suffix) != std::string::npos);
+                REQUIRE(open_metrics.find("\nlatency_seconds_bucket{le=\"0.1\"} 1\n") != std::string::npos);
+                REQUIRE(open_metrics.find("\nrequests_total 3 # {trace_id=\"a\\\"b\",span_id=\"1\"} 2 ") != std::string::npos);
+                REQUIRE(text.find(" # {") == std::string::npos);
+            }
+
+            THEN("invalid exemplars are rejected")
+            {
+                REQUIRE_THROWS_AS(counter->inc({{"0trace", "x"}}), std::invalid_argument);
+                REQUIRE_THROWS_AS(counter->inc({{"trace_id", std::string(200, 'x')}}), std::invalid_argument);
+            }
+
+            WHEN("exemplars are sampled")
+            {
+                CounterMetric sampled("sampled_total", "used for tests");
+                for(int i = 0; i < 9; i++)
+                {
+                    sampled.inc({{"i", std::to_string(i)}}, 10);
+                }
+                bool recorded = sampled.exemplar(exemplar);
+                for(int i = 9; i < 20 && !recorded; i++)
+                {
+                    sampled.inc({{"i", std::to_string(i)}}, 10);
+                    recorded = sampled.exemplar(exemplar);
+                }
+                THEN("one in N is recorded")
+                {
+                    REQUIRE(recorded);
+                    REQUIRE(sampled.get() <= 20);
+                }
+            }
+
+            WHEN("exemplars of two metrics are sampled in turn")
+            {
+                CounterMetric first("first_total", "used for tests");
+                CounterMetric second("second_total", "used for tests");
+                for(int i = 0; i < 4; i++)
+                {
+                    first.inc({{"i", std::to_string(i)}}, 2);
+                    second.inc({{"i", std::to_string(i)}}, 2);
+                }
+                THEN("each counts its own calls")
+                {
+                    REQUIRE(first.exemplar(exemplar));
+                    REQUIRE(exemplar.labels == "i=\"3\"");
+                    REQUIRE(second.exemplar(exemplar));
+                    REQUIRE(exemplar.labels == "i=\"3\"");
+                }
+            }
+        }
+
+        GIVEN("an exemplar slot written and read concurrently")
+        {
+            ExemplarSlot slot;
+            std::atomic<bool> stop(false);
+            std::thread writer([&](){
+                for(int i = 0; !stop; i++)
+                {
+                    const std::string value = std::to_string(i);
+                    slot.record({{"a", value}, {"b", value}}, i);
+                }
+            });
+            bool consistent = true;
+            Exemplar exemplar;
+            for(int i = 0; i < 10000; i++)
+            {
+                if(slot.load(exemplar))
+                {
+                    const std::string value = format_double(exemplar.value);
+                    consistent = consistent && exemplar.labels == "a=\"" + value + "\",b=\"" + value + "\"";
+                }
+            }
+            stop = true;
+            writer.join();
+
+            THEN("reads never see a partly written exemplar")
+                REQUIRE(consistent);
+        }
+    }
+
+    SCENARIO("protobuf serialization", "[ProtobufSerializer]")
+    {
+        GIVEN("a gauge")
+        {
+            std::shared_ptr<GaugeMetric> gauge = std::make_shared<GaugeMetric>("g", "h", 1.5);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{gauge->get_name(), gauge}};
+
+            WHEN("it is serialized")
+            {
+                std::string buffer;
+                ProtobufSerializer().serialize(buffer, metrics);
+
+                THEN("the buffer holds a size delimited MetricFamily message")
+                {
+                    const std::string expected(
+                        "\x15"                                          // family size
+                        "\x0a\x01g\x12\x01h\x18\x01"                    // name, help, type
+                        "\x22\x0b\x12\x09\x09\x00\x00\x00\x00\x00\x00\xf8\x3f", // metric, gauge, value
+                        22);
+                    REQUIRE(buffer == expected);
+                }
+            }
+        }
+
+        GIVEN("a native histogram")
+        {
+            std::shared_ptr<NativeHistogramMetric> h = std::make_shared<NativeHistogramMetric>("h", "", 0);
+            h->observe(1);
+            h->observe(2);
+            h->observe(8);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{h->get_name(), h}};
+
+            WHEN("it is serialized")
+            {
+                std::string buffer;
+                ProtobufSerializer().serialize(buffer, metrics);
+
+                THEN("its buckets are written as spans and deltas")
+                {
+                    // Buckets 0, 1 and 3: spans {0, 2} and {1, 1}, deltas 1, 0, 0
+                    REQUIRE(buffer.find(std::string("\x62\x04\x08\x00\x10\x02\x62\x04\x08\x02\x10\x01\x6a\x03\x02\x00\x00", 17)) != std::string::npos);
+                    // Schema 0
+                    REQUIRE(buffer.find(std::string("\x28\x00\x31", 3)) != std::string::npos);
+                }
+            }
+        }
+    }
+
+    SCENARIO("negotiate_format calls", "[Exposer]")
+    {
+        REQUIRE(negotiate_format("") == ExpositionFormat::Text);
+        REQUIRE(negotiate_format("text/plain;version=0.0.4") == ExpositionFormat::Text);
+        REQUIRE(negotiate_format("application/openmetrics-text;version=1.0.0,text/plain;version=0.0.4;q=0.5") == ExpositionFormat::OpenMetrics);
+        REQUIRE(negotiate_format("text/plain;q=0.5,application/openmetrics-text;q=0.9") == ExpositionFormat::OpenMetrics);
+        REQUIRE(negotiate_format("application/vnd.google.protobuf;proto=io.prometheus.client.metricfamily;encoding=delimited,*/*;q=0.1") == ExpositionFormat::Protobuf);
+        REQUIRE(negotiate_format("application/vnd.google.protobuf;proto=io.prometheus.client.metricfamily;encoding=text,*/*;q=0.1") == ExpositionFormat::Text);
+        REQUIRE(negotiate_format("application/json") == ExpositionFormat::Text);
+        REQUIRE(negotiate_format("text/plain;q=0,application/openmetrics-text;q=0.1,*/*") == ExpositionFormat::OpenMetrics);
+        REQUIRE(negotiate_format("text/plain;q=0.5,application/openmetrics-text;q=0.5") == ExpositionFormat::Text);
+
+        bool acceptable = false;
+        REQUIRE(negotiate_format("application/openmetrics-text;q=0,*/*;q=0.2", acceptable) == ExpositionFormat::Text);
+        REQUIRE(acceptable);
+        REQUIRE(negotiate_format("application/json", acceptable) == ExpositionFormat::Text);
+        REQUIRE(acceptable);
+        negotiate_format("*/*;q=0", acceptable);
+        REQUIRE_FALSE(acceptable);
+        negotiate_format("application/json,text/plain;q=0,*/*;q=0.5", acceptable);
+        REQUIRE_FALSE(acceptable);
+    }
+
+    SCENARIO("accepts_encoding calls", "[Exposer]")
+    {
+        REQUIRE(accepts_encoding("gzip", "gzip"));
+        REQUIRE(accepts_encoding("deflate,gzip;q=0.5", "gzip"));
+        REQUIRE(accepts_encoding("*", "gzip"));
+        REQUIRE_FALSE(accepts_encoding("gzip;q=0", "gzip"));
+        REQUIRE_FALSE(accepts_encoding("deflate,br", "gzip"));
+        REQUIRE_FALSE(accepts_encoding("", "gzip"));
+    }
+
+    // Sends request on a connected socket and returns the whole HTTP response
+    std::string http_exchange(const int fd, const std::string& request)
+    {
+        REQUIRE(::send(fd, request.data(), request.size(), 0) == static_cast<ssize_t>(request.size()));
+        std::string response;
+        char chunk[4096];
+        while(true)
+        {
+            const std::size_t headers_end = response.find("\r\n\r\n");
+            if(headers_end != std::string::npos)
+            {
+                const std::size_t length = response.find("Content-Length: ");
+                const std::size_t content_length = std::stoul(response.substr(length + 16));
+                if(response.size() >= headers_end + 4 + content_length)
+                {
+                    return response;
+                }
+            }
+            const ssize_t size = ::read(fd, chunk, sizeof(chunk));
+            if(size <= 0)
+            {
+                return response;
+            }
+            response.append(chunk, static_cast<std::size_t>(size));
+        }
+    }
+
+    SCENARIO("metrics exposition over HTTP", "[Exposer]")
+    {
+        GIVEN("an exposer serving a registry")
+        {
+            std::shared_ptr<Registry> registry = std::make_shared<Registry>();
+            std::shared_ptr<CounterMetric> counter = std::make_shared<CounterMetric>("my_counter", "used for tests");
+            counter->inc();
+            registry->register_metric(counter);
+            Exposer exposer(0, "127.0.0.1");
+            exposer.register_collectable(registry);
+
+            const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(exposer.port());
+            ::inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+            REQUIRE(::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+
+            WHEN("metrics are scraped twice on a kept alive connection")
+            {
+                const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                const std::string first_response = http_exchange(fd, request);
+                counter->inc();
+                const std::string second_response = http_exchange(fd, request);
+
+                THEN("each response holds the current metrics")
+                {
+                    REQUIRE(first_response.find("HTTP/1.1 200 OK\r\n") == 0);
+                    REQUIRE(first_response.find("\r\nVary: Accept") != std::string::npos);
+                    REQUIRE(first_response.find("\r\n\r\n# HELP my_counter used for tests\n# TYPE my_counter counter\nmy_counter 1\n") != std::string::npos);
+                    REQUIRE(second_response.find("\nmy_counter 2\n") != std::string::npos);
+                }
+            }
+
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+            WHEN("metrics are scraped with gzip accepted")
+            {
+                const std::string response = http_exchange(fd, "GET /metrics HTTP/1.1\r\nAccept-Encoding: deflate, gzip;q=0.8\r\n\r\n");
+                const std::string body = response.substr(response.find("\r\n\r\n") + 4);
+
+                THEN("the response is gzip compressed")
+                {
+                    REQUIRE(response.find("Content-Encoding: gzip\r\n") != std::string::npos);
+                    z_stream stream = z_stream();
+                    REQUIRE(inflateInit2(&stream, 15 + 16) == Z_OK);
+                    char text[4096];
+                    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(body.data()));
+                    stream.avail_in = static_cast<uInt>(body.size());
+                    stream.next_out = reinterpret_cast<Bytef*>(text);
+                    stream.avail_out = sizeof(text);
+                    REQUIRE(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+                    REQUIRE(std::string(text, sizeof(text) - stream.avail_out) == "# HELP my_counter used for tests\n# TYPE my_counter counter\nmy_counter 1\n");
+                    inflateEnd(&stream);
+                }
+            }
+#endif
+
+            WHEN("metrics are scraped in the OpenMetrics format")
+            {
+                const std::string response = http_exchange(fd, "GET /metrics HTTP/1.1\r\nAccept: application/openmetrics-text; version=1.0.0\r\n\r\n");
+
+                THEN("the response is an OpenMetrics exposition")
+                {
+                    REQUIRE(response.find("Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n") != std::string::npos);
+                    REQUIRE(response.find("\nmy_counter_total 1\n") != std::string::npos);
+                    REQUIRE(response.substr(response.size() - 6) == "# EOF\n");
+                }
+            }
+
+            WHEN("metrics are scraped twice within the responses sharing window")
+            {
+                exposer.share_responses(std::chrono::hours(1));
+                const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                const std::string first_response = http_exchange(fd, request);
+                counter->inc();
+                const std::string second_response = http_exchange(fd, request);
+                const std::string open_metrics_response = http_exchange(fd, "GET /metrics HTTP/1.1\r\nAccept: application/openmetrics-text\r\n\r\n");
+
+                THEN("the second scrape gets the response of the first one, other formats are rendered")
+                {
+                    REQUIRE(first_response.find("\nmy_counter 1\n") != std::string::npos);
+                    REQUIRE(second_response == first_response);
+                    REQUIRE(open_metrics_response.find("\nmy_counter_total 2\n") != std::string::npos);
+                }
+            }
+
+            WHEN("metrics are scraped with text caching enabled")
+            {
+                exposer.cache_text_serializations(true);
+                const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                const std::string first_response = http_exchange(fd, request);
+                counter->inc();
+                const std::string second_response = http_exchange(fd, request);
+
+                THEN("each response holds the current metrics")
+                {
+                    REQUIRE(first_response.find("\nmy_counter 1\n") != std::string::npos);
+                    REQUIRE(second_response.find("\nmy_counter 2\n") != std::string::npos);
+                }
+            }
+
+            WHEN("metrics are scraped with self metrics enabled")
+            {
+                std::shared_ptr<SelfMetrics> self_metrics = std::make_shared<SelfMetrics>(registry);
+                exposer.enable_self_metrics(self_metrics);
+                const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                http_exchange(fd, request);
+                const std::string response = http_exchange(fd, request);
+
+                THEN("the previous scrape is recorded")
+                {
+                    REQUIRE(response.find("\nmy_counter 1\n") != std::string::npos);
+                    REQUIRE(response.find("\noura_prometheus_scrape_duration_seconds_count 1\n") != std::string::npos);
+                }
+            }
+
+            WHEN("pipelined requests are sent along with the end of the connection input")
+            {
+                const std::string requests = "GET /metrics HTTP/1.1\r\n\r\nGET /other HTTP/1.1\r\n\r\n";
+                REQUIRE(::send(fd, requests.data(), requests.size(), 0) == static_cast<ssize_t>(requests.size()));
+                REQUIRE(::shutdown(fd, SHUT_WR) == 0);
+                std::string responses;
+                char chunk[4096];
+                ssize_t size;
+                while((size = ::read(fd, chunk, sizeof(chunk))) > 0)
+                {
+                    responses.append(chunk, static_cast<std::size_t>(size));
+                }
+
+                THEN("both are answered before the connection is closed")
+                {
+                    REQUIRE(size == 0);
+                    REQUIRE(responses.find("HTTP/1.1 200 OK\r\n") == 0);
+                    REQUIRE(responses.find("\nmy_counter 1\n") != std::string::npos);
+                    REQUIRE(responses.find("HTTP/1.1 404 Not Found\r\n") != std::string::npos);
+                }
+            }
+
+            WHEN("a callback throws while metrics are scraped")
+            {
+                std::shared_ptr<std::atomic<bool>> failing = std::make_shared<std::atomic<bool>>(true);
+                registry->register_metric(std::make_shared<CallbackGaugeMetric>("failing_gauge", "used for tests", [failing](){
+                    if(failing->load())
+                    {
+                        throw std::runtime_error("cannot read the gauge");
+                    }
+                    return 1.0;
+                }));
+                const std::string request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+                const std::string failed_response = http_exchange(fd, request);
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+                const std::string failed_gzip_response = http_exchange(fd, "GET /metrics HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n");
+#endif
+                failing->store(false);
+                const std::string response = http_exchange(fd, request);
+
+                THEN("the scrape fails and the exposer keeps serving on the connection")
+                {
+                    REQUIRE(failed_response.find("HTTP/1.1 500 Internal Server Error\r\n") == 0);
+#if defined(OURA_PROMETHEUS_WITH_ZLIB)
+                    REQUIRE(failed_gzip_response.find("HTTP/1.1 500 Internal Server Error\r\n") == 0);
+#endif
+                    REQUIRE(response.find("HTTP/1.1 200 OK\r\n") == 0);
+                    REQUIRE(response.find("\nfailing_gauge 1\n") != std::string::npos);
+                    REQUIRE(response.find("\nmy_counter 1\n") != std::string::npos);
+                }
+            }
+
+            WHEN("every format is refused")
+            {
+                const std::string response = http_exchange(fd, "GET /metrics HTTP/1.1\r\nAccept: */*;q=0\r\n\r\n");
+                THEN("the request is not acceptable")
+                    REQUIRE(response.find("HTTP/1.1 406 Not Acceptable\r\n") == 0);
+            }
+
+            WHEN("another path is requested")
+            {
+                const std::string response = http_exchange(fd, "GET /other HTTP/1.1\r\nConnection: close\r\n\r\n");
+                THEN("it is not found and the connection is closed")
+                {
+                    REQUIRE(response.find("HTTP/1.1 404 Not Found\r\n") == 0);
+                    REQUIRE(response.find("Connection: close\r\n") != std::string::npos);
+                    char c;
+                    REQUIRE(::read(fd, &c, 1) == 0);
+                }
+            }
+
+            ::close(fd);
+        }
+    }
+
+    // Pushgateway answering the pushes it receives with the given statuses, then with 200 OK
+    class TestGateway
+    {
+    public:
+        explicit TestGateway(const std::vector<std::string>& statuses) : _statuses(statuses)
+        {
+            _fd = ::socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            ::inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+            REQUIRE(::bind(_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0);
+            REQUIRE(::listen(_fd, 16) == 0);
+            socklen_t address_size = sizeof(address);
+            ::getsockname(_fd, reinterpret_cast<sockaddr*>(&address), &address_size);
+            port = ntohs(address.sin_port);
+            _thread = std::thread([this](){
+                int connection;
+                while((connection = ::accept(_fd, nullptr, nullptr)) >= 0)
+                {
+                    std::string request;
+                    char chunk[4096];
+                    ssize_t size;
+                    while((size = ::read(connection, chunk, sizeof(chunk))) > 0)
+                    {
+                        request.append(chunk, static_cast<std::size_t>(size));
+                        const std::size_t headers_end = request.find("\r\n\r\n");
+                        const std::size_t length = request.find("Content-Length: ");
+                        if(headers_end != std::string::npos && request.size() >= headers_end + 4 + std::stoul(request.substr(length + 16)))
+                        {
+                            break;
+                        }
+                    }
+                    std::lock_guard<std::mutex> lock(_mtx);
+                    const std::string status = _statuses.empty() ? "200 OK" : _statuses.front();
+                    if(!_statuses.empty())
+                    {
+                        _statuses.erase(_statuses.begin());
+                    }
+                    const std::string response = "HTTP/1.1 " + status + "\r\nContent-Length: 0\r\n\r\n";
+                    // Assertions are only made from the test thread
+                    const ssize_t sent = ::send(connection, response.data(), response.size(), MSG_NOSIGNAL);
+                    (void)sent;
+                    ::close(connection);
+                    _requests.push_back(request);
+                }
+            });
+        }
+
+        ~TestGateway()
+        {
+            ::shutdown(_fd, SHUT_RDWR);
+            _thread.join();
+            ::close(_fd);
+        }
+
+        std::vector<std::string> requests()
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            return _requests;
+        }
+
+        // Waits for count requests, for at most 5 seconds
+        std::vector<std::string> wait_requests(const std::size_t count)
+        {
+            for(int i = 0; i < 500 && requests().size() < count; i++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            return requests();
+        }
+
+        std::uint16_t port = 0;
+
+    private:
+        int _fd;
+        std::mutex _mtx;
+        std::vector<std::string> _statuses;
+        std::vector<std::string> _requests;
+        std::thread _thread;
+    };
+
+    SCENARIO("push path segments", "[Pusher]")
+    {
+        REQUIRE(push_path_segment("job", "batch") == "job/batch");
+        REQUIRE(push_path_segment("instance", "host:80 a") == "instance/host%3A80%20a");
+        REQUIRE(push_path_segment("path", "/var/tmp") == "path@base64/L3Zhci90bXA=");
+        REQUIRE(push_path_segment("empty", "") == "empty@base64/=");
+    }
+
+    SCENARIO("metrics push to a Pushgateway", "[Pusher]")
+    {
+        GIVEN("a registry and a gateway failing the first push")
+        {
+            std::shared_ptr<Registry> registry = std::make_shared<Registry>();
+            std::shared_ptr<CounterMetric> counter = std::make_shared<CounterMetric>("processed_total", "used for tests");
+            counter->add(3);
+            registry->register_metric(counter);
+            TestGateway gateway({"503 Service Unavailable"});
+            PushOptions options;
+            options.interval = std::chrono::hours(1);
+            options.initial_backoff = std::chrono::milliseconds(10);
+            options.grouping_labels = {{"instance", "worker-1"}};
+
+            WHEN("a push is asked")
+            {
+                std::unique_ptr<Pusher> pusher(new Pusher("127.0.0.1", gateway.port, "batch", options));
+                pusher->register_collectable(registry);
+                pusher->push();
+                const std::vector<std::string> requests = gateway.wait_requests(2);
+                // The gateway records a push before the pusher reads its response
+                for(int i = 0; i < 500 && pusher->pushes_count() == 0; i++)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+
+                THEN("it is retried after the failure")
+                {
+                    REQUIRE(requests.size() == 2);
+                    REQUIRE(requests[1].find("PUT /metrics/job/batch/instance/worker-1 HTTP/1.1\r\n") == 0);
+                    REQUIRE(requests[1].find("\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n") != std::string::npos);
+                    REQUIRE(requests[1].find("\r\n\r\n# HELP processed_total used for tests\n# TYPE processed_total counter\nprocessed_total 3\n") != std::string::npos);
+                    REQUIRE(pusher->failures_count() == 1);
+                    REQUIRE(pusher->pushes_count() == 1);
+                }
+
+                THEN("the metrics are pushed once more on destruction")
+                {
+                    counter->inc();
+                    pusher.reset();
+                    const std::vector<std::string> all_requests = gateway.wait_requests(3);
+                    REQUIRE(all_requests.size() == 3);
+                    REQUIRE(all_requests[2].find("\nprocessed_total 4\n") != std::string::npos);
+                }
+            }
+
+            WHEN("a collectable throws while metrics are pushed")
+            {
+                std::shared_ptr<std::atomic<bool>> failing = std::make_shared<std::atomic<bool>>(true);
+                std::shared_ptr<CallbackCollector> collector = std::make_shared<CallbackCollector>([failing](){
+                    if(failing->load())
+                    {
+                        throw std::runtime_error("collection failed");
+                    }
+                    return std::vector<std::shared_ptr<Metric>>{};
+                });
+                std::unique_ptr<Pusher> pusher(new Pusher("127.0.0.1", gateway.port, "batch", options));
+                pusher->register_collectable(registry);
+                pusher->register_collectable(collector);
+                pusher->push();
+                for(int i = 0; i < 500 && pusher->failures_count() == 0; i++)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                const bool failed = pusher->failures_count() != 0 && gateway.requests().empty();
+                failing->store(false);
+                for(int i = 0; i < 500 && pusher->pushes_count() == 0; i++)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+
+                THEN("the push fails and is retried after a backoff")
+                {
+                    REQUIRE(failed);
+                    REQUIRE(pusher->pushes_count() == 1);
+                    REQUIRE(pusher->failures_count() >= 2);
+                    REQUIRE(gateway.requests().back().find("\nprocessed_total 3\n") != std::string::npos);
+                }
+            }
+
+            WHEN("a push is asked once no collectable is alive")
+            {
+                std::unique_ptr<Pusher> pusher(new Pusher("127.0.0.1", gateway.port, "batch", options));
+                {
+                    std::shared_ptr<Registry> destroyed_registry = std::make_shared<Registry>();
+                    pusher->register_collectable(destroyed_registry);
+                }
+                pusher->push();
+                pusher.reset();
+
+                THEN("nothing is pushed, which would delete the metrics of the group")
+                    REQUIRE(gateway.requests().empty());
+            }
+
+            THEN("an unknown job or format is rejected")
+            {
+                REQUIRE_THROWS_AS(Pusher("127.0.0.1", gateway.port, ""), std::invalid_argument);
+                PushOptions open_metrics;
+                open_metrics.format = ExpositionFormat::OpenMetrics;
+                REQUIRE_THROWS_AS(Pusher("127.0.0.1", gateway.port, "batch", open_metrics), std::invalid_argument);
+            }
+        }
+    }
+
+    SCENARIO("process metrics", "[ProcessCollector]")
+    {
+        GIVEN("a process collector")
+        {
+            std::shared_ptr<ProcessCollector> collector = std::make_shared<ProcessCollector>();
+
+            WHEN("it is collected")
+            {
+                std::shared_ptr<const MetricsSnapshot> metrics = collector->snapshot();
+                std::string buffer;
+                TextSerializer().serialize(buffer, *metrics);
+
+                THEN("it holds the standard process metrics")
+                {
+                    for(const char* name : {"process_cpu_seconds_total", "process_resident_memory_bytes", "process_virtual_memory_bytes",
+                                            "process_open_fds", "process_max_fds", "process_start_time_seconds", "process_threads"})
+                    {
+                        REQUIRE(metrics->count(name) == 1);
+                    }
+                    REQUIRE(buffer.find("\nprocess_open_fds 0\n") == std::string::npos);
+                    REQUIRE(buffer.find("\nprocess_resident_memory_bytes 0\n") == std::string::npos);
+                    const std::size_t start_time = buffer.find("\nprocess_start_time_seconds ");
+                    REQUIRE(start_time != std::string::npos);
+                    const double seconds = std::strtod(buffer.c_str() + start_time + 28, nullptr);
+                    REQUIRE(seconds <= unix_time());
+                    REQUIRE(seconds > unix_time() - 24 * 3600);
+                }
+
+                THEN("collections within the cache duration share the read")
+                    REQUIRE(collector->snapshot() == metrics);
+            }
+
+            WHEN("its open fds are counted")
+            {
+                // Entries of /proc/self/fd but the one listing it
+                std::size_t listed = 0;
+                DIR* dir = ::opendir("/proc/self/fd");
+                REQUIRE(dir != nullptr);
+                while(const dirent* entry = ::readdir(dir))
+                {
+                    listed += entry->d_name[0] != '.' ? 1 : 0;
+                }
+                ::closedir(dir);
+                std::string buffer;
+                TextSerializer().serialize(buffer, *collector->snapshot());
+
+                THEN("the fds of the collector itself are left out")
+                    REQUIRE(buffer.find("\nprocess_open_fds " + std::to_string(listed - 1 - 3) + "\n") != std::string::npos);
+            }
+        }
+
+        GIVEN("a process collector breaking cpu time down by thread, with no cache")
+        {
+            ProcessCollectorOptions options;
+            options.cache_duration = std::chrono::milliseconds(0);
+            options.per_thread_cpu = true;
+            ProcessCollector collector(options);
+
+            WHEN("it is collected")
+            {
+                std::shared_ptr<const MetricsSnapshot> metrics = collector.snapshot();
+                std::string buffer;
+                TextSerializer().serialize(buffer, *metrics);
+
+                THEN("the main thread has a series and every collection reads anew")
+                {
+                    REQUIRE(buffer.find(",tid=\"" + std::to_string(::getpid()) + "\"} ") != std::string::npos);
+                    REQUIRE(collector.snapshot() != metrics);
+                }
+            }
+
+            WHEN("it is collected in a forked child")
+            {
+                const pid_t pid = ::fork();
+                if(pid == 0)
+                {
+                    // The only thread of the child is itself
+                    std::string buffer;
+                    TextSerializer().serialize(buffer, *collector.snapshot());
+                    const bool own_thread = buffer.find(",tid=\"" + std::to_string(::getpid()) + "\"} ") != std::string::npos;
+                    const bool parent_thread = buffer.find(",tid=\"" + std::to_string(::getppid()) + "\"} ") != std::string::npos;
+                    ::_exit(own_thread && !parent_thread ? 0 : 1);
+                }
+                REQUIRE(pid > 0);
+                int status = 0;
+                REQUIRE(::waitpid(pid, &status, 0) == pid);
+
+                THEN("it reads the child's files")
+                {
+                    REQUIRE(WIFEXITED(status));
+                    REQUIRE(WEXITSTATUS(status) == 0);
+                }
+            }
+        }
+    }
+
+    SCENARIO("shared memory registry", "[SharedRegistry]")
+    {
+        GIVEN("a registry shared by two workers, merging them")
+        {
+            SharedRegistry registry(2);
+            SharedCounter requests = registry.counter("requests_total", "used for tests", {{"code", "200"}});
+            SharedGauge connections = registry.gauge("connections", "used for tests");
+            SharedHistogram latency = registry.histogram("latency_seconds", "used for tests", {0.1, 1});
+
+            WHEN("a forked worker updates its metrics along with the parent")
+            {
+                requests.inc();
+                connections.set(2);
+                latency.observe(0.05);
+                const pid_t pid = ::fork();
+                if(pid == 0)
+                {
+                    registry.set_worker(1);
+                    requests.add(2);
+                    connections.inc(3);
+                    latency.observe(0.5);
+                    latency.observe(5);
+                    ::_exit(0);
+                }
+                REQUIRE(pid > 0);
+                int status = 0;
+                REQUIRE(::waitpid(pid, &status, 0) == pid);
+                std::string buffer;
+                TextSerializer().serialize(buffer, *registry.snapshot());
+
+                THEN("collections sum the slots of both workers")
+                    REQUIRE(buffer ==
+                        "# HELP connections used for tests\n"
+                        "# TYPE connections gauge\n"
+                        "connections 5\n"
+                        "# HELP latency_seconds used for tests\n"
+                        "# TYPE latency_seconds histogram\n"
+                        "latency_seconds_bucket{le=\"0.1\"} 1\n"
+                        "latency_seconds_bucket{le=\"1\"} 2\n"
+                        "latency_seconds_bucket{le=\"+Inf\"} 3\n"
+                        "latency_seconds_sum 5.55\n"
+                        "latency_seconds_count 3\n"
+                        "# HELP requests_total used for tests\n"
+                        "# TYPE requests_total counter\n"
+                        "requests_total{code=\"200\"} 3\n");
+            }
+
+            WHEN("metrics are updated between collections")
+            {
+                requests.inc();
+                registry.snapshot();
+                registry.set_worker(1);
+                requests.inc();
+                latency.observe(0.5);
+                registry.snapshot();
+                std::string buffer;
+                TextSerializer().serialize(buffer, *registry.snapshot());
+
+                THEN("exposed values follow the shared ones")
+                {
+                    REQUIRE(registry.worker() == 1);
+                    REQUIRE(buffer.find("\nrequests_total{code=\"200\"} 2\n") != std::string::npos);
+                    REQUIRE(buffer.find("\nlatency_seconds_count 1\n") != std::string::npos);
+                }
+            }
+
+            THEN("children declared again share their slots, conflicting declarations are rejected")
+            {
+                registry.counter("requests_total", "used for tests", {{"code", "200"}}).inc();
+                std::string buffer;
+                TextSerializer().serialize(buffer, *registry.snapshot());
+                REQUIRE(buffer.find("\nrequests_total{code=\"200\"} 1\n") != std::string::npos);
+                REQUIRE_THROWS_AS(registry.gauge("requests_total", "used for tests", {{"code", "200"}}), std::invalid_argument);
+                REQUIRE_THROWS_AS(registry.counter("requests_total", "used for tests", {{"path", "/"}}), std::invalid_argument);
+                REQUIRE_THROWS_AS(registry.histogram("latency_seconds", "used for tests", {0.5}), std::invalid_argument);
+                REQUIRE_THROWS_AS(registry.set_worker(2), std::invalid_argument);
+            }
+        }
+
+        GIVEN("a registry exposing workers apart")
+        {
+            SharedRegistry registry(2, 8, SharedAggregation::PerWorker);
+            SharedCounter requests = registry.counter("requests_total", "used for tests");
+            requests.inc();
+            registry.set_worker(1);
+            requests.add(4);
+
+            THEN("each worker has its series")
+            {
+                std::string buffer;
+                TextSerializer().serialize(buffer, *registry.snapshot());
+                REQUIRE(buffer.find("\nrequests_total{worker=\"0\"} 1\nrequests_total{worker=\"1\"} 4\n") != std::string::npos);
+            }
+
+            THEN("the worker label is reserved and slots are bounded")
+            {
+                REQUIRE_THROWS_AS(registry.counter("other_total", "used for tests", {{"worker", "0"}}), std::invalid_argument);
+                REQUIRE_THROWS_AS(registry.histogram("latency_seconds", "used for tests"), std::runtime_error);
+            }
+        }
+    }
+
+    SCENARIO("summary observations", "[Summary]")
+    {
+        GIVEN("a summary with some observations")
+        {
+            Summary summary({0, 0.5, 0.99, 1});
+            for(int i = 1; i <= 1000; i++)
+            {
+                summary.observe(i);
+            }
+
+            THEN("sum and count are exact")
+            {
+                REQUIRE(summary.sum() == 500500);
+                REQUIRE(summary.count() == 1000);
+            }
+
+            THEN("quantiles are estimated within the sketch accuracy")
+            {
+                std::vector<double> estimates = summary.estimates();
+                REQUIRE(estimates.size() == 4);
+                REQUIRE(estimates[0] == Approx(1).epsilon(summary_relative_accuracy));
+                REQUIRE(estimates[1] == Approx(500).epsilon(summary_relative_accuracy));
+                REQUIRE(estimates[2] == Approx(990).epsilon(summary_relative_accuracy));
+                REQUIRE(estimates[3] == Approx(1000).epsilon(summary_relative_accuracy));
+            }
+        }
+
+        GIVEN("a summary whose observations are older than its max age")
+        {
+            Summary summary({0.5}, std::chrono::milliseconds(20), 2);
+            summary.observe(1);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+            THEN("quantiles are no longer estimated")
+            {
+                REQUIRE(std::isnan(summary.estimates()[0]));
+                REQUIRE(summary.count() == 1);
+            }
+
+            WHEN("new values are observed")
+            {
+                // The first observations may still go to the window of the latest clock read
+                for(std::uint64_t i = 0; i < summary_clock_period; i++)
+                {
+                    summary.observe(3);
+                }
+                THEN("they are estimated alone")
+                    REQUIRE(summary.estimates()[0] == Approx(3).epsilon(summary_relative_accuracy));
+            }
+        }
+
+        GIVEN("a summary observing slowly")
+        {
+            Summary summary({0.5}, std::chrono::milliseconds(40), 2);
+            for(std::uint64_t i = 0; i < summary_clock_period + summary_clock_period / 2; i++)
+            {
+                summary.observe(1);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+            WHEN("a value is observed once the window changed")
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                summary.observe(3);
+
+                THEN("it is counted in the current window")
+                    REQUIRE(summary.estimates()[0] == Approx(3).epsilon(summary_relative_accuracy));
+            }
+        }
+
+        GIVEN("a summary with a lower relative accuracy")
+        {
+            Summary summary({0.5, 0.99}, std::chrono::minutes(10), 5, 0.05);
+            for(int i = 1; i <= 1000; i++)
+            {
+                summary.observe(i);
+            }
+
+            THEN("quantiles are estimated within it")
+            {
+                std::vector<double> estimates = summary.estimates();
+                REQUIRE(estimates[0] == Approx(500).epsilon(0.05));
+                REQUIRE(estimates[1] == Approx(990).epsilon(0.05));
+            }
+        }
+
+        GIVEN("a summary observing negative or NaN values")
+        {
+            Summary summary({0.5});
+            summary.observe(-1);
+            summary.observe(std::numeric_limits<double>::quiet_NaN());
+            summary.observe(0);
+
+            THEN("they are ignored")
+            {
+                REQUIRE(summary.count() == 1);
+                REQUIRE(summary.sum() == 0);
+                REQUIRE(summary.estimates()[0] == Approx(summary_min_value).epsilon(summary_relative_accuracy));
+            }
+        }
+
+        GIVEN("wrong quantiles or label names")
+        {
+            THEN("it should raise invalid_argument exception")
+            {
+                REQUIRE_THROWS_AS(Summary({1.5}), std::invalid_argument);
+                REQUIRE_THROWS_AS(Summary({0.5}, std::chrono::minutes(10), 5, 0), std::invalid_argument);
+                REQUIRE_THROWS_AS(Summary({0.5}, std::chrono::minutes(10), 5, 1), std::invalid_argument);
+                REQUIRE_THROWS_AS(SummaryFamily("my_summary", "used for tests", {"quantile"}), std::invalid_argument);
+            }
+        }
+
+        GIVEN("a summary family")
+        {
+            std::shared_ptr<SummaryFamily> f = std::make_shared<SummaryFamily>("my_summary", "used for tests", std::set<std::string>{"l1"}, std::set<double>{0.5});
+            f->with_labels("a")->observe(2);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{f->get_name(), f}};
+
+            WHEN("it is serialized")
+            {
+                std::string buffer;
+                TextSerializer().serialize(buffer, metrics);
+
+                THEN("quantiles, sum and count are exposed")
+                {
+                    REQUIRE(buffer.find("# TYPE my_summary summary\nmy_summary{l1=\"a\",quantile=\"0.5\"} ") != std::string::npos);
+                    REQUIRE(buffer.find("\nmy_summary_sum{l1=\"a\"} 2\nmy_summary_count{l1=\"a\"} 1\n") != std::string::npos);
+                }
+            }
+        }
+    }
+
+    SCENARIO("native histogram bucket indexes", "[NativeHistogram]")
+    {
+        for(std::int32_t schema = native_histogram_min_schema; schema <= native_histogram_max_schema; schema++)
+        {
+            for(const double value : {1e-300, 1e-9, 0.001, 0.5, 1.0, 1.5, 2.0, 3.0, 1000.0, 123456.789, 1e300})
+            {
+                const std::int32_t index = native_histogram_index(value, schema);
+                REQUIRE(native_histogram_upper_bound(index - 1, schema) < value);
+                REQUIRE(value <= native_histogram_upper_bound(index, schema));
+            }
+            REQUIRE(native_histogram_index(1, schema) == 0);
+        }
+        REQUIRE(native_histogram_index(4, 0) == 2);
+        REQUIRE(native_histogram_index(4.1, 0) == 3);
+        REQUIRE(native_histogram_index(4.1, -1) == 2);
+        REQUIRE(native_histogram_index(std::nextafter(native_histogram_zero_threshold, 1), native_histogram_min_schema) == -7);
+        REQUIRE(native_histogram_index(std::numeric_limits<double>::max(), native_histogram_min_schema) == 64);
+    }
+
+    SCENARIO("native histogram observations", "[NativeHistogram]")
+    {
+        GIVEN("a native histogram with few buckets allowed")
+        {
+            NativeHistogram h(3, 4);
+            NativeHistogramSnapshot snapshot;
+
+            WHEN("values are observed in a few buckets")
+            {
+                h.observe(1);
+                h.observe(1);
+                h.observe(-1);
+                h.observe(0);
+                h.collect(snapshot);
+
+                THEN("only populated buckets are stored")
+                {
+                    REQUIRE(snapshot.schema == 3);
+                    REQUIRE(snapshot.count == 4);
+                    REQUIRE(snapshot.zero_count == 1);
+                    REQUIRE(snapshot.positive_buckets == std::vector<std::pair<std::int32_t, std::uint64_t>>{{0, 2}});
+                    REQUIRE(snapshot.negative_buckets == std::vector<std::pair<std::int32_t, std::uint64_t>>{{0, 1}});
+                }
+            }
+
+            WHEN("values spread over too many buckets")
+            {
+                for(int i = 1; i <= 100; i++)
+                {
+                    h.observe(i);
+                }
+                h.collect(snapshot);
+
+                THEN("resolution is reduced without losing observations")
+                {
+                    REQUIRE(snapshot.schema < 3);
+                    REQUIRE(snapshot.positive_buckets.size() <= 4);
+                    std::uint64_t count = 0;
+                    for(const auto& bucket : snapshot.positive_buckets)
+                    {
+                        count += bucket.second;
+                    }
+                    REQUIRE(count == 100);
+                    REQUIRE(h.sum() == 5050);
+                }
+            }
+        }
+
+        GIVEN("a native histogram allowed many buckets")
+        {
+            NativeHistogram h(3, 1000);
+            for(int i = 0; i < 300; i++)
+            {
+                h.observe(std::exp2(i / 8.0));
+                h.observe(-std::exp2(i / 8.0));
+            }
+
+            THEN("its table grows without reducing the resolution")
+            {
+                NativeHistogramSnapshot snapshot;
+                h.collect(snapshot);
+                REQUIRE(snapshot.schema == 3);
+                REQUIRE(snapshot.positive_buckets.size() == 300);
+                REQUIRE(snapshot.negative_buckets.size() == 300);
+                REQUIRE(snapshot.positive_buckets.front() == std::pair<std::int32_t, std::uint64_t>(0, 1));
+                REQUIRE(snapshot.positive_buckets.back() == std::pair<std::int32_t, std::uint64_t>(299, 1));
+            }
+        }
+
+        GIVEN("native histograms observing values over the whole double range")
+        {
+            NativeHistogram h(3, 4);
+            NativeHistogram coarse_h(native_histogram_min_schema, 1);
+            for(int k = 1; k <= 40; k++)
+            {
+                for(const double value : {std::ldexp(1, 30 * k), std::ldexp(1, -30 * k), -std::ldexp(1, 30 * k), -std::ldexp(1, -30 * k)})
+                {
+                    h.observe(value);
+                    coarse_h.observe(value);
+                }
+            }
+            for(std::int32_t index = -7; index <= 64; index++)
+            {
+                coarse_h.observe(native_histogram_upper_bound(index, native_histogram_min_schema));
+                coarse_h.observe(-native_histogram_upper_bound(index, native_histogram_min_schema));
+            }
+
+            THEN("every observation is counted at the minimum schema")
+            {
+                for(const NativeHistogram* histogram : {&h, &coarse_h})
+                {
+                    NativeHistogramSnapshot snapshot;
+                    histogram->collect(snapshot);
+                    std::uint64_t count = snapshot.zero_count;
+                    for(const auto& bucket : snapshot.positive_buckets)
+                    {
+                        count += bucket.second;
+                    }
+                    for(const auto& bucket : snapshot.negative_buckets)
+                    {
+                        count += bucket.second;
+                    }
+                    REQUIRE(snapshot.schema == native_histogram_min_schema);
+                    REQUIRE(count == histogram->count());
+                }
+            }
+        }
+
+        GIVEN("a native histogram observed from several threads")
+        {
+            NativeHistogram h(8, 8);
+            std::vector<std::thread> threads;
+            for(int i = 0; i < 4; i++)
+            {
+                threads.emplace_back([&h](){
+                    for(int j = 1; j <= 5000; j++)
+                    {
+                        h.observe(j);
+                    }
+                });
+            }
+            // Collections read the tables that replacements free
+            std::uint64_t collected_count = 0;
+            bool increasing = true;
+            for(int i = 0; i < 1000; i++)
+            {
+                NativeHistogramSnapshot snapshot;
+                h.collect(snapshot);
+                std::uint64_t count = 0;
+                for(const auto& bucket : snapshot.positive_buckets)
+                {
+                    count += bucket.second;
+                }
+                increasing = increasing && count >= collected_count;
+                collected_count = count;
+            }
+            for(auto& thread : threads)
+            {
+                thread.join();
+            }
+
+            THEN("no observation is lost by reductions")
+            {
+                REQUIRE(increasing);
+                NativeHistogramSnapshot snapshot;
+                h.collect(snapshot);
+                std::uint64_t count = 0;
+                for(const auto& bucket : snapshot.positive_buckets)
+                {
+                    count += bucket.second;
+                }
+                REQUIRE(count == 20000);
+                REQUIRE(snapshot.positive_buckets.size() <= 8);
+            }
+        }
+
+        GIVEN("a native histogram metric")
+        {
+            std::shared_ptr<NativeHistogramMetric> h = std::make_shared<NativeHistogramMetric>("my_histogram", "used for tests", 0);
+            h->observe(-3);
+            h->observe(0);
+            h->observe(1.5);
+            h->observe(2);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{h->get_name(), h}};
+
+            WHEN("it is serialized as text")
+            {
+                std::string buffer;
+                TextSerializer().serialize(buffer, metrics);
+
+                THEN("populated buckets are exposed as classic buckets")
+                    REQUIRE(buffer ==
+                        "# HELP my_histogram used for tests\n"
+                        "# TYPE my_histogram histogram\n"
+                        "my_histogram_bucket{le=\"" + format_double(std::nextafter(-2.0, -3.0)) + "\"} 1\n"
+                        "my_histogram_bucket{le=\"" + format_double(native_histogram_zero_threshold) + "\"} 2\n"
+                        "my_histogram_bucket{le=\"2\"} 4\n"
+                        "my_histogram_bucket{le=\"+Inf\"} 4\n"
+                        "my_histogram_sum 0.5\n"
+                        "my_histogram_count 4\n");
+            }
+        }
+
+        GIVEN("a native histogram observing negative bucket bounds")
+        {
+            std::shared_ptr<NativeHistogramMetric> h = std::make_shared<NativeHistogramMetric>("my_histogram", "used for tests", 0);
+            // -1 is in [-1, -0.5), -0.5 in [-0.5, -0.25)
+            h->observe(-1);
+            h->observe(-0.5);
+            std::map<std::string, std::weak_ptr<Metric>> metrics = {{h->get_name(), h}};
+
+            WHEN("it is serialized as text")
+            {
+                std::string buffer;
+                TextSerializer().serialize(buffer, metrics);
+
+                THEN("each bucket counts the observations lower or equal to its le")
+                    REQUIRE(buffer.find(
+                        "my_histogram_bucket{le=\"" + format_double(std::nextafter(-0.5, -1.0)) + "\"} 1\n"
+                        "my_histogram_bucket{le=\"" + format_double(std::nextafter(-0.25, -1.0)) + "\"} 2\n"
+                        "my_histogram_bucket{le=\"" + format_double(native_histogram_zero_threshold) + "\"} 2\n") != std::string::npos);
+            }
+        }
+    }
 }